@@ -0,0 +1,271 @@
+#include "benchmark.h"
+#include "frametiming.h"
+#include "pixelformat.h"
+#include "displaybackend.h"
+#include "perfcounters.h"
+#include <QJsonObject>
+#include <QJsonDocument>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const int SpriteSize = 256;
+static const int ScrollStep = 8;
+
+static qint64 cpuTimeUs()
+{
+    // all threads of the process, the render pool included
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Deterministic positions, so that every back end draws the same thing.
+static quint32 nextRandom(quint32 *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+bool Benchmark::isRequested()
+{
+    return !qEnvironmentVariableIsEmpty("DRMFBTEST_BENCHMARK")
+            && qgetenv("DRMFBTEST_BENCHMARK") != "0";
+}
+
+const char *Benchmark::workloadName(Workload workload)
+{
+    switch (workload) {
+    case FullscreenFill:
+        return "fill";
+    case SmallRects:
+        return "rects";
+    case Scroll:
+        return "scroll";
+    case Blit:
+        return "blit";
+    }
+    return "unknown";
+}
+
+Benchmark::Benchmark(const char *backend)
+    : m_backend(backend),
+      m_format(&PixelFormat::get(PixelFormat::XRGB8888))
+{
+    const Workload all[] = { FullscreenFill, SmallRects, Scroll, Blit };
+    const QByteArray selection = qgetenv("DRMFBTEST_BENCHMARK");
+    const QList<QByteArray> names = selection.split(',');
+    for (Workload w : all) {
+        if (selection == "1" || selection == "all" || names.contains(QByteArray(workloadName(w))))
+            m_workloads.append(w);
+    }
+    if (m_workloads.isEmpty())
+        qWarning("No known workloads in DRMFBTEST_BENCHMARK=%s", selection.constData());
+
+    if (qEnvironmentVariableIsSet("DRMFBTEST_BENCHMARK_FRAMES"))
+        m_framesPerWorkload = qMax(1, qEnvironmentVariableIntValue("DRMFBTEST_BENCHMARK_FRAMES"));
+
+    // The blit source lives in ordinary cached memory, like a client
+    // provided image would.
+    m_sprite.resize(SpriteSize * SpriteSize);
+    for (int y = 0; y < SpriteSize; ++y) {
+        for (int x = 0; x < SpriteSize; ++x)
+            m_sprite[y * SpriteSize + x] = 0xFF000000 | (x << 16) | (y << 8) | ((x ^ y) & 0xFF);
+    }
+    setFormat(*m_format);
+
+    if (!isFinished())
+        startWorkload();
+}
+
+void Benchmark::setFormat(const PixelFormat &format)
+{
+    // packed up front, a client would hand over its image in the right
+    // format too
+    if (&format == m_format && !m_packedSprite.isEmpty())
+        return;
+    m_format = &format;
+    m_packedSprite.resize(m_sprite.count() * format.bytesPerPixel());
+    packPixels(format, m_packedSprite.data(), m_sprite.constData(), m_sprite.count());
+}
+
+void Benchmark::startWorkload()
+{
+    qDebug("Benchmark %s: %d frames", workloadName(workload()), m_framesPerWorkload);
+    m_frame = 0;
+    m_stats.clear();
+    m_startUs = FrameTiming::monotonicUs();
+    m_cpuStartUs = cpuTimeUs();
+}
+
+QRegion Benchmark::render(int output, void *bits, int pitch, const QSize &size, bool scrolled)
+{
+    if (isFinished() || size.isEmpty())
+        return QRegion();
+    if (m_stats.count() <= output)
+        m_stats.resize(output + 1);
+    OutputStats &stats(m_stats[output]);
+    stats.size = size;
+
+    const qint64 start = FrameTiming::monotonicUs();
+    const QRect bounds(QPoint(0, 0), size);
+    const quint32 color = 0xFF000000 | ((m_frame * 3) & 0xFF) << 16 | ((m_frame * 5) & 0xFF) << 8 | ((m_frame * 7) & 0xFF);
+    quint32 seed = m_frame * 7919 + output;
+    QRegion region;
+    qint64 bytes = 0; // overlapping rects count twice, they are written twice
+    const PixelFormat &format(*m_format);
+    const int bpp = format.bytesPerPixel();
+
+    switch (workload()) {
+    case FullscreenFill:
+        fillRect(format, bits, pitch, bounds, color);
+        region = bounds;
+        bytes = qint64(size.width()) * size.height() * bpp;
+        break;
+    case SmallRects:
+        // what a typical UI update looks like: a few dozen small widgets
+        for (int i = 0; i < 64; ++i) {
+            const QRect r = QRect(nextRandom(&seed) % size.width(), nextRandom(&seed) % size.height(),
+                                  32, 32).intersected(bounds);
+            fillRect(format, bits, pitch, r, color ^ (i * 0x010203));
+            region += r;
+            bytes += qint64(r.width()) * r.height() * bpp;
+        }
+        break;
+    case Scroll: {
+        // Move everything up by a few rows, which reads back from the
+        // buffer, then fill in the exposed strip.
+        const int step = qMin(ScrollStep, size.height());
+        const QRect strip(0, size.height() - step, size.width(), step);
+        if (scrolled) {
+            fillRect(format, bits, pitch, strip, color);
+            region = strip;
+            bytes = qint64(size.width()) * step * bpp;
+            break;
+        }
+        // Source and destination overlap, which the copy kernels do not
+        // allow, so row by row, top down: every row is read before it is
+        // written over.
+        uchar *p = static_cast<uchar *>(bits);
+        const size_t rowBytes = size_t(size.width()) * bpp;
+        for (int y = 0; y + step < size.height(); ++y)
+            memmove(p + size_t(y) * pitch, p + size_t(y + step) * pitch, rowBytes);
+        fillRect(format, bits, pitch, strip, color);
+        region = bounds;
+        bytes = qint64(size.width()) * size.height() * bpp;
+        break;
+    }
+    case Blit:
+        for (int i = 0; i < 16; ++i) {
+            const QRect r = QRect(nextRandom(&seed) % size.width(), nextRandom(&seed) % size.height(),
+                                  SpriteSize, SpriteSize).intersected(bounds);
+            uchar *dst = static_cast<uchar *>(bits) + r.y() * pitch + r.x() * bpp;
+            copyRect(format, dst, pitch, m_packedSprite.constData(), SpriteSize * bpp,
+                     QRect(0, 0, r.width(), r.height()));
+            region += r;
+            bytes += qint64(r.width()) * r.height() * bpp;
+        }
+        break;
+    }
+
+    stats.renderUs += FrameTiming::monotonicUs() - start;
+    stats.bytes += bytes;
+    return region;
+}
+
+bool Benchmark::frameDone()
+{
+    if (isFinished())
+        return false;
+    if (++m_frame < m_framesPerWorkload)
+        return false;
+    m_endUs = FrameTiming::monotonicUs();
+    m_cpuEndUs = cpuTimeUs();
+    return true;
+}
+
+void Benchmark::report(int output, const QString &outputName, const FrameTiming *timing, const PerfStats *perf)
+{
+    const OutputStats stats = m_stats.value(output);
+    const double seconds = qMax<qint64>(1, m_endUs - m_startUs) / 1000000.0;
+
+    QJsonObject result;
+    result.insert(QStringLiteral("backend"), QString::fromLatin1(m_backend));
+    result.insert(QStringLiteral("output"), outputName);
+    result.insert(QStringLiteral("workload"), QString::fromLatin1(workloadName(workload())));
+    result.insert(QStringLiteral("width"), stats.size.width());
+    result.insert(QStringLiteral("height"), stats.size.height());
+    result.insert(QStringLiteral("format"), QString::fromLatin1(m_format->name));
+    result.insert(QStringLiteral("frames"), m_frame);
+    result.insert(QStringLiteral("fps"), m_frame / seconds);
+    result.insert(QStringLiteral("bandwidth_mbps"),
+                  stats.renderUs ? stats.bytes / double(stats.renderUs) : 0.0); // bytes per us is MB/s
+    result.insert(QStringLiteral("cpu_ms_per_frame"), (m_cpuEndUs - m_cpuStartUs) / 1000.0 / qMax(1, m_frame));
+    const bool hasFlips = timing && timing->submitLatency().count();
+    result.insert(QStringLiteral("flip_latency_p50_ms"),
+                  hasFlips ? timing->submitLatency().percentile(50) / 1000.0 : -1.0);
+    result.insert(QStringLiteral("flip_latency_p99_ms"),
+                  hasFlips ? timing->submitLatency().percentile(99) / 1000.0 : -1.0);
+    if (perf && perf->frames())
+        result.insert(QStringLiteral("perf"), perf->toJson());
+
+    fputs(QJsonDocument(result).toJson(QJsonDocument::Compact).constData(), stdout);
+    fputc('\n', stdout);
+    fflush(stdout);
+}
+
+void Benchmark::nextWorkload()
+{
+    ++m_current;
+    if (!isFinished())
+        startWorkload();
+}
+
+bool Benchmark::renderFrame(DisplayBackend *backend)
+{
+    // Only what the workload wrote counts. What the buffer is behind on is
+    // cleared first and not counted, the workloads that do not cover the
+    // screen would show whatever a new or recycled buffer held there.
+    bool rendered = false;
+    for (int i = 0; i < backend->outputCount(); ++i) {
+        Surface surface;
+        if (!backend->beginFrame(i, &surface))
+            continue;
+        // Only once there is a surface, the rows that come in are painted
+        // in this frame. Charged to it like the drawing, it can copy a
+        // screenful.
+        bool scrolled = false;
+        qint64 scrollUs = 0;
+        if (!isFinished() && workload() == Scroll && DisplayBackend::isScrollRequested()) {
+            const qint64 start = FrameTiming::monotonicUs();
+            scrolled = backend->scroll(i, qMin(ScrollStep, surface.size.height()));
+            scrollUs = FrameTiming::monotonicUs() - start;
+            if (scrolled && !backend->beginFrame(i, &surface))
+                continue;
+        }
+        setFormat(*surface.format);
+        for (const QRect &rect : surface.behind)
+            fillRect(*surface.format, surface.bits, surface.pitch, rect, 0);
+        backend->endFrame(i, render(i, surface.bits, surface.pitch, surface.size, scrolled));
+        if (i < m_stats.count())
+            m_stats[i].renderUs += scrollUs;
+        rendered = true;
+    }
+    if (!rendered)
+        return !isFinished();
+    backend->swapBuffers();
+
+    if (frameDone()) {
+        for (int i = 0; i < backend->outputCount(); ++i) {
+            FrameTiming *timing = backend->timing(i);
+            PerfStats *perf = backend->perfStats(i);
+            report(i, backend->outputName(i), timing, perf);
+            if (timing)
+                *timing = FrameTiming();
+            if (perf)
+                *perf = PerfStats();
+        }
+        nextWorkload();
+    }
+    return !isFinished();
+}
@@ -0,0 +1,102 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QVector>
+#include <QRegion>
+#include <QSize>
+#include <QString>
+
+class FrameTiming;
+class PerfStats;
+struct PixelFormat;
+class DisplayBackend;
+
+// A fixed set of workloads that each back end can run instead of its demo
+// animation, so that fbdev and the DRM variants can be compared on the same
+// hardware. Every workload runs for a fixed number of frames, then one JSON
+// object per output is written to stdout:
+//
+// {"backend":"doublebuffer","output":"HDMI1","workload":"fill","width":1920,
+//  "height":1080,"format":"xrgb8888","frames":300,"fps":59.9,"bandwidth_mbps":1234.5,
+//  "cpu_ms_per_frame":2.1,"flip_latency_p50_ms":16.6,"flip_latency_p99_ms":16.8}
+//
+// Bandwidth is bytes written per second of time spent drawing, fps is frames
+// per second of wall time. Flip latency is -1 for back ends without page
+// flips. The log goes to stderr as usual, stdout only carries the results.
+// With DRMFBTEST_PERF, back ends that count add "perf", the counters per
+// frame of each section, see PerfStats::toJson().
+//
+// DRMFBTEST_BENCHMARK=1 (or "all") selects all workloads, or give a comma
+// separated list of fill, rects, scroll and blit. DRMFBTEST_BENCHMARK_FRAMES
+// changes the number of frames per workload from the default 300. With
+// DRMFBTEST_SCROLL=1 the scroll workload goes through DisplayBackend::scroll()
+// where the back end can, and only fills the rows that come in.
+class Benchmark
+{
+public:
+    enum Workload {
+        FullscreenFill,
+        SmallRects,
+        Scroll,
+        Blit
+    };
+
+    static bool isRequested();
+
+    explicit Benchmark(const char *backend);
+
+    bool isFinished() const { return m_current >= m_workloads.count(); }
+    Workload workload() const { return m_workloads.at(m_current); }
+    static const char *workloadName(Workload workload);
+
+    // The format of the buffers render() draws into, XRGB8888 unless set.
+    // Cheap when it does not change.
+    void setFormat(const PixelFormat &format);
+
+    // Draws the current frame of the current workload into the buffer at
+    // bits and returns the area that was written. scrolled says the back end
+    // has already moved the contents for the scroll workload.
+    QRegion render(int output, void *bits, int pitch, const QSize &size, bool scrolled = false);
+
+    // Call once per frame, after every output has been rendered. Returns
+    // true when the current workload has run all its frames.
+    bool frameDone();
+
+    // Writes the result line for one output. timing, when given, provides
+    // the flip latency, perf the counters per frame, both should only cover
+    // the current workload.
+    void report(int output, const QString &outputName, const FrameTiming *timing = nullptr,
+                const PerfStats *perf = nullptr);
+
+    void nextWorkload();
+
+    // All of the above for one frame: renders on every output of backend
+    // that can take a frame, presents, and reports and moves on when the
+    // workload is done. Returns false once there is nothing left to run.
+    bool renderFrame(DisplayBackend *backend);
+
+private:
+    struct OutputStats {
+        QSize size;
+        qint64 bytes = 0;
+        qint64 renderUs = 0;
+    };
+
+    void startWorkload();
+
+    QByteArray m_backend;
+    QVector<Workload> m_workloads;
+    int m_current = 0;
+    int m_framesPerWorkload = 300;
+    int m_frame = 0;
+    qint64 m_startUs = 0;
+    qint64 m_endUs = 0;
+    qint64 m_cpuStartUs = 0;
+    qint64 m_cpuEndUs = 0;
+    QVector<OutputStats> m_stats;
+    QVector<quint32> m_sprite;
+    const PixelFormat *m_format;
+    QByteArray m_packedSprite; // m_sprite in m_format
+};
+
+#endif
@@ -0,0 +1,39 @@
+INCLUDEPATH += $$PWD
+
+HEADERS += $$PWD/pixelkernels.h \
+    $$PWD/pixelformat.h \
+    $$PWD/tilescheduler.h \
+    $$PWD/frametiming.h \
+    $$PWD/framescheduler.h \
+    $$PWD/benchmark.h \
+    $$PWD/shadowbuffer.h \
+    $$PWD/dumbbufferpool.h \
+    $$PWD/dmabuf.h \
+    $$PWD/framecapture.h \
+    $$PWD/displaybackend.h \
+    $$PWD/demoscene.h \
+    $$PWD/scrollwindow.h \
+    $$PWD/hostmemory.h \
+    $$PWD/drmdevices.h \
+    $$PWD/perfcounters.h \
+    $$PWD/spscqueue.h \
+    $$PWD/drawlist.h \
+    $$PWD/damagetracker.h \
+    $$PWD/headlessdisplay.h
+SOURCES += $$PWD/pixelkernels.cpp \
+    $$PWD/pixelformat.cpp \
+    $$PWD/tilescheduler.cpp \
+    $$PWD/frametiming.cpp \
+    $$PWD/framescheduler.cpp \
+    $$PWD/benchmark.cpp \
+    $$PWD/shadowbuffer.cpp \
+    $$PWD/dumbbufferpool.cpp \
+    $$PWD/dmabuf.cpp \
+    $$PWD/framecapture.cpp \
+    $$PWD/demoscene.cpp \
+    $$PWD/hostmemory.cpp \
+    $$PWD/drmdevices.cpp \
+    $$PWD/perfcounters.cpp \
+    $$PWD/drawlist.cpp \
+    $$PWD/damagetracker.cpp \
+    $$PWD/headlessdisplay.cpp
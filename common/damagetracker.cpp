@@ -0,0 +1,116 @@
+#include "damagetracker.h"
+#include "shadowbuffer.h"
+#include "tilescheduler.h"
+#include <string.h>
+
+bool DamageTracker::isRequested()
+{
+    return qEnvironmentVariableIntValue("DRMFBTEST_AUTO_DAMAGE");
+}
+
+void DamageTracker::reset(const QSize &size)
+{
+    m_size = size;
+    m_columns = (size.width() + TileSize - 1) / TileSize;
+    m_rows = (size.height() + TileSize - 1) / TileSize;
+    m_hashes.fill(0, m_columns * m_rows);
+    m_wanted.fill(0, m_columns * m_rows);
+}
+
+void DamageTracker::invalidate()
+{
+    m_hashes.fill(0);
+}
+
+static inline quint64 rotate(quint64 h, int bits)
+{
+    return (h << bits) | (h >> (64 - bits));
+}
+
+// Four lanes of xor and multiply, independent so that the multiplies
+// overlap. Each step is a bijection of the lane for a given word, so a
+// tile that differs in one word always hashes differently.
+static quint64 hashTile(const uchar *p, int pitch, int bytes, int rows)
+{
+    const quint64 k = Q_UINT64_C(0x9e3779b97f4a7c15);
+    quint64 h[4] = { 1, 2, 3, 4 };
+    for (int y = 0; y < rows; ++y, p += pitch) {
+        int x = 0;
+        for (; x + 32 <= bytes; x += 32) {
+            quint64 w[4];
+            memcpy(w, p + x, sizeof(w));
+            h[0] = (h[0] ^ w[0]) * k;
+            h[1] = (h[1] ^ w[1]) * k;
+            h[2] = (h[2] ^ w[2]) * k;
+            h[3] = (h[3] ^ w[3]) * k;
+        }
+        for (; x < bytes; ++x)
+            h[0] = (h[0] ^ p[x]) * k;
+    }
+    const quint64 hash = h[0] ^ rotate(h[1], 16) ^ rotate(h[2], 32) ^ rotate(h[3], 48);
+    return hash ? hash : 1; // 0 is for not known
+}
+
+QRegion DamageTracker::detect(const ShadowBuffer &shadow, const QRegion &region, TileScheduler *scheduler)
+{
+    if (shadow.isNull() || shadow.size() != m_size)
+        reset(shadow.size());
+    if (shadow.isNull() || region.isEmpty())
+        return QRegion();
+
+    const QRect bounds(QPoint(0, 0), m_size);
+    for (const QRect &rect : region.intersected(bounds)) {
+        for (int row = rect.top() / TileSize; row <= rect.bottom() / TileSize; ++row) {
+            for (int column = rect.left() / TileSize; column <= rect.right() / TileSize; ++column)
+                m_wanted[row * m_columns + column] = 1;
+        }
+    }
+
+    // One job per row of tiles, each only touches its own entries. The
+    // vectors are detached here, not on the workers.
+    const uchar *bits = static_cast<const uchar *>(shadow.bits());
+    const int pitch = shadow.pitch();
+    const int bytesPerPixel = shadow.format().bytesPerPixel();
+    quint64 *hashes = m_hashes.data();
+    uchar *wanted = m_wanted.data();
+    const int columns = m_columns;
+    const QSize size = m_size;
+    QVector<TileScheduler::Job> jobs;
+    jobs.reserve(m_rows);
+    for (int row = 0; row < m_rows; ++row) {
+        jobs.append([bits, pitch, bytesPerPixel, hashes, wanted, columns, size, row] {
+            const int y = row * TileSize;
+            const int rows = qMin(TileSize, size.height() - y);
+            for (int column = 0; column < columns; ++column) {
+                const int i = row * columns + column;
+                if (!wanted[i])
+                    continue;
+                const int x = column * TileSize;
+                const int width = qMin(TileSize, size.width() - x);
+                const quint64 hash = hashTile(bits + size_t(y) * pitch + x * bytesPerPixel, pitch,
+                                              width * bytesPerPixel, rows);
+                wanted[i] = hashes[i] != hash;
+                hashes[i] = hash;
+            }
+        });
+    }
+    scheduler->run(jobs);
+
+    // Runs of changed tiles, row by row, which is the banding QRegion
+    // wants, and the flags are cleared for the next frame.
+    QVector<QRect> rects;
+    for (int row = 0; row < m_rows; ++row) {
+        for (int column = 0; column < m_columns; ++column) {
+            if (!wanted[row * m_columns + column])
+                continue;
+            const int first = column;
+            while (column < m_columns && wanted[row * m_columns + column])
+                wanted[row * m_columns + column++] = 0;
+            rects.append(QRect(first * TileSize, row * TileSize, (column - first) * TileSize, TileSize)
+                         .intersected(bounds));
+        }
+    }
+    QRegion changed;
+    changed.setRects(rects.constData(), rects.count());
+    return changed;
+}
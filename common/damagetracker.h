@@ -0,0 +1,44 @@
+#ifndef DAMAGETRACKER_H
+#define DAMAGETRACKER_H
+
+#include <QVector>
+#include <QSize>
+#include <QRegion>
+
+class ShadowBuffer;
+class TileScheduler;
+
+// Finds what a frame changed for clients that cannot tell, by comparing the
+// shadow buffer against the last frame tile by tile. Only a 64-bit hash of
+// each 64x64 tile is kept, not a second copy, and hashing reads cached
+// memory only, so it is much cheaper than the full-frame write to the
+// write-combined mapping it saves. The rows of tiles are hashed in parallel.
+//
+// Set DRMFBTEST_AUTO_DAMAGE=1 to have the back ends ignore the damage they
+// are given and flush only the tiles that changed. It implies
+// DRMFBTEST_SHADOW.
+class DamageTracker
+{
+public:
+    static bool isRequested();
+
+    static const int TileSize = 64;
+
+    // Forgets all hashes, the next detect() reports every tile it looks at.
+    void reset(const QSize &size);
+    void invalidate();
+
+    // Hashes the tiles of shadow that region touches and returns those that
+    // differ from the last time, clipped to the size. The hashes of the
+    // rest stay as they were.
+    QRegion detect(const ShadowBuffer &shadow, const QRegion &region, TileScheduler *scheduler);
+
+private:
+    QSize m_size;
+    int m_columns = 0;
+    int m_rows = 0;
+    QVector<quint64> m_hashes; // 0 for not known
+    QVector<uchar> m_wanted; // per tile, to be looked at or changed
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "demoscene.h"
+#include "pixelformat.h"
+
+DemoScene::DemoScene()
+    : m_scroll(DisplayBackend::isScrollRequested())
+{
+}
+
+QRect DemoScene::squareRect(int frame, const QSize &outputSize)
+{
+    const int side = qMin(256, qMin(outputSize.width(), outputSize.height()));
+    const int range = outputSize.width() - side;
+    int x = range > 0 ? (frame * 8) % (2 * range) : 0;
+    if (x > range)
+        x = 2 * range - x;
+    return QRect(x, (outputSize.height() - side) / 2, side, side);
+}
+
+void DemoScene::insertOutput(int output)
+{
+    if (output >= m_frames.count()) {
+        m_frames.resize(output + 1);
+        m_squares.resize(output + 1);
+        return;
+    }
+    m_frames.insert(output, 0);
+    m_squares.insert(output, QRect());
+}
+
+void DemoScene::removeOutput(int output)
+{
+    if (output >= m_frames.count())
+        return;
+    m_frames.remove(output);
+    m_squares.remove(output);
+}
+
+QRegion DemoScene::advance(int output, const QSize &outputSize, DisplayBackend *backend)
+{
+    if (output >= m_frames.count())
+        insertOutput(output);
+    if (m_scroll) {
+        ++m_frames[output];
+        const int dy = qMin(int(ScrollStep), outputSize.height());
+        if (backend && backend->scroll(output, dy))
+            return QRect(0, outputSize.height() - dy, outputSize.width(), dy);
+        return QRect(QPoint(0, 0), outputSize);
+    }
+    const QRect square = squareRect(m_frames[output]++, outputSize);
+    QRegion damage = m_squares[output];
+    damage += square;
+    m_squares[output] = square;
+    return damage;
+}
+
+DrawList DemoScene::record(int output, const QSize &outputSize)
+{
+    DrawList list;
+    if (m_scroll) {
+        // 16 row stripes, fixed to the content as it moves up
+        const int offset = m_frames.value(output) * ScrollStep;
+        for (int y = 0; y < outputSize.height(); ) {
+            const int stripe = (y + offset) / 16;
+            const int rows = qMin(16 - (y + offset) % 16, outputSize.height() - y);
+            const int gray = (stripe * 37) & 0xff;
+            list.fill(QRect(0, y, outputSize.width(), rows), qRgb(gray, gray, gray));
+            y += rows;
+        }
+        return list;
+    }
+    list.fill(QRect(QPoint(0, 0), outputSize), 0);
+    list.fill(m_squares.value(output), color());
+    m_r += 1;
+    m_g += 2;
+    m_b += 3;
+    return list;
+}
+
+void DemoScene::paint(int output, const Surface &surface, const QRegion &region)
+{
+    QVector<TileScheduler::Job> jobs;
+    record(output, surface.size).rasterize(region, *surface.format, surface.bits, surface.pitch, &jobs);
+    for (const TileScheduler::Job &job : jobs)
+        job();
+}
@@ -0,0 +1,55 @@
+#ifndef DEMOSCENE_H
+#define DEMOSCENE_H
+
+#include <QVector>
+#include <QRect>
+#include <QRegion>
+#include <QColor>
+#include "displaybackend.h"
+#include "drawlist.h"
+
+// The demo animation of all back ends: a square bouncing horizontally across
+// the middle of each output over black, so that only a small part of the
+// screen changes from one frame to the next. Its color steps with every frame
+// rendered on any output.
+//
+// With DRMFBTEST_SCROLL=1 it is gray stripes scrolling up instead, through
+// DisplayBackend::scroll() where the back end can, so that only the rows
+// that scroll in are painted.
+class DemoScene
+{
+public:
+    DemoScene();
+
+    static QRect squareRect(int frame, const QSize &outputSize);
+    static const int ScrollStep = 4; // rows per frame
+
+    // outputs may come and go, indices are those of the back end
+    void insertOutput(int output);
+    void removeOutput(int output);
+
+    // Moves on to the next frame of output and returns what changed: where
+    // the square was and where it is now. When scrolling, backend, if given,
+    // is asked to move what is there, the surface is to be fetched after.
+    QRegion advance(int output, const QSize &outputSize, DisplayBackend *backend = nullptr);
+    int frame(int output) const { return m_frames.value(output); }
+    QRect square(int output) const { return m_squares.value(output); }
+    QRgb color() const { return (m_r << 16) | (m_g << 8) | m_b; }
+
+    // The current frame of output as draw commands, for back ends that
+    // rasterize in tiles or later, then steps the color. The damage is left
+    // to the caller, it is what advance() returned.
+    DrawList record(int output, const QSize &outputSize);
+    // Paints region of the current frame of output into surface right away,
+    // then steps the color.
+    void paint(int output, const Surface &surface, const QRegion &region);
+
+private:
+
+    bool m_scroll;
+    QVector<int> m_frames;
+    QVector<QRect> m_squares;
+    int m_r = 0, m_g = 0, m_b = 0;
+};
+
+#endif
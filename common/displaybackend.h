@@ -0,0 +1,66 @@
+#ifndef DISPLAYBACKEND_H
+#define DISPLAYBACKEND_H
+
+#include <QSize>
+#include <QRegion>
+#include <QString>
+
+class FrameTiming;
+class PerfStats;
+struct PixelFormat;
+
+// Where a frame of one output is drawn: a back buffer, the front buffer, or
+// the shadow buffer in front of either.
+struct Surface {
+    void *bits = nullptr;
+    int pitch = 0;
+    QSize size;
+    const PixelFormat *format = nullptr;
+    // What the buffer is behind on and has to be repainted on top of the
+    // frame's own damage. For single buffers and shadow buffers only the
+    // rows that scrolled in, the rest is always the last frame.
+    QRegion behind;
+};
+
+// What fbdev, DRM single buffering and DRM double/N buffering have in common,
+// so that the demo and the benchmarks draw through the same code whichever
+// one shows the result. Each main.cpp has its Device implement it, the kernel
+// interfaces are too far apart to share more than that.
+class DisplayBackend
+{
+public:
+    virtual ~DisplayBackend() { }
+
+    // DRMFBTEST_SCROLL=1 has the back ends set up for scroll(), which takes
+    // buffers twice the height of the screen on fbdev and DRM single
+    // buffering, and has the demo scroll.
+    static bool isScrollRequested() { return qEnvironmentVariableIntValue("DRMFBTEST_SCROLL") != 0; }
+
+    virtual int outputCount() const = 0;
+    virtual QString outputName(int output) const = 0;
+    virtual QSize outputSize(int output) const = 0;
+    // Flip statistics, null for back ends without flips.
+    virtual FrameTiming *timing(int output) { Q_UNUSED(output); return nullptr; }
+    // DRMFBTEST_PERF counters, null for back ends that do not count.
+    virtual PerfStats *perfStats(int output) { Q_UNUSED(output); return nullptr; }
+
+    // Hands out the surface for the next frame of output, false when there
+    // is none right now, e.g. with all buffers waiting for a flip. Can be
+    // called again for the same frame, after a scroll().
+    virtual bool beginFrame(int output, Surface *surface) = 0;
+    // damage is what the frame changed. Shadow buffers are flushed here.
+    virtual void endFrame(int output, const QRegion &damage) = 0;
+
+    // Moves the contents of output up by dy rows, down for negative dy, for
+    // the next frame. The rows that scroll in come back in the behind region
+    // of beginFrame(), and the surface may move, so call it after this one.
+    // Once beginFrame() has succeeded is best, then nothing moves for a
+    // frame that cannot be drawn. False when the back end has no cheaper
+    // way than repainting everything, nothing moved then.
+    virtual bool scroll(int output, int dy) { Q_UNUSED(output); Q_UNUSED(dy); return false; }
+    // Puts what was ended since the last call on screen, for back ends that
+    // flip.
+    virtual void swapBuffers() { }
+};
+
+#endif
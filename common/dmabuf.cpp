@@ -0,0 +1,93 @@
+#include "dmabuf.h"
+#include <QtCore/private/qcore_unix_p.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/dma-buf.h>
+#include <string.h>
+
+static bool syncDmaBuf(int fd, uint64_t flags)
+{
+    dma_buf_sync sync = { flags };
+    // interrupted waits for the fences are restarted
+    int ret;
+    do {
+        ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
+    return ret == 0;
+}
+
+static uint64_t syncFlags(DmaBufAccess::Mode mode)
+{
+    return (mode & DmaBufAccess::Read ? DMA_BUF_SYNC_READ : 0)
+            | (mode & DmaBufAccess::Write ? DMA_BUF_SYNC_WRITE : 0);
+}
+
+DmaBufAccess::DmaBufAccess(int fd, Mode mode)
+    : m_fd(fd),
+      m_mode(mode)
+{
+    if (m_fd >= 0 && !syncDmaBuf(m_fd, DMA_BUF_SYNC_START | syncFlags(m_mode)))
+        qErrnoWarning(errno, "Failed to start CPU access to DMA-BUF %d", m_fd);
+}
+
+DmaBufAccess::~DmaBufAccess()
+{
+    if (m_fd >= 0 && !syncDmaBuf(m_fd, DMA_BUF_SYNC_END | syncFlags(m_mode)))
+        qErrnoWarning(errno, "Failed to end CPU access to DMA-BUF %d", m_fd);
+}
+
+bool sendDmaBufMessage(int socket, const DmaBufMessage &message, int fd)
+{
+    iovec iov = { const_cast<DmaBufMessage *>(&message), sizeof(message) };
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent;
+    EINTR_LOOP(sent, sendmsg(socket, &msg, MSG_NOSIGNAL));
+    if (sent != ssize_t(sizeof(message))) {
+        qErrnoWarning(errno, "Failed to send DMA-BUF message");
+        return false;
+    }
+    return true;
+}
+
+bool receiveDmaBufMessage(int socket, DmaBufMessage *message, int *fd)
+{
+    *fd = -1;
+    iovec iov = { message, sizeof(*message) };
+    char control[CMSG_SPACE(sizeof(int))];
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t received;
+    EINTR_LOOP(received, recvmsg(socket, &msg, MSG_CMSG_CLOEXEC));
+    for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (received != ssize_t(sizeof(*message)) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (received < 0)
+            qErrnoWarning(errno, "Failed to receive DMA-BUF message");
+        if (*fd >= 0) {
+            qt_safe_close(*fd);
+            *fd = -1;
+        }
+        return false;
+    }
+    return true;
+}
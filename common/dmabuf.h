@@ -0,0 +1,71 @@
+#ifndef DMABUF_H
+#define DMABUF_H
+
+#include <QtGlobal>
+#include <stdint.h>
+
+// A buffer shared through a DMA-BUF fd, as passed between processes. The fd
+// is owned by whoever holds the descriptor.
+struct DmaBufDescriptor {
+    int fd = -1;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t format = 0; // DRM_FORMAT_*
+    uint32_t pitch = 0;
+    uint32_t offset = 0;
+};
+
+// Brackets CPU access to the mapping of a DMA-BUF with DMA_BUF_IOCTL_SYNC,
+// so that caches are flushed or invalidated for whatever device wrote or
+// will read the buffer. Does nothing without an fd, plain dumb buffers need
+// no syncing.
+class DmaBufAccess
+{
+public:
+    enum Mode {
+        Read = 1,
+        Write = 2,
+        ReadWrite = Read | Write
+    };
+
+    DmaBufAccess(int fd, Mode mode);
+    ~DmaBufAccess();
+
+private:
+    Q_DISABLE_COPY(DmaBufAccess)
+    int m_fd;
+    Mode m_mode;
+};
+
+// The messages on a DRMFBTEST_DMABUF_SOCKET connection, a SOCK_SEQPACKET
+// unix socket. Buffers travel as SCM_RIGHTS.
+struct DmaBufMessage {
+    enum Type : uint32_t {
+        // client: wants a scanout capable buffer of width, height and
+        // format to render into
+        Allocate = 1,
+        // server: the buffer for an Allocate, with an fd
+        Buffer,
+        // client: show the buffer with cookie. With an fd it is a buffer of
+        // the client's own, cookie is then for the Release
+        Present,
+        // server: the buffer with cookie is off screen and may be written
+        // again
+        Release
+    };
+    uint32_t type = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t format = 0;
+    uint32_t pitch = 0;
+    uint32_t offset = 0;
+    uint64_t cookie = 0;
+};
+
+// Sends message, with fd attached unless it is -1. fd stays open.
+bool sendDmaBufMessage(int socket, const DmaBufMessage &message, int fd = -1);
+// Receives one message and the fd that came with it, or -1. Returns false
+// when the peer is gone or sent something that is not a message.
+bool receiveDmaBufMessage(int socket, DmaBufMessage *message, int *fd);
+
+#endif
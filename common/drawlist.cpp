@@ -0,0 +1,25 @@
+#include "drawlist.h"
+#include "pixelformat.h"
+
+void DrawList::fill(const QRect &rect, QRgb color)
+{
+    m_commands.append(DrawCommand { rect, color });
+}
+
+void DrawList::rasterize(const QRegion &clip, const PixelFormat &format, void *bits, int pitch,
+                         QVector<TileScheduler::Job> *jobs) const
+{
+    // Front to back, each command gets what the later ones left of the clip.
+    QRegion left = clip;
+    const PixelFormat *f = &format;
+    const int bpp = format.bytesPerPixel();
+    for (int i = m_commands.count() - 1; i >= 0 && !left.isEmpty(); --i) {
+        const DrawCommand command = m_commands[i];
+        const QRegion visible = left.intersected(command.rect);
+        left -= command.rect;
+        for (const QRect &rect : visible) {
+            for (const QRect &tile : TileScheduler::horizontalTiles(rect, pitch, bpp))
+                jobs->append([f, bits, pitch, tile, command] { fillRect(*f, bits, pitch, tile, command.color); });
+        }
+    }
+}
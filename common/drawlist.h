@@ -0,0 +1,39 @@
+#ifndef DRAWLIST_H
+#define DRAWLIST_H
+
+#include <QVector>
+#include <QRect>
+#include <QRegion>
+#include <QColor>
+#include "tilescheduler.h"
+
+struct PixelFormat;
+
+struct DrawCommand {
+    QRect rect;
+    QRgb color;
+};
+
+// A frame as draw commands, recorded without touching the buffer it ends up
+// in, so that it can be made ahead of time on one thread and rasterized
+// later on others. The commands cover the whole frame in painting order,
+// damage says what changed compared to the previous list, and rasterize()
+// only draws the part that the buffer needs. Fills are all the demo needs.
+class DrawList
+{
+public:
+    void fill(const QRect &rect, QRgb color);
+
+    QRegion damage;
+
+    // Adds jobs that draw clip of the frame into bits, in tiles. Every
+    // pixel belongs to the last command that covers it and is drawn once,
+    // so the jobs can run in any order.
+    void rasterize(const QRegion &clip, const PixelFormat &format, void *bits, int pitch,
+                   QVector<TileScheduler::Job> *jobs) const;
+
+private:
+    QVector<DrawCommand> m_commands;
+};
+
+#endif
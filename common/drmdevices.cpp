@@ -0,0 +1,39 @@
+#include "drmdevices.h"
+#include <QByteArray>
+#include <xf86drm.h>
+
+static QStringList enumerateDrmDevices()
+{
+    QStringList paths;
+    const int count = drmGetDevices2(0, nullptr, 0);
+    if (count <= 0) {
+        qWarning("No DRM devices found");
+        return paths;
+    }
+    QVector<drmDevicePtr> devices(count);
+    const int found = drmGetDevices2(0, devices.data(), count);
+    for (int i = 0; i < found; ++i) {
+        // render-only devices cannot scan out
+        if (devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY))
+            paths.append(QString::fromLocal8Bit(devices[i]->nodes[DRM_NODE_PRIMARY]));
+    }
+    if (found > 0)
+        drmFreeDevices(devices.data(), found);
+    return paths;
+}
+
+QStringList requestedDrmDevices()
+{
+    const QByteArray value = qgetenv("DRMFBTEST_DEVICE");
+    if (value.isEmpty())
+        return QStringList() << QStringLiteral("/dev/dri/card0");
+    if (value == "all") {
+        const QStringList paths = enumerateDrmDevices();
+        qDebug("Found %d cards: %s", paths.count(), qPrintable(paths.join(QLatin1Char(' '))));
+        return paths;
+    }
+    QStringList paths;
+    for (const QString &path : QString::fromLocal8Bit(value).split(QLatin1Char(','), QString::SkipEmptyParts))
+        paths.append(path.trimmed());
+    return paths;
+}
@@ -0,0 +1,11 @@
+#ifndef DRMDEVICES_H
+#define DRMDEVICES_H
+
+#include <QStringList>
+
+// The cards to drive, as primary nodes. DRMFBTEST_DEVICE is a comma
+// separated list of them, or "all" for every device drmGetDevices2() finds
+// with a primary node, in bus order. The default is /dev/dri/card0.
+QStringList requestedDrmDevices();
+
+#endif
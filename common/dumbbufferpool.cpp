@@ -0,0 +1,300 @@
+#include "dumbbufferpool.h"
+#include "pixelformat.h"
+#include "headlessdisplay.h"
+#include <QtKmsSupport/private/qkmsdevice_p.h>
+#include <QtCore/private/qcore_unix_p.h>
+#include <drm_fourcc.h>
+#include <string.h>
+
+QImage DumbBuffer::image() const
+{
+    const PixelFormat *pixelFormat = PixelFormat::fromFourcc(format);
+    if (p == MAP_FAILED || !pixelFormat)
+        return QImage();
+    return wrapRect(*pixelFormat, p, pitch, QRect(0, 0, width, height));
+}
+
+DumbBufferPool::DumbBufferPool()
+{
+    if (qEnvironmentVariableIsSet("DRMFBTEST_POOL_MAX_FREE_MB"))
+        m_maxFreeBytes = qint64(qMax(0, qEnvironmentVariableIntValue("DRMFBTEST_POOL_MAX_FREE_MB"))) * 1024 * 1024;
+    m_populate = qEnvironmentVariableIntValue("DRMFBTEST_POOL_POPULATE");
+}
+
+DumbBufferPool::~DumbBufferPool()
+{
+    if (!m_free.isEmpty())
+        qWarning("Dumb buffer pool destroyed with %d buffers left", m_free.count());
+}
+
+bool DumbBufferPool::acquire(DumbBuffer *buffer, const QSize &size, uint32_t format, bool clear)
+{
+    bool reused = false;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (int i = 0; i < m_free.count(); ++i) {
+            const DumbBuffer &b(m_free.at(i));
+            if (b.width == uint32_t(size.width()) && b.height == uint32_t(size.height()) && b.format == format) {
+                *buffer = b;
+                m_free.remove(i);
+                --m_stats.free;
+                m_stats.freeBytes -= buffer->size;
+                ++m_stats.reused;
+                ++m_stats.inUse;
+                reused = true;
+                break;
+            }
+        }
+    }
+    if (!reused) {
+        // outside of the lock, so that allocations can run in parallel
+        if (!create(buffer, size, format)) {
+            destroy(buffer);
+            return false;
+        }
+        QMutexLocker locker(&m_mutex);
+        ++m_stats.created;
+        ++m_stats.inUse;
+    }
+
+    if (clear)
+        memset(buffer->p, 0, buffer->size);
+    return true;
+}
+
+void DumbBufferPool::release(DumbBuffer *buffer)
+{
+    if (!buffer->handle)
+        return;
+    if (buffer->imported) {
+        destroy(buffer);
+        return;
+    }
+    QMutexLocker locker(&m_mutex);
+    --m_stats.inUse;
+    if (buffer->p == MAP_FAILED || !buffer->fb || buffer->dmaBufFd >= 0) {
+        // half created or shared, not worth keeping
+        destroy(buffer);
+        ++m_stats.destroyed;
+    } else {
+        m_free.append(*buffer);
+        ++m_stats.free;
+        m_stats.freeBytes += buffer->size;
+        trim();
+    }
+    *buffer = DumbBuffer();
+}
+
+bool DumbBufferPool::exportBuffer(DumbBuffer *buffer)
+{
+    if (buffer->dmaBufFd >= 0)
+        return true;
+    if (m_headless) {
+        qWarning("Headless buffers cannot be shared");
+        return false;
+    }
+    if (drmPrimeHandleToFD(m_fd, buffer->handle, DRM_CLOEXEC | DRM_RDWR, &buffer->dmaBufFd) != 0) {
+        qErrnoWarning(errno, "Failed to export dumb buffer %u", buffer->handle);
+        buffer->dmaBufFd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool DumbBufferPool::importBuffer(DumbBuffer *buffer, const DmaBufDescriptor &descriptor)
+{
+    DumbBuffer &fb(*buffer);
+    fb = DumbBuffer();
+    fb.imported = true;
+    fb.dmaBufFd = descriptor.fd;
+    if (m_headless) {
+        qWarning("Not importing DMA-BUF %d without a device", descriptor.fd);
+        destroy(buffer);
+        return false;
+    }
+    fb.width = descriptor.width;
+    fb.height = descriptor.height;
+    fb.format = descriptor.format;
+    fb.pitch = descriptor.pitch;
+    const PixelFormat *pixelFormat = PixelFormat::fromFourcc(descriptor.format);
+    // one plane starting at the beginning, like the dumb buffers
+    if (!pixelFormat || !fb.width || !fb.height || fb.pitch < fb.width * pixelFormat->bytesPerPixel()
+            || descriptor.offset) {
+        qWarning("Not importing DMA-BUF %ux%u, format %08x, pitch %u", fb.width, fb.height, fb.format, fb.pitch);
+        destroy(buffer);
+        return false;
+    }
+    if (drmPrimeFDToHandle(m_fd, descriptor.fd, &fb.handle) != 0) {
+        qErrnoWarning(errno, "Failed to import DMA-BUF %d", descriptor.fd);
+        destroy(buffer);
+        return false;
+    }
+    const uint32_t handles[4] = { fb.handle, 0, 0, 0 };
+    const uint32_t pitches[4] = { fb.pitch, 0, 0, 0 };
+    const uint32_t offsets[4] = { 0, 0, 0, 0 };
+    if (drmModeAddFB2(m_fd, fb.width, fb.height, fb.format, handles, pitches, offsets, &fb.fb, 0) == -1) {
+        qErrnoWarning(errno, "Failed to add FB for DMA-BUF %d", descriptor.fd);
+        destroy(buffer);
+        return false;
+    }
+    // Not every exporter can be mapped, scanning out works regardless.
+    fb.size = uint64_t(fb.pitch) * fb.height;
+    fb.p = mmap(0, fb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fb.dmaBufFd, 0);
+    if (fb.p == MAP_FAILED)
+        qErrnoWarning(errno, "Failed to mmap DMA-BUF %d", descriptor.fd);
+    qDebug("Imported DMA-BUF %d as FB %u, %ux%u, %s", fb.dmaBufFd, fb.fb, fb.width, fb.height, pixelFormat->name);
+    return true;
+}
+
+void DumbBufferPool::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    for (DumbBuffer &b : m_free)
+        destroy(&b);
+    m_stats.destroyed += m_free.count();
+    m_free.clear();
+    m_stats.free = 0;
+    m_stats.freeBytes = 0;
+}
+
+// with m_mutex held
+void DumbBufferPool::trim()
+{
+    while (m_stats.freeBytes > m_maxFreeBytes && !m_free.isEmpty()) {
+        DumbBuffer b = m_free.takeFirst();
+        --m_stats.free;
+        m_stats.freeBytes -= b.size;
+        destroy(&b);
+        ++m_stats.destroyed;
+    }
+}
+
+DumbBufferPool::Stats DumbBufferPool::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_stats;
+}
+
+void DumbBufferPool::dumpStats() const
+{
+    const Stats stats = this->stats();
+    qDebug("Dumb buffer pool: %d created, %d reused, %d destroyed, %d in use, %d free (%lld kB)",
+           stats.created, stats.reused, stats.destroyed, stats.inUse, stats.free,
+           stats.freeBytes / 1024);
+}
+
+bool DumbBufferPool::create(DumbBuffer *buffer, const QSize &size, uint32_t format)
+{
+    const PixelFormat *pixelFormat = PixelFormat::fromFourcc(format);
+    if (!pixelFormat) {
+        qWarning("Unsupported format %08x for dumb buffers", format);
+        return false;
+    }
+    const uint32_t w = size.width();
+    const uint32_t h = size.height();
+    if (m_headless)
+        return createHeadless(buffer, w, h, *pixelFormat);
+    drm_mode_create_dumb creq = {
+        h,
+        w,
+        uint32_t(pixelFormat->bpp),
+        0, 0, 0, 0
+    };
+    if (drmIoctl(m_fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq) == -1) {
+        qErrnoWarning(errno, "Failed to create dumb buffer");
+        return false;
+    }
+
+    DumbBuffer &fb(*buffer);
+    fb.handle = creq.handle;
+    fb.width = w;
+    fb.height = h;
+    fb.format = format;
+    fb.pitch = creq.pitch;
+    fb.size = creq.size;
+    qDebug("Got a dumb buffer for size %dx%d, %s, handle %u, pitch %u, size %lu", w, h, pixelFormat->name,
+           fb.handle, fb.pitch, fb.size);
+
+    if (format == DRM_FORMAT_XRGB8888) {
+        if (drmModeAddFB(m_fd, w, h, 24, 32, fb.pitch, fb.handle, &fb.fb) == -1) {
+            qErrnoWarning(errno, "Failed to add FB");
+            return false;
+        }
+    } else {
+        const uint32_t handles[4] = { fb.handle, 0, 0, 0 };
+        const uint32_t pitches[4] = { fb.pitch, 0, 0, 0 };
+        const uint32_t offsets[4] = { 0, 0, 0, 0 };
+        if (drmModeAddFB2(m_fd, w, h, format, handles, pitches, offsets, &fb.fb, 0) == -1) {
+            qErrnoWarning(errno, "Failed to add FB with format %08x", format);
+            return false;
+        }
+    }
+
+    drm_mode_map_dumb mreq = {
+        fb.handle,
+        0, 0
+    };
+    if (drmIoctl(m_fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq) == -1) {
+        qErrnoWarning(errno, "Failed to map dumb buffer");
+        return false;
+    }
+    fb.p = mmap(0, fb.size, PROT_READ | PROT_WRITE, MAP_SHARED | (m_populate ? MAP_POPULATE : 0),
+                m_fd, mreq.offset);
+    if (fb.p == MAP_FAILED) {
+        qErrnoWarning(errno, "Failed to mmap dumb buffer");
+        return false;
+    }
+
+    qDebug("FB is %u, mapped at %p", fb.fb, fb.p);
+    return true;
+}
+
+// Laid out like a dumb buffer, so that everything above the pool does the
+// same as on a device.
+bool DumbBufferPool::createHeadless(DumbBuffer *buffer, uint32_t w, uint32_t h, const PixelFormat &pixelFormat)
+{
+    DumbBuffer &fb(*buffer);
+    fb.width = w;
+    fb.height = h;
+    fb.format = pixelFormat.fourcc;
+    fb.pitch = HeadlessDisplay::pitch(int(w), pixelFormat.bytesPerPixel());
+    fb.size = uint64_t(fb.pitch) * h;
+    fb.p = HeadlessDisplay::map(fb.size, m_populate);
+    if (fb.p == MAP_FAILED)
+        return false;
+    fb.handle = uint32_t(m_lastHeadlessId.fetchAndAddRelaxed(1) + 1);
+    fb.fb = fb.handle;
+    qDebug("Got a headless buffer for size %ux%u, %s, FB %u, pitch %u, mapped at %p", w, h, pixelFormat.name,
+           fb.fb, fb.pitch, fb.p);
+    return true;
+}
+
+void DumbBufferPool::destroy(DumbBuffer *buffer)
+{
+    DumbBuffer &fb(*buffer);
+    if (fb.p != MAP_FAILED)
+        munmap(fb.p, fb.size);
+    if (m_headless) {
+        if (fb.dmaBufFd >= 0)
+            qt_safe_close(fb.dmaBufFd);
+        fb = DumbBuffer();
+        return;
+    }
+    if (fb.fb) {
+        if (drmModeRmFB(m_fd, fb.fb) == -1)
+            qErrnoWarning("Failed to remove fb");
+    }
+    if (fb.handle && fb.imported) {
+        // only the handle is ours, the memory belongs to the exporter
+        drm_gem_close creq = { fb.handle, 0 };
+        if (drmIoctl(m_fd, DRM_IOCTL_GEM_CLOSE, &creq) == -1)
+            qErrnoWarning(errno, "Failed to close imported buffer %u", fb.handle);
+    } else if (fb.handle) {
+        drm_mode_destroy_dumb dreq = { fb.handle };
+        if (drmIoctl(m_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq) == -1)
+            qErrnoWarning(errno, "Failed to destroy dumb buffer %u", fb.handle);
+    }
+    if (fb.dmaBufFd >= 0)
+        qt_safe_close(fb.dmaBufFd);
+    fb = DumbBuffer();
+}
@@ -0,0 +1,105 @@
+#ifndef DUMBBUFFERPOOL_H
+#define DUMBBUFFERPOOL_H
+
+#include <QVector>
+#include <QSize>
+#include <QImage>
+#include <QMutex>
+#include <QAtomicInt>
+#include <sys/mman.h>
+#include <stdint.h>
+#include "dmabuf.h"
+
+struct PixelFormat;
+
+// A dumb buffer with its FB and its mapping. Buffers shared with other
+// processes have a DMA-BUF fd, imported ones are mapped through it.
+struct DumbBuffer {
+    DumbBuffer()
+        : handle(0), width(0), height(0), format(0), pitch(0), size(0), fb(0), p(MAP_FAILED),
+          dmaBufFd(-1), imported(false) { }
+    // for QPainter, straight into the mapping
+    QImage image() const;
+    uint32_t handle;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format; // DRM_FORMAT_*
+    uint32_t pitch;
+    uint64_t size;
+    uint32_t fb;
+    void *p;
+    int dmaBufFd;
+    bool imported; // from another process, not a dumb buffer of ours
+};
+
+// Keeps released dumb buffers created, added and mapped, so that the next
+// request for the same size and format, from any output and across mode
+// switches, costs nothing. Everything that is not in use beyond
+// DRMFBTEST_POOL_MAX_FREE_MB (default 64) is destroyed, oldest first.
+//
+// DRMFBTEST_POOL_POPULATE=1 maps new buffers with MAP_POPULATE, so that the
+// page faults happen at allocation time and not on first touch.
+//
+// acquire() and release() may be called from several threads at once, the
+// ioctls for new buffers then run in parallel.
+class DumbBufferPool
+{
+public:
+    struct Stats {
+        int created = 0;
+        int reused = 0;
+        int destroyed = 0;
+        int inUse = 0;
+        int free = 0;
+        qint64 freeBytes = 0;
+    };
+
+    DumbBufferPool();
+    ~DumbBufferPool();
+
+    // The pool is tied to one DRM fd, clear() it before closing that.
+    void setFd(int fd) { m_fd = fd; }
+    // memfd mappings instead of dumb buffers, for a HeadlessDisplay. The
+    // handles and FB ids are made up, and nothing can be shared.
+    void setHeadless(bool headless) { m_headless = headless; }
+
+    // Fills in buffer and, unless told otherwise, clears it to 0. format is
+    // one of the DRM_FORMAT_* codes in PixelFormat. Without clearing, the
+    // contents are undefined and the caller has to paint all of it before
+    // it goes on screen.
+    bool acquire(DumbBuffer *buffer, const QSize &size, uint32_t format, bool clear = true);
+    // Hands the buffer back to the pool and resets it. Released buffers
+    // must not be on screen anymore. Shared buffers are destroyed instead,
+    // the other side may still have them mapped.
+    void release(DumbBuffer *buffer);
+
+    // Makes an acquired buffer shareable, the fd stays with the buffer and
+    // is closed with it.
+    bool exportBuffer(DumbBuffer *buffer);
+    // Wraps a buffer of another process in an FB and maps it. Takes over
+    // the fd, also on failure. Access it within a DmaBufAccess.
+    bool importBuffer(DumbBuffer *buffer, const DmaBufDescriptor &descriptor);
+
+    // Destroys all free buffers.
+    void clear();
+
+    Stats stats() const;
+    void dumpStats() const;
+
+private:
+    bool create(DumbBuffer *buffer, const QSize &size, uint32_t format);
+    bool createHeadless(DumbBuffer *buffer, uint32_t w, uint32_t h, const PixelFormat &pixelFormat);
+    void destroy(DumbBuffer *buffer);
+    void trim();
+
+    int m_fd = -1;
+    bool m_headless = false;
+    QAtomicInt m_lastHeadlessId;
+    mutable QMutex m_mutex; // for m_free and m_stats
+    QVector<DumbBuffer> m_free; // oldest first
+    qint64 m_maxFreeBytes = 64 * 1024 * 1024;
+    bool m_populate = false;
+    Stats m_stats;
+};
+
+#endif
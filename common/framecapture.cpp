@@ -0,0 +1,161 @@
+#include "framecapture.h"
+#include "hostmemory.h"
+#include <QThread>
+#include <QFile>
+#include <QtEndian>
+#include <string.h>
+
+static const quint32 CaptureVersion = 1;
+static const quint32 KeyFrameFlag = 1;
+
+class CaptureWriter : public QThread
+{
+public:
+    explicit CaptureWriter(FrameCapture *capture) : m_capture(capture) { }
+
+protected:
+    void run() override { m_capture->write(); }
+
+private:
+    FrameCapture *m_capture;
+};
+
+bool FrameCapture::isRequested()
+{
+    return qEnvironmentVariableIsSet("DRMFBTEST_CAPTURE");
+}
+
+FrameCapture::FrameCapture(const QString &path)
+    : m_path(path)
+{
+    int count = 8;
+    if (qEnvironmentVariableIsSet("DRMFBTEST_CAPTURE_FRAMES"))
+        count = qBound(2, qEnvironmentVariableIntValue("DRMFBTEST_CAPTURE_FRAMES"), 256);
+    m_slots.resize(count);
+    m_writer = new CaptureWriter(this);
+    m_writer->start(QThread::LowPriority);
+}
+
+FrameCapture::~FrameCapture()
+{
+    if (!m_writer)
+        return;
+    m_quit.store(1);
+    m_queued.release(); // wakes up the writer to see it
+    m_writer->wait();
+    delete m_writer;
+    if (m_dropped)
+        qWarning("Capture dropped %d frames", m_dropped);
+}
+
+void FrameCapture::capture(quint32 stream, const PixelFormat &format, const void *bits, int pitch,
+                           const QSize &size, const QRegion &damage, qint64 timestampUs)
+{
+    const int head = m_head.load();
+    const int next = (head + 1) % m_slots.count();
+    if (next == m_tail.loadAcquire()) {
+        ++m_dropped;
+        m_needKeyFrame.insert(stream);
+        return;
+    }
+
+    Slot &slot(m_slots[head]);
+    slot.stream = stream;
+    slot.fourcc = format.fourcc;
+    slot.size = size;
+    slot.timestampUs = timestampUs;
+    slot.keyFrame = !m_started.contains(stream) || m_needKeyFrame.contains(stream);
+    slot.rects.clear();
+    const QRect bounds(QPoint(0, 0), size);
+    if (slot.keyFrame) {
+        slot.rects.append(bounds);
+    } else {
+        for (const QRect &rect : damage)
+            slot.rects.append(rect.intersected(bounds));
+    }
+
+    // Only the damage is read, the buffer is most likely write-combined.
+    const int bytesPerPixel = format.bytesPerPixel();
+    int total = 0;
+    for (const QRect &rect : slot.rects)
+        total += rect.width() * bytesPerPixel * rect.height();
+    if (total > slot.capacity) {
+        slot.pixels = HostMemory::allocate(total);
+        slot.capacity = slot.pixels ? total : 0;
+    }
+    if (!slot.pixels) {
+        ++m_dropped;
+        m_needKeyFrame.insert(stream);
+        return;
+    }
+    slot.used = total;
+    uchar *dst = slot.pixels.data();
+    for (const QRect &rect : slot.rects) {
+        const int rowBytes = rect.width() * bytesPerPixel;
+        const uchar *src = static_cast<const uchar *>(bits) + rect.y() * pitch + rect.x() * bytesPerPixel;
+        for (int y = 0; y < rect.height(); ++y, src += pitch, dst += rowBytes)
+            memcpy(dst, src, rowBytes);
+    }
+
+    m_started.insert(stream);
+    m_needKeyFrame.remove(stream);
+    m_head.storeRelease(next);
+    m_queued.release();
+}
+
+template <typename T>
+static void append(QByteArray *out, T value)
+{
+    const T le = qToLittleEndian(value);
+    out->append(reinterpret_cast<const char *>(&le), sizeof(le));
+}
+
+void FrameCapture::write()
+{
+    QFile file(m_path);
+    const bool ok = file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    if (!ok)
+        qWarning("Failed to open %s for capturing: %s", qPrintable(m_path), qPrintable(file.errorString()));
+    else
+        qDebug("Capturing to %s", qPrintable(m_path));
+    QByteArray out;
+    out.append("DRMFBCAP", 8);
+    append<quint32>(&out, CaptureVersion);
+    if (ok)
+        file.write(out);
+    out.clear();
+
+    for (;;) {
+        m_queued.acquire();
+        const int tail = m_tail.load();
+        if (tail == m_head.loadAcquire()) {
+            if (m_quit.load())
+                break;
+            continue;
+        }
+
+        const Slot &slot(m_slots[tail]);
+        append<quint32>(&out, slot.stream);
+        append<quint32>(&out, slot.fourcc);
+        append<quint32>(&out, slot.size.width());
+        append<quint32>(&out, slot.size.height());
+        append<qint64>(&out, slot.timestampUs);
+        append<quint32>(&out, slot.keyFrame ? KeyFrameFlag : 0);
+        append<quint32>(&out, slot.rects.count());
+        for (const QRect &rect : slot.rects) {
+            append<quint32>(&out, rect.x());
+            append<quint32>(&out, rect.y());
+            append<quint32>(&out, rect.width());
+            append<quint32>(&out, rect.height());
+        }
+        // fast over small, this has to keep up with the display
+        const QByteArray compressed = qCompress(slot.pixels.data(), slot.used, 1);
+        append<quint32>(&out, compressed.size());
+        out.append(compressed);
+        m_tail.storeRelease((tail + 1) % m_slots.count());
+
+        if (ok && file.write(out) != out.size())
+            qWarning("Capture write failed: %s", qPrintable(file.errorString()));
+        out.clear();
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+#include <QVector>
+#include <QRect>
+#include <QRegion>
+#include <QSize>
+#include <QByteArray>
+#include <QAtomicInt>
+#include <QSemaphore>
+#include <QSet>
+#include <QString>
+#include <QSharedPointer>
+#include "pixelformat.h"
+
+class CaptureWriter;
+
+// Records what went on screen: capture() copies the damaged rects of a frame
+// into a ring of preallocated slots, a background thread compresses them and
+// appends them to a file. The calling thread never waits for the writer, a
+// full ring drops the frame and the next one of that stream is captured
+// whole so that the recording stays consistent. The slots come from
+// HostMemory and only grow.
+//
+// DRMFBTEST_CAPTURE=path turns it on, DRMFBTEST_CAPTURE_FRAMES (default 8)
+// sets the number of slots.
+//
+// The file starts with "DRMFBCAP" and a quint32 version, then for every
+// frame, all little endian:
+//     quint32 stream, fourcc, width, height
+//     qint64 timestamp in us, CLOCK_MONOTONIC
+//     quint32 flags (1 = key frame, the rects cover everything)
+//     quint32 rect count, then x, y, width, height for each
+//     quint32 size, then the pixels of the rects one after the other, rows
+//         packed, through qCompress()
+// A frame only has what changed compared to the previous one of the same
+// stream.
+class FrameCapture
+{
+public:
+    static bool isRequested();
+
+    explicit FrameCapture(const QString &path);
+    ~FrameCapture(); // writes out whatever is queued
+
+    bool isValid() const { return m_writer != nullptr; }
+
+    // From one thread only. bits is the frame as it is on screen, damage
+    // what changed since the previous capture() for stream.
+    void capture(quint32 stream, const PixelFormat &format, const void *bits, int pitch, const QSize &size,
+                 const QRegion &damage, qint64 timestampUs);
+
+    int droppedFrames() const { return m_dropped; }
+
+private:
+    friend class CaptureWriter;
+
+    struct Slot {
+        quint32 stream = 0;
+        quint32 fourcc = 0;
+        QSize size;
+        qint64 timestampUs = 0;
+        bool keyFrame = false;
+        QVector<QRect> rects;
+        QSharedPointer<uchar> pixels;
+        int capacity = 0;
+        int used = 0;
+    };
+
+    void write();
+
+    QVector<Slot> m_slots;
+    // single producer, single consumer: a slot between tail and head
+    // belongs to the writer
+    QAtomicInt m_head; // next slot to fill, capture() only
+    QAtomicInt m_tail; // next slot to write out, the writer only
+    QSemaphore m_queued;
+    QAtomicInt m_quit;
+    QSet<quint32> m_needKeyFrame;
+    QSet<quint32> m_started;
+    int m_dropped = 0;
+    CaptureWriter *m_writer = nullptr;
+    QString m_path;
+};
+
+#endif
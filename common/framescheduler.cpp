@@ -0,0 +1,92 @@
+#include "framescheduler.h"
+#include "frametiming.h"
+
+FrameScheduler::FrameScheduler(QObject *parent)
+    : QObject(parent),
+      m_periodUs(refreshPeriodUs(0, 0, 0))
+{
+    if (qEnvironmentVariableIsSet("DRMFBTEST_RENDER_MARGIN_US"))
+        m_marginUs = qMax(0, qEnvironmentVariableIntValue("DRMFBTEST_RENDER_MARGIN_US"));
+    m_timer.setSingleShot(true);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, &QTimer::timeout, this, &FrameScheduler::frameDue);
+}
+
+qint64 FrameScheduler::refreshPeriodUs(qint64 pixelClockHz, int htotal, int vtotal, int fallbackHz)
+{
+    if (pixelClockHz > 0 && htotal > 0 && vtotal > 0)
+        return qint64(htotal) * vtotal * 1000000 / pixelClockHz;
+    return 1000000 / (fallbackHz > 0 ? fallbackHz : 60);
+}
+
+qint64 FrameScheduler::refreshPeriodUs(const drmModeModeInfo &mode)
+{
+    qint64 us = refreshPeriodUs(qint64(mode.clock) * 1000, mode.htotal, mode.vtotal, mode.vrefresh);
+    if (mode.flags & DRM_MODE_FLAG_INTERLACE)
+        us /= 2;
+    if (mode.flags & DRM_MODE_FLAG_DBLSCAN)
+        us *= 2;
+    return us;
+}
+
+void FrameScheduler::setRefreshPeriod(qint64 us)
+{
+    m_periodUs = qMax<qint64>(1000, us);
+    qCDebug(lcTiming, "Refresh period %lld us (%.2f Hz)", m_periodUs, 1000000.0 / m_periodUs);
+}
+
+void FrameScheduler::vblank(qint64 timestampUs)
+{
+    if (m_lastVblankUs && timestampUs > m_lastVblankUs) {
+        // Follow the real rate slowly, a late wakeup must not throw off
+        // the prediction. Missed vblanks show as multiples of the period.
+        const qint64 elapsed = timestampUs - m_lastVblankUs;
+        const qint64 count = qMax<qint64>(1, (elapsed + m_periodUs / 2) / m_periodUs);
+        const qint64 measured = elapsed / count;
+        if (qAbs(measured - m_periodUs) < m_periodUs / 8)
+            m_periodUs += (measured - m_periodUs) / 8;
+    }
+    m_lastVblankUs = timestampUs;
+}
+
+qint64 FrameScheduler::predictNextVblank(qint64 afterUs) const
+{
+    if (afterUs < m_lastVblankUs)
+        return m_lastVblankUs;
+    return m_lastVblankUs + ((afterUs - m_lastVblankUs) / m_periodUs + 1) * m_periodUs;
+}
+
+void FrameScheduler::renderStarted()
+{
+    m_renderStartUs = FrameTiming::monotonicUs();
+}
+
+void FrameScheduler::renderFinished()
+{
+    if (!m_renderStartUs)
+        return;
+    m_renderUs[m_renderIndex] = FrameTiming::monotonicUs() - m_renderStartUs;
+    m_renderIndex = (m_renderIndex + 1) % RenderHistory;
+    m_renderStartUs = 0;
+}
+
+qint64 FrameScheduler::renderBudget() const
+{
+    qint64 longest = 0;
+    for (qint64 us : m_renderUs)
+        longest = qMax(longest, us);
+    return longest + m_marginUs;
+}
+
+void FrameScheduler::requestFrame()
+{
+    if (m_timer.isActive())
+        return;
+    const qint64 now = FrameTiming::monotonicUs();
+    if (!m_lastVblankUs)
+        m_lastVblankUs = now; // no phase to go by yet
+    const qint64 budget = renderBudget();
+    const qint64 start = predictNextVblank(now + budget) - budget;
+    // QTimer has millisecond resolution, better early than late
+    m_timer.start(int(qMax<qint64>(0, start - now) / 1000));
+}
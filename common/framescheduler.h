@@ -0,0 +1,62 @@
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+#include <QObject>
+#include <QTimer>
+#include <xf86drmMode.h>
+
+// Decides when to start rendering the next frame of one output: as late as
+// possible while still being done before the next vblank, so that what is
+// shown is as fresh as it can be. The vblank times are predicted from the
+// refresh period of the mode and corrected with every real timestamp, which
+// can come from flip or vblank events or FBIO_WAITFORVSYNC. Without any the
+// scheduler still runs at the rate of the mode, only its phase is arbitrary.
+//
+// The render budget is the longest of the last few renders plus a safety
+// margin, DRMFBTEST_RENDER_MARGIN_US (default 1000).
+class FrameScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FrameScheduler(QObject *parent = nullptr);
+
+    // The frame period of a mode, or of fallbackHz when the timings are not
+    // known.
+    static qint64 refreshPeriodUs(qint64 pixelClockHz, int htotal, int vtotal, int fallbackHz = 60);
+    // per field for interlaced modes, which is what vblanks come at
+    static qint64 refreshPeriodUs(const drmModeModeInfo &mode);
+
+    void setRefreshPeriod(qint64 us);
+    qint64 refreshPeriod() const { return m_periodUs; }
+
+    // A vblank happened at timestampUs, CLOCK_MONOTONIC.
+    void vblank(qint64 timestampUs);
+    // The first vblank after afterUs.
+    qint64 predictNextVblank(qint64 afterUs) const;
+
+    void renderStarted();
+    void renderFinished();
+    qint64 renderBudget() const;
+
+    // Emits frameDue() once when it is time to start rendering for the next
+    // vblank that can still be made, right away if that is now.
+    void requestFrame();
+    void cancel() { m_timer.stop(); }
+
+signals:
+    void frameDue();
+
+private:
+    static const int RenderHistory = 16;
+
+    QTimer m_timer;
+    qint64 m_periodUs;
+    qint64 m_lastVblankUs = 0;
+    qint64 m_marginUs = 1000;
+    qint64 m_renderStartUs = 0;
+    qint64 m_renderUs[RenderHistory] = {};
+    int m_renderIndex = 0;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include "frametiming.h"
+#include <QSocketNotifier>
+#include <QtCore/private/qcore_unix_p.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+Q_LOGGING_CATEGORY(lcTiming, "drmfbtest.timing")
+
+TimingHistogram::TimingHistogram()
+    : m_buckets(BucketCount, 0)
+{
+}
+
+void TimingHistogram::add(qint64 us)
+{
+    if (us < 0)
+        return;
+    ++m_buckets[qMin<qint64>(us / BucketUs, BucketCount - 1)];
+    ++m_count;
+    m_sum += us;
+    m_max = qMax(m_max, us);
+}
+
+qint64 TimingHistogram::percentile(int p) const
+{
+    if (!m_count)
+        return 0;
+    const qint64 target = (m_count * p + 99) / 100;
+    qint64 seen = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        seen += m_buckets[i];
+        if (seen >= target)
+            return qMin(m_max, qint64(i + 1) * BucketUs); // upper edge of the bucket
+    }
+    return m_max;
+}
+
+qint64 FrameTiming::monotonicUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void FrameTiming::renderStarted()
+{
+    m_renderStartUs = monotonicUs();
+}
+
+void FrameTiming::renderFinished()
+{
+    if (m_renderStartUs)
+        m_renderTime.add(monotonicUs() - m_renderStartUs);
+    m_renderStartUs = 0;
+}
+
+void FrameTiming::submitted()
+{
+    m_submitUs = monotonicUs();
+}
+
+void FrameTiming::flipCompleted(unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec)
+{
+    const qint64 flipUs = qint64(tv_sec) * 1000000 + tv_usec;
+    if (m_submitUs) {
+        m_submitLatency.add(flipUs - m_submitUs);
+        m_submitUs = 0;
+    }
+    if (m_lastFlipUs) {
+        m_flipInterval.add(flipUs - m_lastFlipUs);
+        // Consecutive flips land on consecutive vblanks, anything in
+        // between repeated the previous frame.
+        const unsigned int vblanks = sequence - m_lastSequence;
+        if (vblanks > 1)
+            m_missedVblanks += vblanks - 1;
+    }
+    m_lastFlipUs = flipUs;
+    m_lastSequence = sequence;
+    ++m_frames;
+}
+
+static QString histogramSummary(const TimingHistogram &h)
+{
+    return QString::fromLatin1("p50 %1 ms  p99 %2 ms  max %3 ms  mean %4 ms")
+            .arg(h.percentile(50) / 1000.0, 0, 'f', 2)
+            .arg(h.percentile(99) / 1000.0, 0, 'f', 2)
+            .arg(h.max() / 1000.0, 0, 'f', 2)
+            .arg(h.mean() / 1000.0, 0, 'f', 2);
+}
+
+void FrameTiming::dump(const QString &name) const
+{
+    qCDebug(lcTiming, "Output %s: %lld frames, %lld missed vblanks",
+            qPrintable(name), m_frames, m_missedVblanks);
+    qCDebug(lcTiming, "  flip interval  %s", qPrintable(histogramSummary(m_flipInterval)));
+    qCDebug(lcTiming, "  render         %s", qPrintable(histogramSummary(m_renderTime)));
+    qCDebug(lcTiming, "  submit to flip %s", qPrintable(histogramSummary(m_submitLatency)));
+}
+
+static int s_dumpSignalFd[2] = { -1, -1 };
+
+static void dumpSignalHandler(int)
+{
+    // only async-signal-safe calls in here, the rest happens in the event loop
+    const char c = 1;
+    const ssize_t ret = ::write(s_dumpSignalFd[1], &c, 1);
+    Q_UNUSED(ret);
+}
+
+void installTimingDumpHandler(QObject *context, const std::function<void()> &dump)
+{
+    if (s_dumpSignalFd[0] == -1 && ::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, s_dumpSignalFd) != 0) {
+        qErrnoWarning(errno, "Failed to create socket pair for SIGUSR1");
+        return;
+    }
+
+    QSocketNotifier *notifier = new QSocketNotifier(s_dumpSignalFd[0], QSocketNotifier::Read, context);
+    QObject::connect(notifier, &QSocketNotifier::activated, context, [dump] {
+        char c;
+        if (qt_safe_read(s_dumpSignalFd[0], &c, 1) == 1)
+            dump();
+    });
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dumpSignalHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, nullptr);
+}
@@ -0,0 +1,75 @@
+#ifndef FRAMETIMING_H
+#define FRAMETIMING_H
+
+#include <QtGlobal>
+#include <QVector>
+#include <QString>
+#include <QLoggingCategory>
+#include <functional>
+
+class QObject;
+
+Q_DECLARE_LOGGING_CATEGORY(lcTiming)
+
+// Fixed resolution histogram of durations in microseconds, 50 us buckets up
+// to 100 ms and everything above in the last one.
+class TimingHistogram
+{
+public:
+    TimingHistogram();
+
+    void add(qint64 us);
+    qint64 count() const { return m_count; }
+    qint64 percentile(int p) const;
+    qint64 max() const { return m_max; }
+    qint64 mean() const { return m_count ? m_sum / m_count : 0; }
+
+private:
+    static const int BucketUs = 50;
+    static const int BucketCount = 2000;
+
+    QVector<qint64> m_buckets;
+    qint64 m_count = 0;
+    qint64 m_sum = 0;
+    qint64 m_max = 0;
+};
+
+// Frame statistics for one output. The flip timestamps come straight from the
+// page flip events, which use CLOCK_MONOTONIC, as does everything else here.
+class FrameTiming
+{
+public:
+    void renderStarted();
+    void renderFinished();
+    void submitted();
+    void flipCompleted(unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec);
+
+    const TimingHistogram &flipInterval() const { return m_flipInterval; }
+    const TimingHistogram &renderTime() const { return m_renderTime; }
+    const TimingHistogram &submitLatency() const { return m_submitLatency; }
+    qint64 frames() const { return m_frames; }
+    qint64 missedVblanks() const { return m_missedVblanks; }
+    // CLOCK_MONOTONIC us of the last flip, 0 before the first
+    qint64 lastFlipUs() const { return m_lastFlipUs; }
+
+    // Logs a summary to lcTiming.
+    void dump(const QString &name) const;
+
+    static qint64 monotonicUs();
+
+private:
+    TimingHistogram m_flipInterval;
+    TimingHistogram m_renderTime;
+    TimingHistogram m_submitLatency;
+    qint64 m_frames = 0;
+    qint64 m_missedVblanks = 0;
+    qint64 m_renderStartUs = 0;
+    qint64 m_submitUs = 0;
+    qint64 m_lastFlipUs = 0;
+    unsigned int m_lastSequence = 0;
+};
+
+// Calls dump from the event loop whenever the process gets SIGUSR1.
+void installTimingDumpHandler(QObject *context, const std::function<void()> &dump);
+
+#endif
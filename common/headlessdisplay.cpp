@@ -0,0 +1,181 @@
+#include "headlessdisplay.h"
+#include "framescheduler.h"
+#include "frametiming.h"
+#include <QStringList>
+#include <QtCore/private/qcore_unix_p.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <linux/memfd.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+static const int CacheLine = 64;
+
+bool HeadlessDisplay::isRequested()
+{
+    return !qEnvironmentVariableIsEmpty("DRMFBTEST_HEADLESS") && qgetenv("DRMFBTEST_HEADLESS") != "0";
+}
+
+HeadlessDisplay::HeadlessDisplay()
+    : m_epochUs(FrameTiming::monotonicUs())
+{
+    QString value = QString::fromLocal8Bit(qgetenv("DRMFBTEST_HEADLESS"));
+    if (value == QLatin1String("1"))
+        value = QStringLiteral("1920x1080@60");
+    for (const QString &spec : value.split(QLatin1Char(','), QString::SkipEmptyParts)) {
+        const QStringList modeAndRate = spec.trimmed().split(QLatin1Char('@'));
+        const QStringList wh = modeAndRate.first().split(QLatin1Char('x'));
+        const int hz = modeAndRate.count() > 1 ? modeAndRate[1].toInt() : 60;
+        const QSize size = wh.count() == 2 ? QSize(wh[0].toInt(), wh[1].toInt()) : QSize();
+        if (size.isEmpty() || size.width() > 0xffff || size.height() > 0xffff || hz < 0) {
+            qWarning("Ignoring DRMFBTEST_HEADLESS output %s, expected WxH or WxH@Hz", qPrintable(spec));
+            continue;
+        }
+        Output output;
+        output.name = QStringLiteral("HEADLESS-%1").arg(m_outputs.count() + 1);
+        output.size = size;
+        output.hz = hz;
+        output.periodUs = hz ? FrameScheduler::refreshPeriodUs(0, 0, 0, hz) : 0;
+        m_outputs.append(output);
+        qDebug("%s: %dx%d at %d Hz", qPrintable(output.name), size.width(), size.height(), hz);
+    }
+    if (m_outputs.isEmpty()) {
+        qWarning("No headless outputs in DRMFBTEST_HEADLESS=%s", qPrintable(value));
+        return;
+    }
+    m_sequences.fill(0, m_outputs.count());
+
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timerFd == -1)
+        qErrnoWarning(errno, "timerfd_create failed, no vblank events");
+}
+
+HeadlessDisplay::~HeadlessDisplay()
+{
+    if (m_timerFd != -1)
+        qt_safe_close(m_timerFd);
+}
+
+QKmsOutput HeadlessDisplay::kmsOutput(int output) const
+{
+    const Output &o(m_outputs[output]);
+    // a mode the refresh period can be worked out of, see
+    // FrameScheduler::refreshPeriodUs()
+    drmModeModeInfo mode;
+    memset(&mode, 0, sizeof(mode));
+    mode.hdisplay = mode.htotal = uint16_t(o.size.width());
+    mode.vdisplay = mode.vtotal = uint16_t(o.size.height());
+    mode.vrefresh = uint32_t(o.hz);
+    snprintf(mode.name, sizeof(mode.name), "%dx%d", o.size.width(), o.size.height());
+
+    QKmsOutput kmsOutput;
+    kmsOutput.name = o.name;
+    kmsOutput.connector_id = uint32_t(output + 1);
+    kmsOutput.crtc_index = uint32_t(output);
+    kmsOutput.crtc_id = uint32_t(output + 1);
+    kmsOutput.modes.append(mode);
+    kmsOutput.preferred_mode = 0;
+    kmsOutput.mode = 0;
+    return kmsOutput;
+}
+
+void *HeadlessDisplay::map(size_t size, bool populate)
+{
+    const int fd = int(syscall(SYS_memfd_create, "drmfbtest-headless", MFD_CLOEXEC));
+    if (fd == -1) {
+        qErrnoWarning(errno, "memfd_create failed");
+        return MAP_FAILED;
+    }
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, off_t(size)) != 0) {
+        qErrnoWarning(errno, "Failed to size a headless buffer to %zu bytes", size);
+    } else {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | (populate ? MAP_POPULATE : 0), fd, 0);
+        if (p == MAP_FAILED)
+            qErrnoWarning(errno, "Failed to map a headless buffer");
+    }
+    // the mapping keeps the pages
+    qt_safe_close(fd);
+    return p;
+}
+
+uint32_t HeadlessDisplay::pitch(int width, int bytesPerPixel)
+{
+    return uint32_t((width * bytesPerPixel + CacheLine - 1) / CacheLine * CacheLine);
+}
+
+void HeadlessDisplay::requestVblank(int output)
+{
+    const Output &o(m_outputs[output]);
+    Event event;
+    event.output = output;
+    event.dueUs = FrameTiming::monotonicUs();
+    if (o.periodUs) {
+        // the first vblank from now on
+        const qint64 count = (event.dueUs - m_epochUs) / o.periodUs + 1;
+        event.dueUs = m_epochUs + count * o.periodUs;
+        event.sequence = unsigned(count);
+    } else {
+        event.sequence = ++m_sequences[output];
+    }
+    m_events.append(event);
+    armTimer();
+}
+
+qint64 HeadlessDisplay::firstDueUs() const
+{
+    qint64 dueUs = m_events.first().dueUs;
+    for (const Event &event : m_events)
+        dueUs = qMin(dueUs, event.dueUs);
+    return dueUs;
+}
+
+void HeadlessDisplay::armTimer()
+{
+    if (m_timerFd == -1)
+        return;
+    // a zero it_value disarms
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (!m_events.isEmpty()) {
+        const qint64 dueUs = firstDueUs();
+        spec.it_value.tv_sec = time_t(dueUs / 1000000);
+        spec.it_value.tv_nsec = long(dueUs % 1000000) * 1000;
+    }
+    if (timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) != 0)
+        qErrnoWarning(errno, "Failed to arm the vblank timer");
+}
+
+bool HeadlessDisplay::dispatch(const std::function<void(int, unsigned int, qint64)> &handler)
+{
+    if (m_timerFd == -1)
+        return false;
+    if (m_events.isEmpty())
+        return true;
+    const qint64 dueUs = firstDueUs();
+    // Blocks like reading the DRM fd does. Reading the timer clears it,
+    // it is armed again for what is left.
+    const timespec ts = { time_t(dueUs / 1000000), long(dueUs % 1000000) * 1000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) { }
+    uint64_t expirations;
+    if (read(m_timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        qErrnoWarning(errno, "Failed to read the vblank timer");
+
+    const qint64 nowUs = FrameTiming::monotonicUs();
+    QVector<Event> due;
+    for (int i = 0; i < m_events.count(); ) {
+        if (m_events[i].dueUs <= nowUs)
+            due.append(m_events.takeAt(i));
+        else
+            ++i;
+    }
+    armTimer();
+    // the handler may ask for the next ones
+    for (const Event &event : due)
+        handler(event.output, event.sequence, event.dueUs);
+    return true;
+}
@@ -0,0 +1,80 @@
+#ifndef HEADLESSDISPLAY_H
+#define HEADLESSDISPLAY_H
+
+#include <QString>
+#include <QSize>
+#include <QVector>
+#include <functional>
+#include <QtKmsSupport/private/qkmsdevice_p.h>
+
+// Outputs without a display, for running the demos and the benchmarks where
+// there is neither /dev/dri/card0 nor /dev/fb0, like on CI machines. Each
+// program's Device takes them in place of its device: the buffers are memfd
+// mappings, see map(), and flips and vblanks complete on a simulated vblank
+// clock that starts with the display. Everything above the kernel calls runs
+// as it does on hardware, so the numbers can be compared from one commit to
+// the next.
+//
+// DRMFBTEST_HEADLESS=1 gives one 1920x1080 output at 60 Hz, or give a comma
+// separated list of WxH or WxH@Hz, e.g. 3840x2160@60,1280x720@30. A rate of
+// 0 has every event come right away, for measuring throughput.
+class HeadlessDisplay
+{
+public:
+    struct Output {
+        QString name;
+        QSize size;
+        int hz = 60; // 0 for no vblanks
+        qint64 periodUs = 0;
+    };
+
+    static bool isRequested();
+
+    // Parses DRMFBTEST_HEADLESS. Outputs that do not parse are left out
+    // with a warning, and there may be none left.
+    HeadlessDisplay();
+    ~HeadlessDisplay();
+
+    const QVector<Output> &outputs() const { return m_outputs; }
+    // What the DRM programs keep of a connector, with one mode. crtc_id is
+    // the index plus one. Nothing that goes to the kernel is set, so
+    // cleanup() and setPowerState() do nothing.
+    QKmsOutput kmsOutput(int output) const;
+
+    // Shared file pages like the shmem behind dumb buffers on virtual GPUs,
+    // zeroed like a fresh dumb buffer. Not write-combined, so this says
+    // nothing about the cost of the scanout memory itself. MAP_FAILED on
+    // failure, munmap() it.
+    static void *map(size_t size, bool populate = true);
+    // line lengths aligned the way drivers do
+    static uint32_t pitch(int width, int bytesPerPixel);
+
+    // Asks for an event at the next vblank of output, like a page flip or
+    // a vblank event does.
+    void requestVblank(int output);
+    // Readable once the first of the events asked for is due, for a
+    // QSocketNotifier.
+    int fd() const { return m_timerFd; }
+    // Waits for the first event to be due and calls back for every one that
+    // is, with the time of its vblank on CLOCK_MONOTONIC. False when there
+    // is no timer.
+    bool dispatch(const std::function<void(int output, unsigned int sequence, qint64 timestampUs)> &handler);
+
+private:
+    struct Event {
+        int output;
+        unsigned int sequence;
+        qint64 dueUs;
+    };
+
+    qint64 firstDueUs() const;
+    void armTimer();
+
+    QVector<Output> m_outputs;
+    QVector<unsigned int> m_sequences; // of the last event, for outputs at 0 Hz
+    QVector<Event> m_events; // in the order asked for
+    qint64 m_epochUs; // the first vblank of every output
+    int m_timerFd = -1;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "hostmemory.h"
+#include <QByteArray>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+static const size_t HugePageSize = 2 * 1024 * 1024;
+
+enum HugePages {
+    NoHugePages,
+    TransparentHugePages,
+    HugeTlbPages
+};
+
+static HugePages requestedHugePages()
+{
+    const QByteArray value = qgetenv("DRMFBTEST_HUGEPAGES").toLower();
+    if (value.isEmpty() || value == "0")
+        return NoHugePages;
+    if (value == "hugetlb")
+        return HugeTlbPages;
+    return TransparentHugePages;
+}
+
+static const int NoNode = -1;
+static const int LocalNode = -2; // of the thread allocating, every time
+
+static int requestedNode()
+{
+    const QByteArray value = qgetenv("DRMFBTEST_NUMA_NODE");
+    if (value.isEmpty())
+        return NoNode;
+    if (value == "local")
+        return LocalNode;
+    bool ok = false;
+    const int node = value.toInt(&ok);
+    if (!ok || node < 0) {
+        qWarning("Invalid DRMFBTEST_NUMA_NODE %s", value.constData());
+        return NoNode;
+    }
+    return node;
+}
+
+int HostMemory::currentNode()
+{
+    // glibc only wraps getcpu() since 2.29
+    unsigned int cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+        return 0;
+    return int(node);
+}
+
+static bool preferNode(void *p, size_t bytes, int node)
+{
+    // Preferred rather than bound, a full node falls back to the others
+    // instead of failing the fault.
+    unsigned long mask[4] = {};
+    const int bits = int(sizeof(mask) * 8);
+    if (node >= bits) {
+        qWarning("NUMA node %d out of range", node);
+        return false;
+    }
+    mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+    if (syscall(SYS_mbind, p, bytes, MPOL_PREFERRED, mask, bits + 1, 0) != 0) {
+        qErrnoWarning(errno, "Failed to place %zu bytes on node %d", bytes, node);
+        return false;
+    }
+    return true;
+}
+
+QSharedPointer<uchar> HostMemory::allocate(size_t bytes)
+{
+    static const HugePages hugePages = requestedHugePages();
+    static const int requested = requestedNode();
+    if (!bytes)
+        return QSharedPointer<uchar>();
+
+    // Huge pages want the whole mapping in units of them.
+    const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+    const size_t unit = hugePages == NoHugePages ? pageSize : HugePageSize;
+    size_t length = (bytes + unit - 1) / unit * unit;
+    void *p = MAP_FAILED;
+    if (hugePages == HugeTlbPages) {
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED)
+            qErrnoWarning(errno, "No hugetlb pages for %zu bytes, trying transparent ones", length);
+    }
+    if (p == MAP_FAILED && hugePages != NoHugePages) {
+        // Over-allocate to cut out an aligned range, the kernel only backs
+        // aligned 2 MiB ranges with huge pages.
+        void *raw = mmap(nullptr, length + HugePageSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED) {
+            const quintptr start = quintptr(raw);
+            const quintptr aligned = (start + HugePageSize - 1) & ~quintptr(HugePageSize - 1);
+            if (aligned > start)
+                munmap(raw, aligned - start);
+            const size_t tail = (start + length + HugePageSize) - (aligned + length);
+            if (tail)
+                munmap(reinterpret_cast<void *>(aligned + length), tail);
+            p = reinterpret_cast<void *>(aligned);
+            if (madvise(p, length, MADV_HUGEPAGE) != 0)
+                qErrnoWarning(errno, "No transparent huge pages");
+        }
+    }
+    if (p == MAP_FAILED) {
+        length = (bytes + pageSize - 1) / pageSize * pageSize;
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+        qErrnoWarning(errno, "Failed to map %zu bytes", length);
+        return QSharedPointer<uchar>();
+    }
+
+    // The placement only applies to pages not faulted in yet, so it goes
+    // first, then every page is touched. Threads move between nodes, so
+    // "local" asks each time.
+    const int node = requested == LocalNode ? currentNode() : requested;
+    if (node >= 0)
+        preferNode(p, length, node);
+    memset(p, 0, length);
+
+    return QSharedPointer<uchar>(static_cast<uchar *>(p), [length](uchar *p) { munmap(p, length); });
+}
@@ -0,0 +1,28 @@
+#ifndef HOSTMEMORY_H
+#define HOSTMEMORY_H
+
+#include <QSharedPointer>
+#include <stddef.h>
+
+// Anonymous system memory for what the CPU streams whole frames through:
+// shadow buffers and the capture ring. A 4K frame spans thousands of 4 KiB
+// pages, so huge pages save most of the TLB misses, and everything is
+// faulted in up front instead of during the first frames.
+//
+// DRMFBTEST_HUGEPAGES=1 asks for transparent huge pages on a 2 MiB aligned
+// mapping, "hugetlb" for pages from the hugetlbfs pool, falling back to
+// transparent ones when the pool is empty.
+//
+// DRMFBTEST_NUMA_NODE=n prefers memory on node n, "local" on the node of the
+// thread that allocates. Unset leaves placement to the process policy.
+class HostMemory
+{
+public:
+    // Zeroed, cache line aligned at least, freed with the last reference.
+    static QSharedPointer<uchar> allocate(size_t bytes);
+
+    // The node the calling thread runs on, 0 without NUMA.
+    static int currentNode();
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include "perfcounters.h"
+#include "frametiming.h"
+#include <QJsonObject>
+#include <QStringList>
+#include <QtCore/private/qcore_unix_p.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+struct CounterConfig {
+    quint32 type;
+    quint64 config;
+    const char *name;
+};
+
+static const CounterConfig counterConfigs[PerfCounters::CounterCount] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "llc_misses" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page_faults" }
+};
+
+static const char *sectionNames[PerfStats::SectionCount] = { "render", "present", "events" };
+
+static int openCounter(const CounterConfig &counter, bool excludeKernel)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counter.type;
+    attr.config = counter.config;
+    attr.inherit = 1; // the render threads started later
+    attr.exclude_kernel = excludeKernel;
+    attr.exclude_hv = 1;
+    // this thread, any CPU
+    return int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+bool PerfCounters::isRequested()
+{
+    return qEnvironmentVariableIntValue("DRMFBTEST_PERF");
+}
+
+const char *PerfCounters::counterName(Counter counter)
+{
+    return counterConfigs[counter].name;
+}
+
+PerfCounters::PerfCounters()
+{
+    for (int &fd : m_fds)
+        fd = -1;
+    if (!isRequested())
+        return;
+
+    bool excludeKernel = false;
+    QStringList missing;
+    for (int i = 0; i < CounterCount; ++i) {
+        m_fds[i] = openCounter(counterConfigs[i], excludeKernel);
+        if (m_fds[i] == -1 && (errno == EACCES || errno == EPERM) && !excludeKernel) {
+            qWarning("perf_event_paranoid does not allow counting the kernel, counting user space only");
+            excludeKernel = true;
+            m_fds[i] = openCounter(counterConfigs[i], excludeKernel);
+        }
+        if (m_fds[i] == -1)
+            missing.append(QString::fromLatin1(counterConfigs[i].name));
+    }
+    if (!missing.isEmpty())
+        qWarning("No perf counters for %s", qPrintable(missing.join(QStringLiteral(", "))));
+    if (isValid())
+        qDebug("Reading perf counters%s", excludeKernel ? ", user space only" : "");
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int fd : m_fds) {
+        if (fd != -1)
+            qt_safe_close(fd);
+    }
+}
+
+bool PerfCounters::isValid() const
+{
+    for (int fd : m_fds) {
+        if (fd != -1)
+            return true;
+    }
+    return false;
+}
+
+PerfCounters::Sample PerfCounters::read() const
+{
+    // One read per counter, groups cannot be inherited. The read sums up
+    // the threads that inherited the counter.
+    Sample sample;
+    for (int i = 0; i < CounterCount; ++i) {
+        if (m_fds[i] == -1)
+            continue;
+        quint64 value = 0;
+        if (qt_safe_read(m_fds[i], &value, sizeof(value)) == sizeof(value))
+            sample.counts[i] = value;
+    }
+    return sample;
+}
+
+const char *PerfStats::sectionName(Section section)
+{
+    return sectionNames[section];
+}
+
+void PerfStats::add(Section section, const PerfCounters::Sample &start, const PerfCounters::Sample &end)
+{
+    for (int i = 0; i < PerfCounters::CounterCount; ++i)
+        m_totals[section][i] += end.counts[i] - start.counts[i];
+    ++m_calls[section];
+}
+
+double PerfStats::perFrame(Section section, PerfCounters::Counter counter) const
+{
+    return frames() ? double(m_totals[section][counter]) / frames() : 0.0;
+}
+
+void PerfStats::dump(const QString &name) const
+{
+    if (!frames())
+        return;
+    qCDebug(lcTiming, "Output %s: perf counters per frame", qPrintable(name));
+    for (int s = 0; s < SectionCount; ++s) {
+        const Section section = Section(s);
+        const double cycles = perFrame(section, PerfCounters::Cycles);
+        qCDebug(lcTiming, "  %-8s %.0f cycles  %.0f instructions (%.2f IPC)  %.0f LLC misses  %.1f page faults",
+                sectionNames[s], cycles, perFrame(section, PerfCounters::Instructions),
+                cycles ? perFrame(section, PerfCounters::Instructions) / cycles : 0.0,
+                perFrame(section, PerfCounters::CacheMisses), perFrame(section, PerfCounters::PageFaults));
+    }
+}
+
+QJsonObject PerfStats::toJson() const
+{
+    QJsonObject result;
+    for (int s = 0; s < SectionCount; ++s) {
+        QJsonObject section;
+        for (int c = 0; c < PerfCounters::CounterCount; ++c)
+            section.insert(QString::fromLatin1(counterConfigs[c].name), perFrame(Section(s), PerfCounters::Counter(c)));
+        result.insert(QString::fromLatin1(sectionNames[s]), section);
+    }
+    return result;
+}
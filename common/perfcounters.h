@@ -0,0 +1,76 @@
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <QtGlobal>
+#include <QString>
+
+class QJsonObject;
+
+// CPU counters from perf_event_open(), to tell whether a frame is bound by
+// memory bandwidth, cache misses or syscalls. They count the thread that
+// opens them and every thread it starts afterwards, so they have to be
+// opened before the render pool is. Kernel time is included where
+// perf_event_paranoid allows, otherwise only user space is counted and the
+// ioctls look free.
+//
+// DRMFBTEST_PERF=1 turns them on. Counters the CPU or the hypervisor does
+// not have read as 0.
+class PerfCounters
+{
+public:
+    enum Counter {
+        Cycles,
+        Instructions,
+        CacheMisses, // last level, on most CPUs
+        PageFaults,
+        CounterCount
+    };
+
+    struct Sample {
+        quint64 counts[CounterCount] = {};
+    };
+
+    static bool isRequested();
+    static const char *counterName(Counter counter);
+
+    PerfCounters(); // opens the counters when requested
+    ~PerfCounters();
+
+    bool isValid() const;
+    Sample read() const;
+
+private:
+    int m_fds[CounterCount];
+};
+
+// What the counters did in each section of the frames of one output. A
+// section that covers several outputs at once, a batch of fills or an
+// atomic commit, is charged to each of them in full.
+class PerfStats
+{
+public:
+    enum Section {
+        Render,
+        Present, // the commit or page flip ioctls
+        Events, // drmHandleEvent()
+        SectionCount
+    };
+
+    static const char *sectionName(Section section);
+
+    void add(Section section, const PerfCounters::Sample &start, const PerfCounters::Sample &end);
+    // averages per frame, frames being what went through Render
+    qint64 frames() const { return m_calls[Render]; }
+    double perFrame(Section section, PerfCounters::Counter counter) const;
+
+    // Logs the per frame averages to lcTiming.
+    void dump(const QString &name) const;
+    // the same as {"render":{"cycles":...,...},...}
+    QJsonObject toJson() const;
+
+private:
+    quint64 m_totals[SectionCount][PerfCounters::CounterCount] = {};
+    qint64 m_calls[SectionCount] = {};
+};
+
+#endif
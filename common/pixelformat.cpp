@@ -0,0 +1,192 @@
+#include "pixelformat.h"
+#include <QByteArray>
+#include <QPainter>
+#include <drm_fourcc.h>
+#include <linux/fb.h>
+#include <string.h>
+
+static const PixelFormat formats[] = {
+    { PixelFormat::XRGB8888, DRM_FORMAT_XRGB8888, 32, 24, QImage::Format_RGB32, "xrgb8888" },
+    { PixelFormat::ARGB8888, DRM_FORMAT_ARGB8888, 32, 32, QImage::Format_ARGB32_Premultiplied, "argb8888" },
+    { PixelFormat::RGB565, DRM_FORMAT_RGB565, 16, 16, QImage::Format_RGB16, "rgb565" },
+    { PixelFormat::XRGB2101010, DRM_FORMAT_XRGB2101010, 32, 30, QImage::Format_RGB30, "xrgb2101010" }
+};
+
+const PixelFormat &PixelFormat::get(Id id)
+{
+    return formats[id];
+}
+
+const PixelFormat *PixelFormat::fromFourcc(uint32_t fourcc)
+{
+    for (const PixelFormat &format : formats) {
+        if (format.fourcc == fourcc)
+            return &format;
+    }
+    return nullptr;
+}
+
+static const PixelFormat &requestedFormat()
+{
+    const QByteArray name = qgetenv("DRMFBTEST_FORMAT").toLower();
+    if (name.isEmpty())
+        return formats[PixelFormat::XRGB8888];
+    for (const PixelFormat &format : formats) {
+        // no alpha on scanout buffers
+        if (format.id != PixelFormat::ARGB8888 && name == format.name)
+            return format;
+    }
+    qWarning("Unknown DRMFBTEST_FORMAT %s, using xrgb8888", name.constData());
+    return formats[PixelFormat::XRGB8888];
+}
+
+const PixelFormat &PixelFormat::requested()
+{
+    static const PixelFormat &format = requestedFormat();
+    return format;
+}
+
+// offset and length of red, green and blue, as fbdev describes them
+struct FbdevLayout {
+    PixelFormat::Id id;
+    int bpp;
+    int red[2];
+    int green[2];
+    int blue[2];
+};
+
+static const FbdevLayout fbdevLayouts[] = {
+    { PixelFormat::XRGB8888, 32, { 16, 8 }, { 8, 8 }, { 0, 8 } },
+    { PixelFormat::RGB565, 16, { 11, 5 }, { 5, 6 }, { 0, 5 } },
+    { PixelFormat::XRGB2101010, 32, { 20, 10 }, { 10, 10 }, { 0, 10 } }
+};
+
+static bool matches(const fb_bitfield &field, const int layout[2])
+{
+    return int(field.offset) == layout[0] && int(field.length) == layout[1] && !field.msb_right;
+}
+
+const PixelFormat *PixelFormat::fromFbdev(const fb_var_screeninfo &vinfo)
+{
+    // The alpha channel, if any, is ignored for scanout.
+    for (const FbdevLayout &layout : fbdevLayouts) {
+        if (int(vinfo.bits_per_pixel) == layout.bpp && matches(vinfo.red, layout.red)
+                && matches(vinfo.green, layout.green) && matches(vinfo.blue, layout.blue))
+            return &formats[layout.id];
+    }
+    return nullptr;
+}
+
+void PixelFormat::toFbdev(fb_var_screeninfo *vinfo) const
+{
+    for (const FbdevLayout &layout : fbdevLayouts) {
+        if (layout.id != id)
+            continue;
+        vinfo->bits_per_pixel = layout.bpp;
+        vinfo->red = fb_bitfield { uint32_t(layout.red[0]), uint32_t(layout.red[1]), 0 };
+        vinfo->green = fb_bitfield { uint32_t(layout.green[0]), uint32_t(layout.green[1]), 0 };
+        vinfo->blue = fb_bitfield { uint32_t(layout.blue[0]), uint32_t(layout.blue[1]), 0 };
+        vinfo->transp = fb_bitfield { 0, 0, 0 };
+        vinfo->grayscale = 0;
+        vinfo->nonstd = 0;
+    }
+}
+
+void fill16(uchar *dst, int dstPitch, int width, int height, quint16 value)
+{
+    if (width <= 0 || height <= 0)
+        return;
+    // A leading pixel when the rows start half way into a 32-bit word, then
+    // pairs, then a trailing pixel when one is left. Only works for all rows
+    // at once when the pitch keeps the alignment.
+    if (dstPitch % 4 != 0) {
+        for (int y = 0; y < height; ++y, dst += dstPitch) {
+            quint16 *p = reinterpret_cast<quint16 *>(dst);
+            for (int x = 0; x < width; ++x)
+                p[x] = value;
+        }
+        return;
+    }
+    const int lead = (quintptr(dst) & 2) ? 1 : 0;
+    const int pairs = (width - lead) / 2;
+    const int tail = width - lead - pairs * 2;
+    if (lead || tail) {
+        uchar *row = dst;
+        for (int y = 0; y < height; ++y, row += dstPitch) {
+            quint16 *p = reinterpret_cast<quint16 *>(row);
+            if (lead)
+                p[0] = value;
+            if (tail)
+                p[width - 1] = value;
+        }
+    }
+    if (pairs > 0)
+        pixelKernels().fill32(dst + lead * 2, dstPitch, pairs, height, quint32(value) << 16 | value);
+}
+
+void paintFill(const PixelFormat &format, void *bits, int pitch, const QRect &rect, QRgb color)
+{
+    QImage image = wrapRect(format, bits, pitch, rect);
+    QPainter p(&image);
+    p.setCompositionMode(QPainter::CompositionMode_Source);
+    p.fillRect(image.rect(), QColor::fromRgba(color));
+}
+
+void fillRect(const PixelFormat &format, void *bits, int pitch, const QRect &rect, QRgb color)
+{
+    switch (format.id) {
+    case PixelFormat::XRGB8888:
+        fillRect<PixelFormat::XRGB8888>(bits, pitch, rect, color);
+        break;
+    case PixelFormat::ARGB8888:
+        fillRect<PixelFormat::ARGB8888>(bits, pitch, rect, color);
+        break;
+    case PixelFormat::RGB565:
+        fillRect<PixelFormat::RGB565>(bits, pitch, rect, color);
+        break;
+    case PixelFormat::XRGB2101010:
+        fillRect<PixelFormat::XRGB2101010>(bits, pitch, rect, color);
+        break;
+    }
+}
+
+void packPixels(const PixelFormat &format, void *dst, const QRgb *src, int count)
+{
+    switch (format.id) {
+    case PixelFormat::XRGB8888:
+        packPixels<PixelFormat::XRGB8888>(dst, src, count);
+        break;
+    case PixelFormat::ARGB8888:
+        packPixels<PixelFormat::ARGB8888>(dst, src, count);
+        break;
+    case PixelFormat::RGB565:
+        packPixels<PixelFormat::RGB565>(dst, src, count);
+        break;
+    case PixelFormat::XRGB2101010:
+        packPixels<PixelFormat::XRGB2101010>(dst, src, count);
+        break;
+    }
+}
+
+void copyRect(const PixelFormat &format, void *dstBits, int dstPitch, const void *srcBits, int srcPitch,
+              const QRect &rect)
+{
+    if (format.id != PixelFormat::XRGB8888 && pixelKernels().qpainter) {
+        QImage image = wrapRect(format, dstBits, dstPitch, rect);
+        QPainter p(&image);
+        p.setCompositionMode(QPainter::CompositionMode_Source);
+        p.drawImage(0, 0, wrapRect(format, const_cast<void *>(srcBits), srcPitch, rect));
+        return;
+    }
+    const int bytesPerPixel = format.bytesPerPixel();
+    uchar *dst = static_cast<uchar *>(dstBits) + rect.y() * dstPitch + rect.x() * bytesPerPixel;
+    const uchar *src = static_cast<const uchar *>(srcBits) + rect.y() * srcPitch + rect.x() * bytesPerPixel;
+    const int bytes = rect.width() * bytesPerPixel;
+    // copy32 does not care what the words hold
+    if (bytes % 4 == 0 && !(quintptr(dst) & 3) && !(quintptr(src) & 3) && !(dstPitch & 3) && !(srcPitch & 3)) {
+        pixelKernels().copy32(dst, dstPitch, src, srcPitch, bytes / 4, rect.height());
+    } else {
+        for (int y = 0; y < rect.height(); ++y, dst += dstPitch, src += srcPitch)
+            memcpy(dst, src, bytes);
+    }
+}
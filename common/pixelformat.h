@@ -0,0 +1,131 @@
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <QtGlobal>
+#include <QRect>
+#include <QImage>
+#include <QColor>
+#include <stdint.h>
+#include "pixelkernels.h"
+
+struct fb_var_screeninfo;
+
+// The formats the back ends can scan out. Colors are 0xAARRGGBB everywhere
+// and only get packed by the writers below, once per fill.
+//
+// DRMFBTEST_FORMAT=rgb565, xrgb2101010 or xrgb8888 (the default) selects the
+// format of the scanout buffers. The DRM back ends fall back to XRGB8888 when
+// the driver cannot scan the requested one out, legacy_fb asks fbdev for it
+// and otherwise takes what the device is set to.
+struct PixelFormat {
+    enum Id {
+        XRGB8888,
+        ARGB8888,
+        RGB565,
+        XRGB2101010
+    };
+
+    Id id;
+    uint32_t fourcc; // DRM_FORMAT_*
+    int bpp;
+    int depth; // for drmModeAddFB
+    QImage::Format imageFormat;
+    const char *name;
+
+    int bytesPerPixel() const { return bpp / 8; }
+
+    static const PixelFormat &get(Id id);
+    static const PixelFormat *fromFourcc(uint32_t fourcc);
+    static const PixelFormat &requested();
+
+    // The format described by the bitfields, or null for anything else.
+    static const PixelFormat *fromFbdev(const fb_var_screeninfo &vinfo);
+    void toFbdev(fb_var_screeninfo *vinfo) const;
+};
+
+template <PixelFormat::Id Format> struct PixelTraits;
+
+template <> struct PixelTraits<PixelFormat::XRGB8888> {
+    typedef quint32 Pixel;
+    static Pixel pack(QRgb c) { return c & 0xffffff; }
+};
+
+template <> struct PixelTraits<PixelFormat::ARGB8888> {
+    typedef quint32 Pixel;
+    static Pixel pack(QRgb c) { return c; } // premultiplied already
+};
+
+template <> struct PixelTraits<PixelFormat::RGB565> {
+    typedef quint16 Pixel;
+    static Pixel pack(QRgb c) {
+        return ((c >> 8) & 0xf800) | ((c >> 5) & 0x07e0) | ((c >> 3) & 0x001f);
+    }
+};
+
+template <> struct PixelTraits<PixelFormat::XRGB2101010> {
+    typedef quint32 Pixel;
+    // the top bits are repeated at the bottom so that white stays white
+    static Pixel pack(QRgb c) {
+        const quint32 r = qRed(c), g = qGreen(c), b = qBlue(c);
+        return ((r << 2 | r >> 6) << 20) | ((g << 2 | g >> 6) << 10) | (b << 2 | b >> 6);
+    }
+};
+
+// Fills width x height 16 bpp pixels, in pairs through fill32 where the rows
+// allow it.
+void fill16(uchar *dst, int dstPitch, int width, int height, quint16 value);
+
+inline void fillPixels(uchar *dst, int dstPitch, int width, int height, quint32 value)
+{
+    pixelKernels().fill32(dst, dstPitch, width, height, value);
+}
+
+inline void fillPixels(uchar *dst, int dstPitch, int width, int height, quint16 value)
+{
+    fill16(dst, dstPitch, width, height, value);
+}
+
+// For DRMFBTEST_KERNELS=qpainter, on an image in the actual format.
+void paintFill(const PixelFormat &format, void *bits, int pitch, const QRect &rect, QRgb color);
+
+// Fills rect of a buffer in Format with color. The format being a template
+// argument, packing happens once and there is no per-pixel dispatch.
+template <PixelFormat::Id Format>
+inline void fillRect(void *bits, int pitch, const QRect &rect, QRgb color)
+{
+    typedef PixelTraits<Format> Traits;
+    if (Format != PixelFormat::XRGB8888 && pixelKernels().qpainter) {
+        paintFill(PixelFormat::get(Format), bits, pitch, rect, color);
+        return;
+    }
+    uchar *dst = static_cast<uchar *>(bits) + rect.y() * pitch + rect.x() * int(sizeof(typename Traits::Pixel));
+    fillPixels(dst, pitch, rect.width(), rect.height(), Traits::pack(color));
+}
+
+// Packs count ARGB32 pixels from src into dst.
+template <PixelFormat::Id Format>
+inline void packPixels(void *dst, const QRgb *src, int count)
+{
+    typedef PixelTraits<Format> Traits;
+    typename Traits::Pixel *d = static_cast<typename Traits::Pixel *>(dst);
+    for (int i = 0; i < count; ++i)
+        d[i] = Traits::pack(src[i]);
+}
+
+// The same for when the format is only known at runtime, one switch per
+// call.
+void fillRect(const PixelFormat &format, void *bits, int pitch, const QRect &rect, QRgb color);
+void packPixels(const PixelFormat &format, void *dst, const QRgb *src, int count);
+
+// Copies rect between two buffers in format.
+void copyRect(const PixelFormat &format, void *dstBits, int dstPitch, const void *srcBits, int srcPitch,
+              const QRect &rect);
+
+// Wraps rect of a mapped buffer in a QImage, like wrapRect32().
+inline QImage wrapRect(const PixelFormat &format, void *bits, int pitch, const QRect &rect)
+{
+    uchar *p = static_cast<uchar *>(bits) + rect.y() * pitch + rect.x() * format.bytesPerPixel();
+    return QImage(p, rect.width(), rect.height(), pitch, format.imageFormat);
+}
+
+#endif
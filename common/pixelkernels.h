@@ -0,0 +1,64 @@
+#ifndef PIXELKERNELS_H
+#define PIXELKERNELS_H
+
+#include <QtGlobal>
+#include <QRect>
+#include <QImage>
+
+// Fill, copy and blend routines for 32 bpp pixels, picked at runtime based
+// on what the CPU supports. The destination is typically a write-combined
+// dumb buffer or fbdev mapping, so everything writes whole rows front to
+// back and large rows are written with streaming stores where available.
+//
+// Set DRMFBTEST_KERNELS=scalar to force the plain C++ loops for comparison,
+// qpainter to go through QPainter on images wrapping the destination, or
+// avx2 for AVX2 fills and copies too, which are slower than SSE2 where they
+// were measured.
+
+struct PixelKernels {
+    // Fills width x height pixels starting at dst.
+    void (*fill32)(uchar *dst, int dstPitch, int width, int height, quint32 value);
+    // Copies width x height pixels, the rectangles must not overlap.
+    void (*copy32)(uchar *dst, int dstPitch, const uchar *src, int srcPitch, int width, int height);
+    // Composites premultiplied ARGB32 src over dst (SourceOver).
+    void (*blend32)(uchar *dst, int dstPitch, const uchar *src, int srcPitch, int width, int height);
+    const char *name;
+    // Whether the above go through QPainter, which only knows RGB32 here.
+    bool qpainter;
+};
+
+const PixelKernels &pixelKernels();
+
+// Wraps rect of a mapped 32 bpp buffer in a QImage without copying, so that
+// QPainter draws straight into it. The memory has to stay mapped for as long
+// as the image is in use. Each call returns a fresh image: painting on a copy
+// of one that is shared would detach it and paint into the copy instead.
+inline QImage wrapRect32(void *bits, int pitch, const QRect &rect)
+{
+    uchar *p = static_cast<uchar *>(bits) + rect.y() * pitch + rect.x() * 4;
+    return QImage(p, rect.width(), rect.height(), pitch, QImage::Format_RGB32);
+}
+
+inline void fillRect32(void *bits, int pitch, const QRect &rect, quint32 value)
+{
+    uchar *dst = static_cast<uchar *>(bits) + rect.y() * pitch + rect.x() * 4;
+    pixelKernels().fill32(dst, pitch, rect.width(), rect.height(), value);
+}
+
+inline void copyRect32(void *dstBits, int dstPitch, const void *srcBits, int srcPitch,
+                       const QRect &rect)
+{
+    uchar *dst = static_cast<uchar *>(dstBits) + rect.y() * dstPitch + rect.x() * 4;
+    const uchar *src = static_cast<const uchar *>(srcBits) + rect.y() * srcPitch + rect.x() * 4;
+    pixelKernels().copy32(dst, dstPitch, src, srcPitch, rect.width(), rect.height());
+}
+
+inline void blendRect32(void *dstBits, int dstPitch, const void *srcBits, int srcPitch,
+                        const QRect &rect)
+{
+    uchar *dst = static_cast<uchar *>(dstBits) + rect.y() * dstPitch + rect.x() * 4;
+    const uchar *src = static_cast<const uchar *>(srcBits) + rect.y() * srcPitch + rect.x() * 4;
+    pixelKernels().blend32(dst, dstPitch, src, srcPitch, rect.width(), rect.height());
+}
+
+#endif
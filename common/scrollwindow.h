@@ -0,0 +1,47 @@
+#ifndef SCROLLWINDOW_H
+#define SCROLLWINDOW_H
+
+#include <QtGlobal>
+
+// The visible part of a buffer twice the height of the screen, so that
+// scrolling moves the window instead of the pixels. Once the window would
+// leave the buffer, the rows that stay visible are copied to the other end,
+// which is off screen at that point: one screenful of copying for every
+// screenful scrolled.
+class ScrollWindow
+{
+public:
+    // Rows to copy within the buffer before showing the new offset.
+    struct Move {
+        int from = 0;
+        int to = 0;
+        int rows = 0;
+    };
+
+    void reset(int height) { m_height = height; m_offset = 0; }
+    bool isNull() const { return !m_height; }
+    int offset() const { return m_offset; }
+
+    // Contents move up by dy rows, down for negative dy, |dy| < height.
+    Move scroll(int dy)
+    {
+        Move move;
+        int offset = m_offset + dy;
+        if (offset < 0 || offset > m_height) {
+            // start over at the end the window moves away from
+            const int base = dy > 0 ? 0 : m_height;
+            move.from = m_offset + qMax(dy, 0);
+            move.to = base + qMax(-dy, 0);
+            move.rows = m_height - qAbs(dy);
+            offset = base;
+        }
+        m_offset = offset;
+        return move;
+    }
+
+private:
+    int m_height = 0;
+    int m_offset = 0;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "shadowbuffer.h"
+#include "hostmemory.h"
+#include <string.h>
+
+static const int CacheLine = 64;
+
+bool ShadowBuffer::isRequested()
+{
+    return qEnvironmentVariableIntValue("DRMFBTEST_SHADOW");
+}
+
+bool ShadowBuffer::create(const QSize &size, const PixelFormat &format)
+{
+    destroy();
+    m_format = &format;
+    m_pitch = (size.width() * format.bytesPerPixel() + CacheLine - 1) / CacheLine * CacheLine;
+    const size_t bytes = size_t(m_pitch) * size.height();
+    // zeroed, same as a fresh dumb buffer
+    m_bits = HostMemory::allocate(bytes);
+    if (!m_bits) {
+        qWarning("Failed to allocate %zu bytes for the shadow buffer", bytes);
+        m_pitch = 0;
+        return false;
+    }
+    m_size = size;
+    qDebug("Shadow buffer for size %dx%d, %s, pitch %d, at %p", size.width(), size.height(), format.name,
+           m_pitch, m_bits.data());
+    return true;
+}
+
+void ShadowBuffer::destroy()
+{
+    m_bits.reset();
+    m_pitch = 0;
+    m_size = QSize();
+}
+
+QImage ShadowBuffer::image() const
+{
+    return m_bits ? wrapRect(*m_format, m_bits.data(), m_pitch, QRect(QPoint(0, 0), m_size)) : QImage();
+}
+
+QRegion ShadowBuffer::alignedRegion(const QRegion &region) const
+{
+    // Both sides hold the same pixels outside of region, copying a few more
+    // is cheaper than partial line writes to write-combined memory.
+    const int pixelsPerLine = CacheLine / m_format->bytesPerPixel();
+    const QRect bounds(QPoint(0, 0), m_size);
+    QRegion aligned;
+    for (const QRect &rect : region) {
+        const int left = rect.left() / pixelsPerLine * pixelsPerLine;
+        const int right = (rect.right() / pixelsPerLine + 1) * pixelsPerLine - 1;
+        aligned += QRect(QPoint(left, rect.top()), QPoint(right, rect.bottom())).intersected(bounds);
+    }
+    return aligned;
+}
+
+QRect ShadowBuffer::scroll(int dy)
+{
+    const int height = m_size.height();
+    if (!m_bits || !dy)
+        return QRect();
+    if (qAbs(dy) >= height)
+        return QRect(QPoint(0, 0), m_size);
+    // Rows are contiguous, one memmove moves them all. Cached memory, so
+    // reading it back is fine.
+    uchar *bits = m_bits.data();
+    const size_t bytes = size_t(m_pitch) * (height - qAbs(dy));
+    if (dy > 0) {
+        memmove(bits, bits + size_t(m_pitch) * dy, bytes);
+        return QRect(0, height - dy, m_size.width(), dy);
+    }
+    memmove(bits + size_t(m_pitch) * -dy, bits, bytes);
+    return QRect(0, 0, m_size.width(), -dy);
+}
+
+void ShadowBuffer::flush(void *dst, int dstPitch, const QRegion &region) const
+{
+    if (!m_bits)
+        return;
+    for (const QRect &r : alignedRegion(region))
+        copyRect(*m_format, dst, dstPitch, m_bits.data(), m_pitch, r);
+}
@@ -0,0 +1,53 @@
+#ifndef SHADOWBUFFER_H
+#define SHADOWBUFFER_H
+
+#include <QSize>
+#include <QRect>
+#include <QRegion>
+#include <QImage>
+#include <QSharedPointer>
+#include "pixelformat.h"
+
+// A copy of the screen contents in cached system memory. Everything is drawn
+// here, including anything that has to read back like blending or scrolling,
+// and only the rects that changed are then streamed to the write-combined
+// mapping with full cache line writes. The memory comes from HostMemory.
+//
+// Set DRMFBTEST_SHADOW=1 to use one for each output.
+class ShadowBuffer
+{
+public:
+    static bool isRequested();
+
+    // Copies share the memory, like copies of a Framebuffer share the
+    // mapping. It is freed with the last one. The format is that of the
+    // buffers it is flushed to.
+    bool create(const QSize &size, const PixelFormat &format = PixelFormat::get(PixelFormat::XRGB8888));
+    void destroy();
+
+    bool isNull() const { return !m_bits; }
+    void *bits() const { return m_bits.data(); }
+    int pitch() const { return m_pitch; }
+    QSize size() const { return m_size; }
+    const PixelFormat &format() const { return *m_format; }
+    QImage image() const;
+
+    // What to copy for region so that every row starts and ends on a 64 byte
+    // boundary of a buffer with a 64 byte aligned pitch, clipped to the size.
+    QRegion alignedRegion(const QRegion &region) const;
+
+    // Copies region from the shadow buffer to dst, which has the same size.
+    void flush(void *dst, int dstPitch, const QRegion &region) const;
+
+    // Moves the contents up by dy rows, down for negative dy, and returns
+    // the rows that scrolled in, which are left as they were.
+    QRect scroll(int dy);
+
+private:
+    QSharedPointer<uchar> m_bits;
+    int m_pitch = 0;
+    QSize m_size;
+    const PixelFormat *m_format = &PixelFormat::get(PixelFormat::XRGB8888);
+};
+
+#endif
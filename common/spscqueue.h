@@ -0,0 +1,53 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <QVector>
+#include <QAtomicInt>
+#include <utility>
+
+// A fixed size ring for one producer and one consumer thread, without
+// locks: the producer only moves the head, the consumer only the tail, and
+// a slot between them belongs to the consumer. Values are moved in and out,
+// so implicitly shared ones cost no reference counting across threads.
+template <typename T>
+class SpscQueue
+{
+public:
+    explicit SpscQueue(int capacity) : m_slots(capacity + 1) { }
+
+    int capacity() const { return m_slots.count() - 1; }
+    bool isEmpty() const { return m_tail.loadAcquire() == m_head.loadAcquire(); }
+    bool isFull() const { return next(m_head.loadAcquire()) == m_tail.loadAcquire(); }
+
+    // producer only, false when full
+    bool push(T value)
+    {
+        const int head = m_head.load();
+        if (next(head) == m_tail.loadAcquire())
+            return false;
+        m_slots[head] = std::move(value);
+        m_head.storeRelease(next(head));
+        return true;
+    }
+
+    // consumer only, false when empty
+    bool pop(T *value)
+    {
+        const int tail = m_tail.load();
+        if (tail == m_head.loadAcquire())
+            return false;
+        *value = std::move(m_slots[tail]);
+        m_slots[tail] = T();
+        m_tail.storeRelease(next(tail));
+        return true;
+    }
+
+private:
+    int next(int index) const { return (index + 1) % m_slots.count(); }
+
+    QVector<T> m_slots;
+    QAtomicInt m_head; // next slot to fill
+    QAtomicInt m_tail; // next slot to take
+};
+
+#endif
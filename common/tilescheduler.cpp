@@ -0,0 +1,150 @@
+#include "tilescheduler.h"
+#include <QThread>
+
+class TileWorker : public QThread
+{
+public:
+    TileWorker(TileScheduler *scheduler, int index)
+        : m_scheduler(scheduler), m_index(index) { }
+
+protected:
+    void run() override;
+
+private:
+    TileScheduler *m_scheduler;
+    int m_index;
+};
+
+void TileWorker::run()
+{
+    quint64 seen = 0;
+    for (;;) {
+        {
+            QMutexLocker locker(&m_scheduler->m_mutex);
+            while (m_scheduler->m_generation == seen && !m_scheduler->m_quit)
+                m_scheduler->m_batchReady.wait(&m_scheduler->m_mutex);
+            if (m_scheduler->m_quit)
+                return;
+            seen = m_scheduler->m_generation;
+        }
+        m_scheduler->work(m_index);
+    }
+}
+
+TileScheduler::TileScheduler(int threadCount)
+{
+    if (qEnvironmentVariableIsSet("DRMFBTEST_RENDER_THREADS"))
+        threadCount = qEnvironmentVariableIntValue("DRMFBTEST_RENDER_THREADS");
+    if (threadCount <= 0)
+        threadCount = QThread::idealThreadCount();
+    threadCount = qMax(1, threadCount);
+
+    for (int i = 0; i < threadCount; ++i)
+        m_queues.append(new Queue);
+    for (int i = 1; i < threadCount; ++i) {
+        TileWorker *worker = new TileWorker(this, i);
+        worker->start();
+        m_workers.append(worker);
+    }
+    qDebug("Rendering with %d threads", threadCount);
+}
+
+TileScheduler::~TileScheduler()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+        m_batchReady.wakeAll();
+    }
+    for (TileWorker *worker : m_workers) {
+        worker->wait();
+        delete worker;
+    }
+    qDeleteAll(m_queues);
+}
+
+void TileScheduler::run(const QVector<Job> &jobs)
+{
+    if (jobs.isEmpty())
+        return;
+    if (m_workers.isEmpty() || jobs.count() == 1) {
+        for (const Job &job : jobs)
+            job();
+        return;
+    }
+
+    const int count = jobs.count();
+    const int chunk = (count + m_queues.count() - 1) / m_queues.count();
+    m_remaining.store(count);
+    for (int i = 0; i < m_queues.count(); ++i) {
+        Queue *q = m_queues[i];
+        QMutexLocker queueLocker(&q->lock);
+        q->jobs = &jobs;
+        q->head = qMin(count, i * chunk);
+        q->tail = qMin(count, (i + 1) * chunk);
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        ++m_generation;
+        m_batchReady.wakeAll();
+    }
+
+    work(0);
+
+    QMutexLocker locker(&m_mutex);
+    while (m_remaining.load() > 0)
+        m_batchDone.wait(&m_mutex);
+}
+
+const TileScheduler::Job *TileScheduler::take(int queue, bool steal)
+{
+    Queue *q = m_queues[queue];
+    QMutexLocker locker(&q->lock);
+    if (q->head >= q->tail)
+        return nullptr;
+    // own work from the back, stolen work from the front, which keeps the
+    // owner walking a contiguous part of the buffer
+    return &q->jobs->at(steal ? q->head++ : --q->tail);
+}
+
+void TileScheduler::work(int self)
+{
+    for (;;) {
+        const Job *job = take(self, false);
+        for (int i = 1; !job && i < m_queues.count(); ++i)
+            job = take((self + i) % m_queues.count(), true);
+        if (!job)
+            return;
+
+        (*job)();
+
+        if (m_remaining.fetchAndAddOrdered(-1) == 1) {
+            QMutexLocker locker(&m_mutex);
+            m_batchDone.wakeAll();
+        }
+    }
+}
+
+QVector<QRect> TileScheduler::horizontalTiles(const QRect &rect, int pitch, int bytesPerPixel, int tileBytes)
+{
+    QVector<QRect> tiles;
+    if (rect.isEmpty())
+        return tiles;
+
+    // Rows y with y * pitch on a 64 byte boundary are the ones tiles may
+    // start at. Usually that is every row.
+    int alignRows = 1;
+    while ((alignRows * pitch) % 64 && alignRows < 64)
+        ++alignRows;
+    int rows = qMax(1, tileBytes / (rect.width() * bytesPerPixel));
+    rows = (rows + alignRows - 1) / alignRows * alignRows;
+
+    int y = rect.top();
+    while (y <= rect.bottom()) {
+        const int next = qMin(rect.bottom() + 1, (y / rows + 1) * rows);
+        tiles.append(QRect(rect.left(), y, rect.width(), next - y));
+        y = next;
+    }
+    return tiles;
+}
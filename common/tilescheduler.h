@@ -0,0 +1,59 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <QVector>
+#include <QRect>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <functional>
+
+class TileWorker;
+
+// A small work-stealing pool for rasterizing tiles in parallel. Each batch is
+// split into one contiguous range per thread, threads take jobs from the back
+// of their own range and steal from the front of the others once they run dry.
+// The calling thread takes part, run() returns when the whole batch is done.
+//
+// DRMFBTEST_RENDER_THREADS overrides the number of threads, 1 disables the pool.
+class TileScheduler
+{
+public:
+    typedef std::function<void()> Job;
+
+    explicit TileScheduler(int threadCount = 0);
+    ~TileScheduler();
+
+    int threadCount() const { return m_queues.count(); }
+    void run(const QVector<Job> &jobs);
+
+    // Splits rect into horizontal strips of roughly tileBytes each. Strip
+    // boundaries fall on rows starting at a cache line, so no two tiles
+    // write to the same line.
+    static QVector<QRect> horizontalTiles(const QRect &rect, int pitch, int bytesPerPixel,
+                                          int tileBytes = 64 * 1024);
+
+private:
+    friend class TileWorker;
+
+    struct Queue {
+        QMutex lock;
+        const QVector<Job> *jobs = nullptr;
+        int head = 0; // stolen from here
+        int tail = 0; // owner takes from here
+    };
+
+    void work(int self);
+    const Job *take(int queue, bool steal);
+
+    QVector<Queue *> m_queues; // 0 is the caller's
+    QVector<TileWorker *> m_workers;
+    QAtomicInt m_remaining;
+    QMutex m_mutex;
+    QWaitCondition m_batchReady;
+    QWaitCondition m_batchDone;
+    quint64 m_generation = 0;
+    bool m_quit = false;
+};
+
+#endif
@@ -0,0 +1,223 @@
+#include "dmabufserver.h"
+#include <QSocketNotifier>
+#include <QtCore/private/qcore_unix_p.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+
+// per client, allocated and not presented, so that a runaway producer
+// cannot take all of the video memory
+static const int MaxAllocated = 8;
+
+DmaBufServer::DmaBufServer(const QByteArray &path, DumbBufferPool *pool, QObject *parent)
+    : QObject(parent),
+      m_path(path),
+      m_pool(pool)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (m_path.size() >= int(sizeof(addr.sun_path))) {
+        qWarning("DMA-BUF socket path %s too long", m_path.constData());
+        return;
+    }
+    memcpy(addr.sun_path, m_path.constData(), m_path.size());
+
+    m_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (m_socket == -1) {
+        qErrnoWarning(errno, "Failed to create DMA-BUF socket");
+        return;
+    }
+    unlink(m_path.constData());
+    if (bind(m_socket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(m_socket, 1) != 0) {
+        qErrnoWarning(errno, "Failed to listen on %s", m_path.constData());
+        qt_safe_close(m_socket);
+        m_socket = -1;
+        return;
+    }
+    m_listenNotifier = new QSocketNotifier(m_socket, QSocketNotifier::Read, this);
+    connect(m_listenNotifier, &QSocketNotifier::activated, this, &DmaBufServer::acceptClient);
+    qDebug("Accepting DMA-BUF producers on %s", m_path.constData());
+}
+
+DmaBufServer::~DmaBufServer()
+{
+    dropClient();
+    // the device hands back what it showed before this goes
+    for (SharedBuffer &shared : m_buffers)
+        m_pool->release(&shared.buffer);
+    delete m_listenNotifier;
+    if (m_socket != -1) {
+        qt_safe_close(m_socket);
+        unlink(m_path.constData());
+    }
+}
+
+void DmaBufServer::acceptClient()
+{
+    const int client = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (client == -1)
+        return;
+    if (m_client != -1) {
+        qWarning("Already serving a DMA-BUF producer, turning another one away");
+        qt_safe_close(client);
+        return;
+    }
+    m_client = client;
+    ++m_session;
+    m_clientNotifier = new QSocketNotifier(m_client, QSocketNotifier::Read, this);
+    connect(m_clientNotifier, &QSocketNotifier::activated, this, &DmaBufServer::handleMessage);
+    qDebug("DMA-BUF producer connected");
+}
+
+void DmaBufServer::handleMessage()
+{
+    DmaBufMessage message;
+    int fd = -1;
+    if (!receiveDmaBufMessage(m_client, &message, &fd)) {
+        dropClient();
+        return;
+    }
+    switch (message.type) {
+    case DmaBufMessage::Allocate:
+        allocate(message);
+        break;
+    case DmaBufMessage::Present:
+        presentShared(message, fd);
+        fd = -1;
+        break;
+    default:
+        qWarning("Unexpected DMA-BUF message %u", message.type);
+        break;
+    }
+    if (fd != -1)
+        qt_safe_close(fd);
+}
+
+void DmaBufServer::allocate(const DmaBufMessage &message)
+{
+    int allocated = 0;
+    for (const SharedBuffer &shared : m_buffers) {
+        if (shared.session == m_session && !shared.buffer.imported)
+            ++allocated;
+    }
+    SharedBuffer shared;
+    shared.cookie = m_nextCookie++;
+    shared.session = m_session;
+    shared.presented = false;
+    // not cleared by the pool, that would be a CPU write before the export
+    if (allocated >= MaxAllocated
+            || !m_pool->acquire(&shared.buffer, QSize(message.width, message.height), message.format, false)) {
+        qWarning("Cannot allocate a %ux%u buffer for the DMA-BUF producer", message.width, message.height);
+        DmaBufMessage reply;
+        reply.type = DmaBufMessage::Buffer;
+        sendDmaBufMessage(m_client, reply);
+        return;
+    }
+    if (!m_pool->exportBuffer(&shared.buffer)) {
+        m_pool->release(&shared.buffer);
+        DmaBufMessage reply;
+        reply.type = DmaBufMessage::Buffer;
+        sendDmaBufMessage(m_client, reply);
+        return;
+    }
+    {
+        DmaBufAccess access(shared.buffer.dmaBufFd, DmaBufAccess::Write);
+        memset(shared.buffer.p, 0, shared.buffer.size);
+    }
+
+    DmaBufMessage reply;
+    reply.type = DmaBufMessage::Buffer;
+    reply.width = shared.buffer.width;
+    reply.height = shared.buffer.height;
+    reply.format = shared.buffer.format;
+    reply.pitch = shared.buffer.pitch;
+    reply.cookie = shared.cookie;
+    if (!sendDmaBufMessage(m_client, reply, shared.buffer.dmaBufFd)) {
+        m_pool->release(&shared.buffer);
+        return;
+    }
+    m_buffers.append(shared);
+}
+
+void DmaBufServer::presentShared(const DmaBufMessage &message, int fd)
+{
+    if (fd == -1) {
+        // one of ours, back from the producer
+        for (SharedBuffer &shared : m_buffers) {
+            if (shared.session == m_session && shared.cookie == message.cookie && !shared.presented) {
+                shared.presented = true;
+                emit present(shared.buffer);
+                return;
+            }
+        }
+        qWarning("DMA-BUF producer presented unknown buffer %llu", (unsigned long long)message.cookie);
+        return;
+    }
+
+    DmaBufDescriptor descriptor;
+    descriptor.fd = fd;
+    descriptor.width = message.width;
+    descriptor.height = message.height;
+    descriptor.format = message.format;
+    descriptor.pitch = message.pitch;
+    descriptor.offset = message.offset;
+    SharedBuffer shared;
+    shared.cookie = message.cookie;
+    shared.session = m_session;
+    shared.presented = true;
+    if (!m_pool->importBuffer(&shared.buffer, descriptor)) {
+        // not shown, so it is free again right away
+        DmaBufMessage reply;
+        reply.type = DmaBufMessage::Release;
+        reply.cookie = message.cookie;
+        sendDmaBufMessage(m_client, reply);
+        return;
+    }
+    m_buffers.append(shared);
+    emit present(shared.buffer);
+}
+
+bool DmaBufServer::release(DumbBuffer *buffer)
+{
+    for (int i = 0; i < m_buffers.count(); ++i) {
+        SharedBuffer &shared(m_buffers[i]);
+        if (!shared.presented || shared.buffer.handle != buffer->handle || shared.buffer.fb != buffer->fb)
+            continue;
+        const bool current = m_client != -1 && shared.session == m_session;
+        if (current) {
+            DmaBufMessage reply;
+            reply.type = DmaBufMessage::Release;
+            reply.cookie = shared.cookie;
+            sendDmaBufMessage(m_client, reply);
+        }
+        if (current && !shared.buffer.imported) {
+            // the producer can render into it again
+            shared.presented = false;
+        } else {
+            m_pool->release(&shared.buffer);
+            m_buffers.remove(i);
+        }
+        *buffer = DumbBuffer();
+        return true;
+    }
+    return false;
+}
+
+void DmaBufServer::dropClient()
+{
+    if (m_client == -1)
+        return;
+    delete m_clientNotifier;
+    m_clientNotifier = nullptr;
+    qt_safe_close(m_client);
+    m_client = -1;
+    // What is on screen stays until release(), the rest goes.
+    for (int i = m_buffers.count() - 1; i >= 0; --i) {
+        if (!m_buffers[i].presented) {
+            m_pool->release(&m_buffers[i].buffer);
+            m_buffers.remove(i);
+        }
+    }
+    qDebug("DMA-BUF producer disconnected");
+}
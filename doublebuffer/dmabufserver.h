@@ -0,0 +1,59 @@
+#ifndef DMABUFSERVER_H
+#define DMABUFSERVER_H
+
+#include <QObject>
+#include <QVector>
+#include "dumbbufferpool.h"
+
+class QSocketNotifier;
+
+// Lets one producer in another process at a time, a video decoder or a
+// camera pipeline, put frames on screen without copying them. It either
+// renders into scanout buffers allocated here, or hands over DMA-BUFs of
+// its own, see DmaBufMessage. Each frame comes out of present() and has to
+// go back through release() once it is off screen, that is what tells the
+// producer it may reuse the buffer.
+class DmaBufServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Listens on the unix socket at path, replacing whatever is there.
+    DmaBufServer(const QByteArray &path, DumbBufferPool *pool, QObject *parent = nullptr);
+    ~DmaBufServer();
+
+    bool isValid() const { return m_socket != -1; }
+
+    // Takes back a buffer from present(). Returns false if it is not one
+    // of the producer's, the caller keeps it then.
+    bool release(DumbBuffer *buffer);
+
+signals:
+    void present(const DumbBuffer &buffer);
+
+private:
+    struct SharedBuffer {
+        DumbBuffer buffer;
+        uint64_t cookie;
+        int session; // of the client it was for
+        bool presented; // given out through present()
+    };
+
+    void acceptClient();
+    void handleMessage();
+    void allocate(const DmaBufMessage &message);
+    void presentShared(const DmaBufMessage &message, int fd);
+    void dropClient();
+
+    QByteArray m_path;
+    DumbBufferPool *m_pool;
+    int m_socket = -1;
+    int m_client = -1;
+    int m_session = 0;
+    uint64_t m_nextCookie = 1;
+    QSocketNotifier *m_listenNotifier = nullptr;
+    QSocketNotifier *m_clientNotifier = nullptr;
+    QVector<SharedBuffer> m_buffers;
+};
+
+#endif
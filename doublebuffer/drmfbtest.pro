@@ -1,4 +1,9 @@
 QT += core-private kms_support-private
 
-SOURCES = main.cpp
+CONFIG += link_pkgconfig
+PKGCONFIG += libudev
 
+HEADERS = swapchain.h hotplugmonitor.h dmabufserver.h presentbarrier.h
+SOURCES = main.cpp swapchain.cpp hotplugmonitor.cpp dmabufserver.cpp presentbarrier.cpp
+
+include(../common/common.pri)
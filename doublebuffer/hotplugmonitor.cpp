@@ -0,0 +1,58 @@
+#include "hotplugmonitor.h"
+#include <QSocketNotifier>
+#include <QByteArray>
+#include <libudev.h>
+
+static const int SettleTime = 200; // ms
+
+HotplugMonitor::HotplugMonitor(const QString &devicePath, QObject *parent)
+    : QObject(parent),
+      m_devicePath(devicePath.toLocal8Bit())
+{
+    m_udev = udev_new();
+    if (!m_udev) {
+        qWarning("Failed to get udev context, hotplug disabled");
+        return;
+    }
+    m_monitor = udev_monitor_new_from_netlink(m_udev, "udev");
+    if (!m_monitor) {
+        qWarning("Failed to create udev monitor, hotplug disabled");
+        return;
+    }
+    udev_monitor_filter_add_match_subsystem_devtype(m_monitor, "drm", nullptr);
+    if (udev_monitor_enable_receiving(m_monitor) < 0) {
+        qWarning("Failed to enable udev monitor, hotplug disabled");
+        udev_monitor_unref(m_monitor);
+        m_monitor = nullptr;
+        return;
+    }
+
+    m_notifier = new QSocketNotifier(udev_monitor_get_fd(m_monitor), QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &HotplugMonitor::handleEvent);
+
+    m_settleTimer.setSingleShot(true);
+    m_settleTimer.setInterval(SettleTime);
+    connect(&m_settleTimer, &QTimer::timeout, this, &HotplugMonitor::hotplug);
+    qDebug("Watching %s for hotplug", m_devicePath.constData());
+}
+
+HotplugMonitor::~HotplugMonitor()
+{
+    delete m_notifier;
+    if (m_monitor)
+        udev_monitor_unref(m_monitor);
+    if (m_udev)
+        udev_unref(m_udev);
+}
+
+void HotplugMonitor::handleEvent()
+{
+    struct udev_device *dev = udev_monitor_receive_device(m_monitor);
+    if (!dev)
+        return;
+    const char *devnode = udev_device_get_devnode(dev);
+    const char *hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+    if (devnode && m_devicePath == devnode && hotplug && qstrcmp(hotplug, "1") == 0)
+        m_settleTimer.start();
+    udev_device_unref(dev);
+}
@@ -0,0 +1,37 @@
+#ifndef HOTPLUGMONITOR_H
+#define HOTPLUGMONITOR_H
+
+#include <QObject>
+#include <QTimer>
+
+class QSocketNotifier;
+struct udev;
+struct udev_monitor;
+
+// Listens for the uevents the kernel sends when connectors on a DRM device
+// change. A flaky link tends to produce bursts of them, so hotplug() comes
+// once the device has been quiet for a moment.
+class HotplugMonitor : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit HotplugMonitor(const QString &devicePath, QObject *parent = nullptr);
+    ~HotplugMonitor();
+
+    bool isValid() const { return m_monitor != nullptr; }
+
+signals:
+    void hotplug();
+
+private:
+    void handleEvent();
+
+    QByteArray m_devicePath;
+    struct udev *m_udev = nullptr;
+    struct udev_monitor *m_monitor = nullptr;
+    QSocketNotifier *m_notifier = nullptr;
+    QTimer m_settleTimer;
+};
+
+#endif
@@ -1,43 +1,202 @@
 #include <QGuiApplication>
 #include <QTimer>
 #include <QElapsedTimer>
+#include <QRegion>
+#include <QHash>
+#include <QSocketNotifier>
+#include <QThread>
+#include <QScopedPointer>
+#include <QSharedPointer>
+#include <QMutex>
+#include <QSemaphore>
 #include <QtKmsSupport/private/qkmsdevice_p.h>
 #include <QtCore/private/qcore_unix_p.h>
 #include <sys/mman.h>
+#include <drm_fourcc.h>
+#include <algorithm>
+#include "pixelformat.h"
+#include "swapchain.h"
+#include "tilescheduler.h"
+#include "frametiming.h"
+#include "benchmark.h"
+#include "shadowbuffer.h"
+#include "dumbbufferpool.h"
+#include "hotplugmonitor.h"
+#include "framescheduler.h"
+#include "dmabufserver.h"
+#include "framecapture.h"
+#include "displaybackend.h"
+#include "demoscene.h"
+#include "drmdevices.h"
+#include "presentbarrier.h"
+#include "perfcounters.h"
+#include "drawlist.h"
+#include "spscqueue.h"
+#include "headlessdisplay.h"
 
-static const int BUFFER_COUNT = 2;
-
-class Device : public QKmsDevice
+class Device : public QObject, public QKmsDevice, public DisplayBackend
 {
+    Q_OBJECT
+
 public:
-    struct Framebuffer {
-        Framebuffer() : handle(0), pitch(0), size(0), fb(0), p(MAP_FAILED) { }
-        uint32_t handle;
-        uint32_t pitch;
-        uint64_t size;
-        uint32_t fb;
-        void *p;
+    typedef DumbBuffer Framebuffer;
+
+    typedef QHash<QByteArray, uint32_t> PropertyIds;
+
+    // An ARGB8888 buffer on its own overlay or cursor plane, composited
+    // by the display hardware. Moving it is a plane update, nothing gets
+    // redrawn.
+    struct Layer {
+        enum Type {
+            Overlay,
+            Cursor
+        };
+        Layer() : type(Overlay), planeId(0), committedFb(0) { }
+        Type type;
+        uint32_t planeId; // 0 for a legacy cursor
+        PropertyIds planeProps;
+        Framebuffer fb;
+        QRect geometry;
+        // Buffers replaced by setLayerBuffer() stay in use until the commit
+        // without them has flipped.
+        uint32_t committedFb;
+        QVector<Framebuffer> replaced; // still in the last commit
+        QVector<Framebuffer> retiring; // until the pending flip completes
     };
 
     struct Output {
-        Output() : backFb(0), flipped(false) { }
+        Output()
+            : active(false), format(&PixelFormat::get(PixelFormat::XRGB8888)), backFb(-1), flipPending(false),
+              layersDirty(false), planeId(0), modeBlob(0) { }
+        // what is rendered, the primary plane scales it to the mode
+        QSize size() const { return renderSize.isValid() ? renderSize : modeSize(); }
+        QSize modeSize() const {
+            const drmModeModeInfo &modeInfo(kmsOutput.modes[kmsOutput.mode]);
+            return QSize(modeInfo.hdisplay, modeInfo.vdisplay);
+        }
         QKmsOutput kmsOutput;
-        Framebuffer fb[2];
-        int backFb;
-        bool flipped;
+        bool active; // buffers allocated and mode set
+        bool vrrEnabled = false;
+        const PixelFormat *format; // of fb and shadow, layers are ARGB8888
+        QSize renderSize; // invalid for the size of the mode
+        QVector<Framebuffer> fb;
+        QVector<Framebuffer> retiringFb; // of the size before, until the next flip
+        ShadowBuffer shadow; // one for all buffers, always has the latest frame
+        Swapchain swapchain;
+        int backFb; // acquired for rendering, -1 if none
+        bool flipPending;
+        bool fbFlipPending = false; // the pending flip sets FB_ID, not only layers
+        QRegion damage; // accumulated for the frame being rendered
+        QRegion exposed; // scrolled into the shadow, still to be painted
+        QRegion flipDamage; // of the frame being flipped to, compared to the one on screen
+        FrameTiming timing;
+        PerfStats perf; // DRMFBTEST_PERF
+        PerfCounters::Sample perfStart; // of the frame being rendered
+        QVector<Layer> layers;
+        bool layersDirty; // to be committed with the next frame
+        QVector<uint32_t> overlayPlanes; // usable for layers
+        QVector<uint32_t> cursorPlanes;
+        // atomic only
+        uint32_t planeId; // primary plane
+        uint32_t modeBlob;
+        PropertyIds connectorProps;
+        PropertyIds crtcProps;
+        PropertyIds planeProps;
     };
 
-    Device(QKmsScreenConfig *screenConfig);
+    // card numbers the devices of one process, from 0. An empty path opens
+    // the DRMFBTEST_HEADLESS outputs instead, which are there right away,
+    // without createScreens(). They flip like legacy KMS without planes.
+    Device(QKmsScreenConfig *screenConfig, const QString &path, int card);
     bool open() override;
     void close() override;
 
-    void createFramebuffers();
+    // Both take indices into outputs(), so that some outputs can be brought
+    // up before others. The buffers are allocated in parallel on the
+    // scheduler's threads.
+    void createFramebuffers(TileScheduler *scheduler, const QVector<int> &outputs);
     void destroyFramebuffers();
-    void setMode();
+    // Outputs whose modeset fails while others are running stay inactive.
+    void setMode(const QVector<int> &outputs);
+    // DPMS standby for all active outputs, or back on. Buffers and modes
+    // stay as they are, so the last frame shows again right away.
+    void setStandby(bool standby);
+    // Renders output at size from the next frame on and has the primary
+    // plane scale it up to the mode, a plane update instead of a modeset.
+    // Atomic only. Otherwise the old size stays, for good when the plane
+    // cannot scale to the mode, until the next try when a frame is being
+    // rendered, the output is off or there are no buffers of that size.
+    enum RenderSizeResult {
+        RenderSizeSet,
+        RenderSizeLater,
+        RenderSizeUnsupported
+    };
+    RenderSizeResult setRenderSize(Output *output, const QSize &size);
+
+    bool beginFrame(Output *output);
+    void addDamage(Output *output, const QRect &rect);
+    QRegion repaintRegion(const Output *output) const;
+    void swapBuffers() override;
+
+    // DisplayBackend, on top of the above. Renders into the shadow buffer
+    // when there is one and brings the back buffer up to date in endFrame().
+    // Only the shadow buffer scrolls: the back buffers are all at different
+    // ages, moving one would leave the others behind by everything.
+    int outputCount() const override { return m_outputs.count(); }
+    QString outputName(int output) const override { return m_outputs[output].kmsOutput.name; }
+    QSize outputSize(int output) const override { return m_outputs[output].size(); }
+    FrameTiming *timing(int output) override { return &m_outputs[output].timing; }
+    PerfStats *perfStats(int output) override { return m_perf ? &m_outputs[output].perf : nullptr; }
+    bool beginFrame(int output, Surface *surface) override;
+    void endFrame(int output, const QRegion &damage) override;
+    bool scroll(int output, int dy) override;
+    // endFrame() copies from the shadow buffers in tiles on scheduler's
+    // threads when given one.
+    void setTileScheduler(TileScheduler *scheduler) { m_scheduler = scheduler; }
 
-    void swapBuffers(Output *output);
+    // Returns the index of the new layer in output->layers, or -1 if
+    // there is no suitable plane left.
+    int createLayer(Output *output, Layer::Type type, const QSize &size);
+    void moveLayer(Output *output, int layer, const QPoint &pos);
+    // Puts fb on an overlay layer, resizing it to fit. Takes over fb, also
+    // when the plane cannot scan it out.
+    bool setLayerBuffer(Output *output, int layer, const Framebuffer &fb);
+
+    // DRMFBTEST_DMABUF_SOCKET. Buffers from the server go back to it
+    // through releaseBuffer().
+    DmaBufServer *startDmaBufServer(const QByteArray &path);
+    void releaseBuffer(Framebuffer *fb);
+
+    // What rescanOutputs() did. removed has the old indices of the outputs
+    // that went away, highest first. added has the indices of the outputs
+    // that need buffers and a mode, new ones and ones whose mode is gone.
+    struct OutputChanges {
+        QVector<int> removed;
+        QVector<int> added;
+    };
+    // Probes the connectors again after a hotplug. Outputs that did not
+    // change keep scanning out what they have.
+    OutputChanges rescanOutputs();
 
     QVector<Output> *outputs() { return &m_outputs; }
+    void dumpTiming() const;
+
+    // Counts the sections of the frames into Output::perf. counters belong
+    // to the thread that runs the device.
+    void setPerfCounters(const PerfCounters *counters) { m_perf = counters; }
+    PerfCounters::Sample perfSample() const { return m_perf ? m_perf->read() : PerfCounters::Sample(); }
+
+    // DRMFBTEST_PRESENT_MODE=adaptive: frames come when the content changes,
+    // frames without damage are dropped in swapBuffers(), and outputs that
+    // can do variable refresh get VRR_ENABLED so that a flip is shown as
+    // soon as it lands. Needs atomic for VRR.
+    bool isAdaptive() const { return m_adaptive; }
+    bool isHeadless() const { return m_headless != nullptr; }
+
+signals:
+    // All pending flips have completed and buffers may have become free to
+    // render into.
+    void framePresented();
 
 private:
     void *nativeDisplay() const override;
@@ -47,22 +206,86 @@ private:
                         const QPoint &virtualPos,
                         const QList<QPlatformScreen *> &virtualSiblings) override;
 
-    bool createFramebuffer(Device::Output *output, int bufferIdx);
-    void destroyFramebuffer(Device::Output *output, int bufferIdx);
+    bool openHeadless();
+    void negotiateFormat();
+    bool allocateFramebuffers(TileScheduler *scheduler, const QVector<int> &outputs);
+    void disableLayers();
+    void disableVrr();
+    void captureFrontBuffer(Output *output);
+    void releaseLayer(Layer *layer);
+    void shutDownOutput(Output *output);
+    bool probeOutput(drmModeConnectorPtr connector, const QVector<uint32_t> &usedCrtcs, QKmsOutput *output);
+
+    bool discoverPlanes(const QVector<int> &outputs);
+    bool setModeAtomic(const QVector<int> &outputs);
+    void setModeLegacy(const QVector<int> &outputs);
+    struct Flip {
+        Output *output;
+        int index; // -1 when only layers change
+        QRegion damage; // compared to what is on screen
+    };
+    void addLayerProperties(drmModeAtomicReq *req, const Output *output);
+    void updateLayersLegacy(Output *output);
+    void present();
+    bool commitAtomic(const QVector<Flip> &flips);
+    bool flipLegacy(const Flip &flip);
+    void handleDrmEvent();
+    void waitForFlips();
+    bool dispatchEvents(drmEventContext *drmEvent);
+    bool readEvents(drmEventContext *drmEvent);
 
     static void pageFlipHandler(int fd, unsigned int sequence,
-                                unsigned int tv_sec, unsigned int tv_usec, void *user_data);
+                                unsigned int tv_sec, unsigned int tv_usec,
+                                unsigned int crtc_id, void *user_data);
+    static drmEventContext flipEventContext();
 
     QVector<Output> m_outputs;
+    bool m_hasAtomic = false;
+    bool m_warnedRenderSize = false;
+    int m_pendingFlips = 0;
+    QSocketNotifier *m_notifier = nullptr;
+    int m_bufferCount = 2;
+    Swapchain::PresentMode m_presentMode = Swapchain::Fifo;
+    bool m_adaptive = false;
+    bool m_useShadow = false;
+    const PixelFormat *m_format;
+    QVector<uint32_t> m_usedPlanes; // by layers, of any output
+    DumbBufferPool m_pool;
+    DmaBufServer *m_dmaBufServer = nullptr;
+    FrameCapture *m_capture = nullptr; // DRMFBTEST_CAPTURE
+    const PerfCounters *m_perf = nullptr;
+    TileScheduler *m_scheduler = nullptr;
+    HeadlessDisplay *m_headless = nullptr; // in place of the device
 };
 
-Device::Device(QKmsScreenConfig *screenConfig)
-    : QKmsDevice(screenConfig, QStringLiteral("/dev/dri/card0"))
+Device::Device(QKmsScreenConfig *screenConfig, const QString &path, int card)
+    : QKmsDevice(screenConfig, path),
+      m_format(&PixelFormat::requested())
 {
+    if (qEnvironmentVariableIsSet("DRMFBTEST_BUFFER_COUNT"))
+        m_bufferCount = qBound(2, qEnvironmentVariableIntValue("DRMFBTEST_BUFFER_COUNT"), 4);
+    const QByteArray presentMode = qgetenv("DRMFBTEST_PRESENT_MODE");
+    if (presentMode == "mailbox")
+        m_presentMode = Swapchain::Mailbox;
+    m_adaptive = presentMode == "adaptive"; // fifo for the frames that are made
+    m_useShadow = ShadowBuffer::isRequested();
+    // Records the primary planes, layers are composited by the display and
+    // never are in memory. Cards after the first get a file of their own,
+    // with the card number appended.
+    if (FrameCapture::isRequested()) {
+        QString capturePath = QString::fromLocal8Bit(qgetenv("DRMFBTEST_CAPTURE"));
+        if (card > 0)
+            capturePath += QLatin1Char('.') + QString::number(card);
+        m_capture = new FrameCapture(capturePath);
+    }
+    qDebug("Using %d buffers per output, %s", m_bufferCount,
+           m_adaptive ? "adaptive" : m_presentMode == Swapchain::Mailbox ? "mailbox" : "fifo");
 }
 
 bool Device::open()
 {
+    if (devicePath().isEmpty())
+        return openHeadless();
     int fd = qt_safe_open(devicePath().toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
     if (fd == -1) {
         qErrnoWarning("Could not open DRM device %s", qPrintable(devicePath()));
@@ -74,17 +297,77 @@ bool Device::open()
         qt_safe_close(fd);
         return false;
     }
+    if (qEnvironmentVariableIntValue("DRMFBTEST_NO_ATOMIC")) {
+        qDebug("Atomic modesetting disabled");
+    } else if (drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0) {
+        // implies DRM_CLIENT_CAP_UNIVERSAL_PLANES
+        m_hasAtomic = true;
+        qDebug("Using atomic modesetting");
+    } else {
+        qDebug("Atomic modesetting not supported, falling back to legacy");
+    }
+    uint64_t hasMonotonic = 0;
+    if (drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &hasMonotonic) == -1 || !hasMonotonic)
+        qWarning("Flip timestamps are not CLOCK_MONOTONIC, submit to flip latency will be off");
     setFd(fd);
+    m_pool.setFd(fd);
+    negotiateFormat();
+
+    m_notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &Device::handleDrmEvent);
+
+    return true;
+}
+
+// Buffers in memory, and flips that complete at the simulated vblank of
+// their output, see dispatchEvents(). The swapchains, shadow buffers,
+// capture and the flip handling are the same as with a device.
+bool Device::openHeadless()
+{
+    QScopedPointer<HeadlessDisplay> display(new HeadlessDisplay);
+    if (display->outputs().isEmpty() || display->fd() == -1)
+        return false;
+    m_headless = display.take();
+    m_pool.setHeadless(true);
+    negotiateFormat();
+    for (int i = 0; i < m_headless->outputs().count(); ++i)
+        createScreen(m_headless->kmsOutput(i));
+
+    m_notifier = new QSocketNotifier(m_headless->fd(), QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &Device::handleDrmEvent);
+
     return true;
 }
 
 void Device::close()
 {
-    for (Output &output : m_outputs)
+    // Not a part of the mode, cleanup() would leave it on.
+    disableVrr();
+
+    for (Output &output : m_outputs) {
         output.kmsOutput.cleanup(this); // restore mode
+        if (output.modeBlob)
+            drmModeDestroyPropertyBlob(fd(), output.modeBlob);
+    }
 
     m_outputs.clear();
 
+    // gives back what the producer did not present
+    delete m_dmaBufServer;
+    m_dmaBufServer = nullptr;
+    delete m_capture;
+    m_capture = nullptr;
+
+    // nothing is on screen anymore
+    m_pool.dumpStats();
+    m_pool.clear();
+
+    delete m_notifier;
+    m_notifier = nullptr;
+    delete m_headless;
+    m_headless = nullptr;
+    m_pool.setHeadless(false);
+
     if (fd() != -1) {
         qt_safe_close(fd());
         setFd(-1);
@@ -118,215 +401,2014 @@ void Device::registerScreen(QPlatformScreen *screen,
     Q_UNUSED(virtualSiblings);
 }
 
-bool Device::createFramebuffer(Device::Output *output, int bufferIdx)
+void Device::createFramebuffers(TileScheduler *scheduler, const QVector<int> &outputs)
 {
-    drmModeModeInfo &modeInfo(output->kmsOutput.modes[output->kmsOutput.mode]);
-    const uint32_t w = modeInfo.hdisplay;
-    const uint32_t h = modeInfo.vdisplay;
-    drm_mode_create_dumb creq = {
-        h,
-        w,
-        32,
-        0, 0, 0, 0
-    };
-    if (drmIoctl(fd(), DRM_IOCTL_MODE_CREATE_DUMB, &creq) == -1) {
-        qErrnoWarning(errno, "Failed to create dumb buffer");
-        return false;
+    // Without atomic the planes were not checked, the kernel has the final
+    // word then. Outputs that are up already keep their format, later ones
+    // do not try again.
+    if (!allocateFramebuffers(scheduler, outputs) && m_format->id != PixelFormat::XRGB8888) {
+        qWarning("No %s framebuffers, falling back to xrgb8888", m_format->name);
+        for (int index : outputs) {
+            for (int i = 0; i < m_outputs[index].fb.count(); ++i)
+                m_pool.release(&m_outputs[index].fb[i]);
+        }
+        m_format = &PixelFormat::get(PixelFormat::XRGB8888);
+        allocateFramebuffers(scheduler, outputs);
     }
 
-    Framebuffer &fb(output->fb[bufferIdx]);
-    fb.handle = creq.handle;
-    fb.pitch = creq.pitch;
-    fb.size = creq.size;
-    qDebug("Got a dumb buffer for size %dx%d, handle %u, pitch %u, size %lu", w, h, fb.handle, fb.pitch, fb.size);
+    // Except the one the modeset shows.
+    QVector<TileScheduler::Job> jobs;
+    for (int index : outputs) {
+        const Framebuffer &fb(m_outputs[index].fb[0]);
+        const PixelFormat &format(*m_outputs[index].format);
+        if (fb.p == MAP_FAILED)
+            continue;
+        void *p = fb.p;
+        const int pitch = fb.pitch;
+        for (const QRect &tile : TileScheduler::horizontalTiles(QRect(0, 0, fb.width, fb.height), pitch, format.bytesPerPixel()))
+            jobs.append([&format, p, pitch, tile] { fillRect(format, p, pitch, tile, 0); });
+    }
+    scheduler->run(jobs);
+}
 
-    if (drmModeAddFB(fd(), w, h, 24, 32, fb.pitch, fb.handle, &fb.fb) == -1) {
-        qErrnoWarning(errno, "Failed to add FB");
-        return false;
+bool Device::allocateFramebuffers(TileScheduler *scheduler, const QVector<int> &outputs)
+{
+    QVector<TileScheduler::Job> jobs;
+    QAtomicInt failed;
+    const uint32_t fourcc = m_format->fourcc;
+    for (int index : outputs) {
+        Output &output(m_outputs[index]);
+        output.format = m_format;
+        output.renderSize = QSize(); // a modeset starts out unscaled
+        output.fb.resize(m_bufferCount);
+        output.swapchain.reset(m_bufferCount, m_presentMode);
+        if (m_useShadow)
+            output.shadow.create(output.size(), *m_format);
+        output.backFb = -1;
+        output.flipPending = false;
+        output.fbFlipPending = false;
+        output.damage = QRegion();
+
+        // The swapchain has every buffer painted completely the first time
+        // it is handed out, the benchmarks paint Surface::behind as well,
+        // so nothing needs clearing here.
+        Framebuffer *fbs = output.fb.data();
+        const QSize size = output.size();
+        for (int i = 0; i < m_bufferCount; ++i) {
+            jobs.append([this, fbs, i, size, fourcc, &failed] {
+                if (!m_pool.acquire(&fbs[i], size, fourcc, false))
+                    failed.ref();
+            });
+        }
     }
+    scheduler->run(jobs);
+    if (failed.load())
+        qWarning("Failed to create %d framebuffers", failed.load());
+    return !failed.load();
+}
 
-    drm_mode_map_dumb mreq = {
-        fb.handle,
-        0, 0
-    };
-    if (drmIoctl(fd(), DRM_IOCTL_MODE_MAP_DUMB, &mreq) == -1) {
-        qErrnoWarning(errno, "Failed to map dumb buffer");
-        return false;
+void Device::destroyFramebuffers()
+{
+    // do not pull buffers from under a flip that is still queued
+    waitForFlips();
+
+    // The pool keeps the FBs alive, so the planes have to be turned off
+    // before the buffers go back.
+    disableLayers();
+    m_usedPlanes.clear();
+
+    for (Output &output : m_outputs) {
+        for (Layer &layer : output.layers)
+            releaseLayer(&layer);
+        output.layers.clear();
+        output.layersDirty = false;
+        for (int i = 0; i < output.fb.count(); ++i)
+            m_pool.release(&output.fb[i]);
+        output.fb.clear();
+        for (Framebuffer &fb : output.retiringFb)
+            m_pool.release(&fb);
+        output.retiringFb.clear();
+        output.active = false;
+        output.shadow.destroy();
     }
-    fb.p = mmap(0, fb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd(), mreq.offset);
-    if (fb.p == MAP_FAILED) {
-        qErrnoWarning(errno, "Failed to mmap dumb buffer");
-        return false;
+}
+
+static Device::PropertyIds propertyIds(int fd, uint32_t objectId, uint32_t objectType)
+{
+    Device::PropertyIds ids;
+    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, objectId, objectType);
+    if (!props)
+        return ids;
+    for (uint32_t i = 0; i < props->count_props; ++i) {
+        drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+        if (prop) {
+            ids.insert(QByteArray(prop->name), prop->prop_id);
+            drmModeFreeProperty(prop);
+        }
+    }
+    drmModeFreeObjectProperties(props);
+    return ids;
+}
+
+static uint64_t propertyValue(int fd, uint32_t objectId, uint32_t objectType, uint32_t propId)
+{
+    uint64_t value = 0;
+    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, objectId, objectType);
+    if (!props)
+        return value;
+    for (uint32_t i = 0; i < props->count_props; ++i) {
+        if (props->props[i] == propId)
+            value = props->prop_values[i];
     }
+    drmModeFreeObjectProperties(props);
+    return value;
+}
 
-    qDebug("FB is %u, mapped at %p", fb.fb, fb.p);
-    memset(fb.p, 0, fb.size);
+static void addProperty(drmModeAtomicReq *req, uint32_t objectId,
+                        const Device::PropertyIds &props, const char *name, uint64_t value)
+{
+    const uint32_t propId = props.value(QByteArray(name));
+    if (propId)
+        drmModeAtomicAddProperty(req, objectId, propId, value);
+    else
+        qWarning("Property %s not found on object %u", name, objectId);
+}
 
-    return true;
+static bool hasFormat(drmModePlanePtr plane, uint32_t format)
+{
+    for (uint32_t i = 0; i < plane->count_formats; ++i) {
+        if (plane->formats[i] == format)
+            return true;
+    }
+    return false;
 }
 
-void Device::createFramebuffers()
+// With atomic, and so universal planes, drop to XRGB8888 up front when a
+// primary plane cannot scan out what was asked for.
+void Device::negotiateFormat()
 {
-    for (Output &output : m_outputs) {
-        for (int i = 0; i < BUFFER_COUNT; ++i) {
-            if (!createFramebuffer(&output, i))
-                return;
+    if (m_format->id != PixelFormat::XRGB8888 && m_hasAtomic) {
+        drmModePlaneResPtr planeResources = drmModeGetPlaneResources(fd());
+        bool supported = planeResources != nullptr;
+        for (uint32_t i = 0; planeResources && i < planeResources->count_planes; ++i) {
+            drmModePlanePtr plane = drmModeGetPlane(fd(), planeResources->planes[i]);
+            if (!plane)
+                continue;
+            const PropertyIds props = propertyIds(fd(), plane->plane_id, DRM_MODE_OBJECT_PLANE);
+            const uint64_t type = propertyValue(fd(), plane->plane_id, DRM_MODE_OBJECT_PLANE,
+                                                props.value(QByteArray("type")));
+            if (type == DRM_PLANE_TYPE_PRIMARY && !hasFormat(plane, m_format->fourcc))
+                supported = false;
+            drmModeFreePlane(plane);
+        }
+        if (planeResources)
+            drmModeFreePlaneResources(planeResources);
+        if (!supported) {
+            qWarning("Primary planes cannot scan out %s, using xrgb8888", m_format->name);
+            m_format = &PixelFormat::get(PixelFormat::XRGB8888);
         }
-        output.backFb = 0;
-        output.flipped = false;
     }
+    qDebug("Scanning out %s", m_format->name);
 }
 
-void Device::destroyFramebuffer(Device::Output *output, int bufferIdx)
+// Finds the primary plane of every output and the overlay and cursor planes
+// that could be used for layers. Without atomic, and so without universal
+// planes, only overlays are listed and they have no type property, which
+// reads as 0, DRM_PLANE_TYPE_OVERLAY.
+bool Device::discoverPlanes(const QVector<int> &outputs)
 {
-    Framebuffer &fb(output->fb[bufferIdx]);
-    if (fb.p != MAP_FAILED)
-        munmap(fb.p, fb.size);
-    if (fb.fb) {
-        if (drmModeRmFB(fd(), fb.fb) == -1)
-            qErrnoWarning("Failed to remove fb");
+    drmModeResPtr resources = drmModeGetResources(fd());
+    if (!resources)
+        return false;
+    drmModePlaneResPtr planeResources = drmModeGetPlaneResources(fd());
+    if (!planeResources) {
+        drmModeFreeResources(resources);
+        return false;
     }
-    if (fb.handle) {
-        drm_mode_destroy_dumb dreq = { fb.handle };
-        if (drmIoctl(fd(), DRM_IOCTL_MODE_DESTROY_DUMB, &dreq) == -1)
-            qErrnoWarning(errno, "Failed to destroy dumb buffer %u", fb.handle);
+
+    for (int index : outputs) {
+        Output &output(m_outputs[index]);
+        int crtcIndex = -1;
+        for (int i = 0; i < resources->count_crtcs; ++i) {
+            if (resources->crtcs[i] == output.kmsOutput.crtc_id)
+                crtcIndex = i;
+        }
+
+        output.planeId = 0;
+        output.overlayPlanes.clear();
+        output.cursorPlanes.clear();
+        for (uint32_t i = 0; i < planeResources->count_planes; ++i) {
+            drmModePlanePtr plane = drmModeGetPlane(fd(), planeResources->planes[i]);
+            if (!plane)
+                continue;
+            if (crtcIndex >= 0 && (plane->possible_crtcs & (1 << crtcIndex))) {
+                const PropertyIds props = propertyIds(fd(), plane->plane_id, DRM_MODE_OBJECT_PLANE);
+                const uint64_t type = propertyValue(fd(), plane->plane_id, DRM_MODE_OBJECT_PLANE,
+                                                    props.value(QByteArray("type")));
+                if (type == DRM_PLANE_TYPE_PRIMARY && !output.planeId) {
+                    output.planeId = plane->plane_id;
+                    output.planeProps = props;
+                } else if (hasFormat(plane, DRM_FORMAT_ARGB8888)) {
+                    if (type == DRM_PLANE_TYPE_OVERLAY)
+                        output.overlayPlanes.append(plane->plane_id);
+                    else if (type == DRM_PLANE_TYPE_CURSOR)
+                        output.cursorPlanes.append(plane->plane_id);
+                }
+            }
+            drmModeFreePlane(plane);
+        }
+
+        output.connectorProps = propertyIds(fd(), output.kmsOutput.connector_id, DRM_MODE_OBJECT_CONNECTOR);
+        output.crtcProps = propertyIds(fd(), output.kmsOutput.crtc_id, DRM_MODE_OBJECT_CRTC);
+        qDebug("Output %s: crtc %u, primary plane %u, %d overlay and %d cursor planes",
+               qPrintable(output.kmsOutput.name), output.kmsOutput.crtc_id, output.planeId,
+               output.overlayPlanes.count(), output.cursorPlanes.count());
     }
-    fb = Framebuffer();
+
+    drmModeFreePlaneResources(planeResources);
+    drmModeFreeResources(resources);
+    return true;
 }
 
-void Device::destroyFramebuffers()
+bool Device::setModeAtomic(const QVector<int> &outputs)
 {
-    for (Output &output : m_outputs) {
-        for (int i = 0; i < BUFFER_COUNT; ++i)
-            destroyFramebuffer(&output, i);
+    for (int index : outputs) {
+        const Output &output(m_outputs[index]);
+        if (!output.planeId) {
+            qWarning("No primary plane for output %s", qPrintable(output.kmsOutput.name));
+            return false;
+        }
     }
+
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    for (int index : outputs) {
+        Output &output(m_outputs[index]);
+        drmModeModeInfo &modeInfo(output.kmsOutput.modes[output.kmsOutput.mode]);
+        if (!output.modeBlob && drmModeCreatePropertyBlob(fd(), &modeInfo, sizeof(modeInfo), &output.modeBlob) != 0) {
+            qErrnoWarning(errno, "Failed to create mode blob");
+            drmModeAtomicFree(req);
+            return false;
+        }
+        const uint32_t crtcId = output.kmsOutput.crtc_id;
+        const uint32_t w = modeInfo.hdisplay;
+        const uint32_t h = modeInfo.vdisplay;
+        addProperty(req, output.kmsOutput.connector_id, output.connectorProps, "CRTC_ID", crtcId);
+        addProperty(req, crtcId, output.crtcProps, "MODE_ID", output.modeBlob);
+        addProperty(req, crtcId, output.crtcProps, "ACTIVE", 1);
+        addProperty(req, output.planeId, output.planeProps, "FB_ID", output.fb[0].fb);
+        addProperty(req, output.planeId, output.planeProps, "CRTC_ID", crtcId);
+        addProperty(req, output.planeId, output.planeProps, "SRC_X", 0);
+        addProperty(req, output.planeId, output.planeProps, "SRC_Y", 0);
+        addProperty(req, output.planeId, output.planeProps, "SRC_W", w << 16);
+        addProperty(req, output.planeId, output.planeProps, "SRC_H", h << 16);
+        addProperty(req, output.planeId, output.planeProps, "CRTC_X", 0);
+        addProperty(req, output.planeId, output.planeProps, "CRTC_Y", 0);
+        addProperty(req, output.planeId, output.planeProps, "CRTC_W", w);
+        addProperty(req, output.planeId, output.planeProps, "CRTC_H", h);
+
+        // vrr_capable says the panel and the link can, VRR_ENABLED asks
+        // for it
+        const uint32_t vrrCapable = output.connectorProps.value(QByteArray("vrr_capable"));
+        output.vrrEnabled = m_adaptive && vrrCapable && output.crtcProps.contains(QByteArray("VRR_ENABLED"))
+                && propertyValue(fd(), output.kmsOutput.connector_id, DRM_MODE_OBJECT_CONNECTOR, vrrCapable);
+        if (output.vrrEnabled)
+            addProperty(req, crtcId, output.crtcProps, "VRR_ENABLED", 1);
+        if (m_adaptive)
+            qDebug("Output %s: variable refresh %s", qPrintable(output.kmsOutput.name),
+                   output.vrrEnabled ? "on" : "not supported");
+    }
+
+    const int ret = drmModeAtomicCommit(fd(), req, DRM_MODE_ATOMIC_ALLOW_MODESET, nullptr);
+    drmModeAtomicFree(req);
+    if (ret != 0) {
+        qErrnoWarning(errno, "Atomic modeset failed");
+        return false;
+    }
+    return true;
 }
 
-void Device::setMode()
+void Device::setModeLegacy(const QVector<int> &outputs)
 {
-    for (Output &output : m_outputs) {
+    if (m_headless)
+        return;
+    for (int index : outputs) {
+        Output &output(m_outputs[index]);
         drmModeModeInfo &modeInfo(output.kmsOutput.modes[output.kmsOutput.mode]);
         if (drmModeSetCrtc(fd(), output.kmsOutput.crtc_id, output.fb[0].fb, 0, 0,
                            &output.kmsOutput.connector_id, 1, &modeInfo) == -1) {
             qErrnoWarning(errno, "Failed to set mode");
             return;
         }
+    }
+}
+
+void Device::setMode(const QVector<int> &outputs)
+{
+    // Outputs that are up already may have flips in flight, which a modeset
+    // would fail on. Have those complete first, then carry on as if the
+    // event loop had handled them.
+    const bool waited = m_pendingFlips > 0;
+    waitForFlips();
 
+    if (!m_headless && !discoverPlanes(outputs))
+        qWarning("Failed to query planes");
+    QVector<int> lit = outputs;
+    if (m_hasAtomic && !setModeAtomic(outputs)) {
+        // Only the first modeset falls back as a whole. Outputs that are up
+        // already keep atomic, and with it layers, VRR and scaling, the
+        // ones that failed stay off.
+        bool running = false;
+        for (const Output &output : m_outputs)
+            running |= output.active;
+        if (running) {
+            for (int index : outputs) {
+                qWarning("Leaving output %s off", qPrintable(m_outputs[index].kmsOutput.name));
+                shutDownOutput(&m_outputs[index]);
+            }
+            lit.clear();
+        } else {
+            qWarning("Falling back to legacy modesetting");
+            m_hasAtomic = false;
+        }
+    }
+    if (!m_hasAtomic)
+        setModeLegacy(lit);
+
+    for (int index : lit) {
+        Output &output(m_outputs[index]);
         output.kmsOutput.mode_set = true; // have cleanup() to restore the mode
         output.kmsOutput.setPowerState(this, QPlatformScreen::PowerStateOn);
+        output.swapchain.setScanningOut(0);
+        output.active = true;
+    }
+
+    if (waited) {
+        present();
+        emit framePresented();
+    }
+}
+
+void Device::setStandby(bool standby)
+{
+    // As in setMode(), a flip completing on a dark screen may never be
+    // reported.
+    const bool waited = m_pendingFlips > 0;
+    waitForFlips();
+
+    for (Output &output : m_outputs) {
+        if (output.active)
+            output.kmsOutput.setPowerState(this, standby ? QPlatformScreen::PowerStateStandby
+                                                         : QPlatformScreen::PowerStateOn);
+    }
+    qDebug("Outputs %s", standby ? "in standby" : "back on");
+
+    if (waited) {
+        present();
+        emit framePresented();
+    }
+}
+
+Device::RenderSizeResult Device::setRenderSize(Output *output, const QSize &size)
+{
+    const QSize target = size.boundedTo(output->modeSize());
+    if (!m_hasAtomic && !m_warnedRenderSize) {
+        qWarning("Rendering below the mode size needs atomic modesetting, DRMFBTEST_RENDER_SCALE has no effect");
+        m_warnedRenderSize = true;
+    }
+    if (!m_hasAtomic || target.isEmpty())
+        return RenderSizeUnsupported;
+    if (!output->active || output->backFb >= 0)
+        return RenderSizeLater;
+    if (target == output->size())
+        return RenderSizeSet;
+
+    // As in setMode(). Frames still queued are of the old size and are
+    // dropped.
+    const bool waited = m_pendingFlips > 0;
+    waitForFlips();
+
+    // From the pool, so going back and forth between sizes allocates
+    // nothing after the first time. Not cleared, as in
+    // allocateFramebuffers().
+    QVector<Framebuffer> fbs(m_bufferCount);
+    bool ok = true;
+    for (Framebuffer &fb : fbs)
+        ok = ok && m_pool.acquire(&fb, target, output->format->fourcc, false);
+    RenderSizeResult result = ok ? RenderSizeSet : RenderSizeLater;
+    if (ok) {
+        const QSize mode = output->modeSize();
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        addProperty(req, output->planeId, output->planeProps, "FB_ID", fbs[0].fb);
+        addProperty(req, output->planeId, output->planeProps, "SRC_W", uint64_t(target.width()) << 16);
+        addProperty(req, output->planeId, output->planeProps, "SRC_H", uint64_t(target.height()) << 16);
+        addProperty(req, output->planeId, output->planeProps, "CRTC_W", mode.width());
+        addProperty(req, output->planeId, output->planeProps, "CRTC_H", mode.height());
+        ok = drmModeAtomicCommit(fd(), req, DRM_MODE_ATOMIC_TEST_ONLY, nullptr) == 0;
+        drmModeAtomicFree(req);
+        if (!ok) {
+            qErrnoWarning(errno, "The primary plane of %s cannot scale %dx%d to %dx%d",
+                          qPrintable(output->kmsOutput.name), target.width(), target.height(),
+                          mode.width(), mode.height());
+            result = RenderSizeUnsupported;
+        }
+    }
+
+    if (ok) {
+        // The buffer on screen stays there until the first frame of the new
+        // size has flipped, commits of layers alone leave it there. Without
+        // such a flip since the last change, the buffer on screen is still
+        // one of the retiring ones and the current ones never showed.
+        if (output->retiringFb.isEmpty()) {
+            output->retiringFb = output->fb;
+        } else {
+            for (Framebuffer &fb : output->fb)
+                m_pool.release(&fb);
+        }
+        output->fb = fbs;
+        output->renderSize = target == output->modeSize() ? QSize() : target;
+        output->swapchain.reset(m_bufferCount, m_presentMode);
+        output->damage = QRegion();
+        output->exposed = QRegion();
+        // A new shadow is blank, all of it has to be painted like the
+        // buffers.
+        if (!output->shadow.isNull()) {
+            output->shadow.create(target, *output->format);
+            output->exposed = QRect(QPoint(0, 0), target);
+        }
+        qDebug("Rendering %s at %dx%d", qPrintable(output->kmsOutput.name), target.width(), target.height());
+    } else {
+        for (Framebuffer &fb : fbs)
+            m_pool.release(&fb);
     }
+
+    if (waited) {
+        present();
+        emit framePresented();
+    }
+    return result;
+}
+
+// Turns the output off and hands its buffers back to the pool, the other
+// outputs are not touched. No flips may be pending.
+void Device::shutDownOutput(Output *output)
+{
+    const uint32_t crtcId = output->kmsOutput.crtc_id;
+    if (output->active && m_hasAtomic) {
+        drmModeAtomicReq *req = drmModeAtomicAlloc();
+        for (const Layer &layer : output->layers) {
+            addProperty(req, layer.planeId, layer.planeProps, "FB_ID", 0);
+            addProperty(req, layer.planeId, layer.planeProps, "CRTC_ID", 0);
+        }
+        addProperty(req, output->planeId, output->planeProps, "FB_ID", 0);
+        addProperty(req, output->planeId, output->planeProps, "CRTC_ID", 0);
+        addProperty(req, output->kmsOutput.connector_id, output->connectorProps, "CRTC_ID", 0);
+        addProperty(req, crtcId, output->crtcProps, "MODE_ID", 0);
+        addProperty(req, crtcId, output->crtcProps, "ACTIVE", 0);
+        if (output->vrrEnabled)
+            addProperty(req, crtcId, output->crtcProps, "VRR_ENABLED", 0);
+        if (drmModeAtomicCommit(fd(), req, DRM_MODE_ATOMIC_ALLOW_MODESET, nullptr) != 0)
+            qErrnoWarning(errno, "Failed to disable output %s", qPrintable(output->kmsOutput.name));
+        drmModeAtomicFree(req);
+    } else if (output->active && !m_headless) {
+        for (const Layer &layer : output->layers) {
+            if (!layer.planeId)
+                drmModeSetCursor(fd(), crtcId, 0, 0, 0);
+            else
+                drmModeSetPlane(fd(), layer.planeId, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        }
+        if (drmModeSetCrtc(fd(), crtcId, 0, 0, 0, nullptr, 0, nullptr) != 0)
+            qErrnoWarning(errno, "Failed to disable output %s", qPrintable(output->kmsOutput.name));
+    }
+
+    for (Layer &layer : output->layers) {
+        m_usedPlanes.removeAll(layer.planeId);
+        releaseLayer(&layer);
+    }
+    output->layers.clear();
+    output->layersDirty = false;
+    for (int i = 0; i < output->fb.count(); ++i)
+        m_pool.release(&output->fb[i]);
+    output->fb.clear();
+    for (Framebuffer &fb : output->retiringFb)
+        m_pool.release(&fb);
+    output->retiringFb.clear();
+    output->shadow.destroy();
+    output->backFb = -1;
+    output->flipPending = false;
+    output->fbFlipPending = false;
+    output->damage = QRegion();
+    if (output->modeBlob) {
+        drmModeDestroyPropertyBlob(fd(), output->modeBlob);
+        output->modeBlob = 0;
+    }
+    output->vrrEnabled = false;
+    output->active = false;
+}
+
+static const char *connectorTypeName(uint32_t type)
+{
+    static const char *const names[] = {
+        "None", "VGA", "DVI", "DVI", "DVI", "Composite", "TV", "LVDS", "CTV", "DIN",
+        "DP", "HDMI", "HDMI", "TV", "eDP", "Virtual", "DSI", "DPI", "Writeback"
+    };
+    return type < sizeof(names) / sizeof(names[0]) ? names[type] : "Unknown";
 }
 
-void Device::pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+static int preferredMode(drmModeConnectorPtr connector)
+{
+    for (int i = 0; i < connector->count_modes; ++i) {
+        if (connector->modes[i].type & DRM_MODE_TYPE_PREFERRED)
+            return i;
+    }
+    return 0;
+}
+
+// The equivalent of what QKmsDevice does for the connectors it finds at
+// startup, minus the per-output configuration: the preferred mode on the
+// first CRTC that can drive the connector and is not in use.
+bool Device::probeOutput(drmModeConnectorPtr connector, const QVector<uint32_t> &usedCrtcs, QKmsOutput *output)
+{
+    drmModeResPtr resources = drmModeGetResources(fd());
+    if (!resources)
+        return false;
+    int crtcIndex = -1;
+    for (int e = 0; e < connector->count_encoders && crtcIndex < 0; ++e) {
+        drmModeEncoderPtr encoder = drmModeGetEncoder(fd(), connector->encoders[e]);
+        if (!encoder)
+            continue;
+        for (int c = 0; c < resources->count_crtcs; ++c) {
+            if ((encoder->possible_crtcs & (1 << c)) && !usedCrtcs.contains(resources->crtcs[c])) {
+                crtcIndex = c;
+                break;
+            }
+        }
+        drmModeFreeEncoder(encoder);
+    }
+    if (crtcIndex < 0) {
+        drmModeFreeResources(resources);
+        return false;
+    }
+
+    output->name = QString::fromLatin1("%1%2").arg(QLatin1String(connectorTypeName(connector->connector_type)))
+                                               .arg(connector->connector_type_id);
+    output->connector_id = connector->connector_id;
+    output->crtc_index = crtcIndex;
+    output->crtc_id = resources->crtcs[crtcIndex];
+    output->physical_size = QSizeF(connector->mmWidth, connector->mmHeight);
+    for (int i = 0; i < connector->count_modes; ++i)
+        output->modes.append(connector->modes[i]);
+    output->preferred_mode = preferredMode(connector);
+    output->mode = output->preferred_mode;
+    output->saved_crtc = drmModeGetCrtc(fd(), output->crtc_id);
+    drmModeFreeResources(resources);
+    return true;
+}
+
+static bool sameMode(const drmModeModeInfo &a, const drmModeModeInfo &b)
+{
+    return a.clock == b.clock && a.hdisplay == b.hdisplay && a.vdisplay == b.vdisplay
+            && a.htotal == b.htotal && a.vtotal == b.vtotal && a.flags == b.flags;
+}
+
+Device::OutputChanges Device::rescanOutputs()
+{
+    OutputChanges changes;
+    drmModeResPtr resources = drmModeGetResources(fd());
+    if (!resources) {
+        qErrnoWarning(errno, "Failed to get DRM resources");
+        return changes;
+    }
+    // Getting a connector probes it, which is what picks up the change.
+    QVector<drmModeConnectorPtr> connected;
+    for (int i = 0; i < resources->count_connectors; ++i) {
+        drmModeConnectorPtr connector = drmModeGetConnector(fd(), resources->connectors[i]);
+        if (connector && connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0)
+            connected.append(connector);
+        else if (connector)
+            drmModeFreeConnector(connector);
+    }
+    drmModeFreeResources(resources);
+
+    // As in setMode()
+    const bool waited = m_pendingFlips > 0;
+    waitForFlips();
+
+    for (int i = m_outputs.count() - 1; i >= 0; --i) {
+        Output &output(m_outputs[i]);
+        drmModeConnectorPtr connector = nullptr;
+        for (drmModeConnectorPtr c : connected) {
+            if (c->connector_id == output.kmsOutput.connector_id)
+                connector = c;
+        }
+        if (!connector) {
+            qDebug("Output %s disconnected", qPrintable(output.kmsOutput.name));
+            shutDownOutput(&output);
+            output.kmsOutput.mode_set = false; // nothing to restore on
+            output.kmsOutput.cleanup(this);
+            m_outputs.remove(i);
+            changes.removed.append(i);
+            continue;
+        }
+        // Another display on the same connector that can do the current
+        // mode just carries on. Otherwise it starts over in its preferred
+        // mode.
+        const drmModeModeInfo current = output.kmsOutput.modes[output.kmsOutput.mode];
+        bool offered = false;
+        for (int m = 0; m < connector->count_modes; ++m)
+            offered |= sameMode(connector->modes[m], current);
+        if (offered)
+            continue;
+        shutDownOutput(&output);
+        output.kmsOutput.modes.clear();
+        for (int m = 0; m < connector->count_modes; ++m)
+            output.kmsOutput.modes.append(connector->modes[m]);
+        output.kmsOutput.preferred_mode = preferredMode(connector);
+        output.kmsOutput.mode = output.kmsOutput.preferred_mode;
+        qDebug("Output %s changed to %dx%d", qPrintable(output.kmsOutput.name),
+               output.size().width(), output.size().height());
+        changes.added.append(i);
+    }
+    std::sort(changes.added.begin(), changes.added.end());
+    // the removals further down moved them
+    for (int &index : changes.added) {
+        for (int removed : changes.removed)
+            index -= removed < index;
+    }
+
+    QVector<uint32_t> usedCrtcs;
+    for (const Output &output : m_outputs)
+        usedCrtcs.append(output.kmsOutput.crtc_id);
+    for (drmModeConnectorPtr connector : connected) {
+        bool known = false;
+        for (const Output &output : m_outputs)
+            known |= output.kmsOutput.connector_id == connector->connector_id;
+        if (known)
+            continue;
+        Output o;
+        if (!probeOutput(connector, usedCrtcs, &o.kmsOutput)) {
+            qWarning("No free CRTC for connector %u", connector->connector_id);
+            continue;
+        }
+        qDebug("Got a new output: %s", qPrintable(o.kmsOutput.name));
+        usedCrtcs.append(o.kmsOutput.crtc_id);
+        m_outputs.append(o);
+        changes.added.append(m_outputs.count() - 1);
+    }
+    for (drmModeConnectorPtr connector : connected)
+        drmModeFreeConnector(connector);
+
+    if (waited) {
+        present();
+        emit framePresented();
+    }
+    return changes;
+}
+
+void Device::pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+                             unsigned int crtc_id, void *user_data)
 {
     Q_UNUSED(fd);
-    Q_UNUSED(sequence);
-    Q_UNUSED(tv_sec);
-    Q_UNUSED(tv_usec);
 
-    Device::Output *output = static_cast<Device::Output *>(user_data);
-    output->backFb = (output->backFb + 1) % BUFFER_COUNT;
+    // An atomic commit covering several CRTCs delivers one event per CRTC.
+    // Kernels without DRM_CAP_CRTC_IN_VBLANK_EVENT pass 0 as crtc_id, then
+    // just count the events.
+    Device *device = static_cast<Device *>(user_data);
+    --device->m_pendingFlips;
+    for (Output &output : device->m_outputs) {
+        if (output.flipPending && (output.kmsOutput.crtc_id == crtc_id || (!crtc_id && !device->m_pendingFlips))) {
+            output.flipPending = false;
+            for (Layer &layer : output.layers) {
+                for (Framebuffer &fb : layer.retiring)
+                    device->releaseBuffer(&fb);
+                layer.retiring.clear();
+            }
+            if (output.fbFlipPending) {
+                for (Framebuffer &fb : output.retiringFb)
+                    device->m_pool.release(&fb);
+                output.retiringFb.clear();
+                output.fbFlipPending = false;
+            }
+            output.swapchain.flipCompleted();
+            output.timing.flipCompleted(sequence, tv_sec, tv_usec);
+            if (device->m_capture && !output.flipDamage.isEmpty())
+                device->captureFrontBuffer(&output);
+        }
+    }
+}
+
+// Nothing renders into the buffer while it is on screen, it has exactly the
+// frame that was shown. Only the damage is read here, compressing and writing
+// happen on the capture thread.
+void Device::captureFrontBuffer(Output *output)
+{
+    const int front = output->swapchain.scanningOut();
+    if (front >= 0 && output->fb[front].p != MAP_FAILED) {
+        const Framebuffer &fb(output->fb[front]);
+        m_capture->capture(output->kmsOutput.connector_id, *output->format, fb.p, fb.pitch, output->size(),
+                           output->flipDamage, output->timing.lastFlipUs());
+    }
+    output->flipDamage = QRegion();
+}
+
+drmEventContext Device::flipEventContext()
+{
+    drmEventContext drmEvent;
+    memset(&drmEvent, 0, sizeof(drmEvent));
+    drmEvent.version = 3; // for page_flip_handler2
+    drmEvent.page_flip_handler2 = pageFlipHandler;
+    return drmEvent;
+}
+
+bool Device::beginFrame(Output *output)
+{
+    if (!output->active)
+        return false;
+    if (output->backFb < 0)
+        output->backFb = output->swapchain.acquire();
+    return output->backFb >= 0;
+}
+
+void Device::addDamage(Output *output, const QRect &rect)
+{
+    output->damage += rect.intersected(QRect(QPoint(0, 0), output->size()));
 }
 
-//QElapsedTimer t;
+QRegion Device::repaintRegion(const Output *output) const
+{
+    return output->swapchain.repaintRegion(output->backFb, output->damage,
+                                           QRect(QPoint(0, 0), output->size()));
+}
+
+bool Device::beginFrame(int output, Surface *surface)
+{
+    Output &o(m_outputs[output]);
+    if (!beginFrame(&o))
+        return false;
+    const Framebuffer &fb(o.fb[o.backFb]);
+    if (fb.p == MAP_FAILED)
+        return false;
+    o.timing.renderStarted();
+    o.perfStart = perfSample();
+    const bool useShadow = !o.shadow.isNull();
+    surface->bits = useShadow ? o.shadow.bits() : fb.p;
+    surface->pitch = useShadow ? o.shadow.pitch() : int(fb.pitch);
+    surface->size = o.size();
+    surface->format = o.format;
+    surface->behind = useShadow ? o.exposed : repaintRegion(&o);
+    return true;
+}
 
-void Device::swapBuffers(Output *output)
+void Device::endFrame(int output, const QRegion &damage)
 {
-    if (output->flipped) {
-        const int fbIdx = output->backFb;
-        while (output->backFb == fbIdx) {
-            drmEventContext drmEvent = {
-                DRM_EVENT_CONTEXT_VERSION,
-                nullptr,
-                pageFlipHandler
-            };
-            // Blocks until there is something to read on the drm fd
-            // and calls back pageFlipHandler once the flip completes.
-            drmHandleEvent(fd(), &drmEvent);
+    Output &o(m_outputs[output]);
+    for (const QRect &rect : damage)
+        addDamage(&o, rect);
+    // including what the back buffer is behind on
+    const Framebuffer &fb(o.fb[o.backFb]);
+    if (m_scheduler && !o.shadow.isNull()) {
+        QVector<TileScheduler::Job> copies;
+        const PixelFormat *format = o.format;
+        const void *src = o.shadow.bits();
+        const int srcPitch = o.shadow.pitch();
+        void *dst = fb.p;
+        const int dstPitch = fb.pitch;
+        for (const QRect &rect : o.shadow.alignedRegion(repaintRegion(&o))) {
+            for (const QRect &tile : TileScheduler::horizontalTiles(rect, dstPitch, format->bytesPerPixel()))
+                copies.append([format, dst, dstPitch, src, srcPitch, tile] {
+                    copyRect(*format, dst, dstPitch, src, srcPitch, tile);
+                });
         }
+        m_scheduler->run(copies);
     } else {
-        output->flipped = true;
+        o.shadow.flush(fb.p, fb.pitch, repaintRegion(&o));
     }
+    o.exposed = QRegion();
+    o.timing.renderFinished();
+    if (m_perf)
+        o.perf.add(PerfStats::Render, o.perfStart, perfSample());
+}
+
+bool Device::scroll(int output, int dy)
+{
+    Output &o(m_outputs[output]);
+    const QSize size = o.size();
+    if (!o.active || o.shadow.isNull() || !dy || qAbs(dy) >= size.height())
+        return false;
+    const QRect bounds(QPoint(0, 0), size);
+    o.exposed = o.exposed.translated(0, -dy).intersected(bounds) + o.shadow.scroll(dy);
+    // every pixel of the back buffer changed
+    addDamage(&o, bounds);
+    return true;
+}
 
-//    qDebug("flipping to %d elapsed %lld", output->backFb, t.restart());
-    Framebuffer &fb(output->fb[output->backFb]);
-    if (drmModePageFlip(fd(), output->kmsOutput.crtc_id, fb.fb, DRM_MODE_PAGE_FLIP_EVENT, output) == -1) {
+bool Device::commitAtomic(const QVector<Flip> &flips)
+{
+    drmModeAtomicReq *req = drmModeAtomicAlloc();
+    QVector<uint32_t> blobs;
+    for (const Flip &flip : flips) {
+        Output *output = flip.output;
+        if (output->layersDirty)
+            addLayerProperties(req, output);
+        if (flip.index < 0)
+            continue;
+        addProperty(req, output->planeId, output->planeProps, "FB_ID", output->fb[flip.index].fb);
+        // the buffers may have changed size since the modeset
+        const QSize size = output->size();
+        addProperty(req, output->planeId, output->planeProps, "SRC_W", uint64_t(size.width()) << 16);
+        addProperty(req, output->planeId, output->planeProps, "SRC_H", uint64_t(size.height()) << 16);
+
+        // Tell the driver what changed compared to the previous frame, for
+        // the ones that scan out from a copy or compress the link.
+        const uint32_t damageProp = output->planeProps.value(QByteArray("FB_DAMAGE_CLIPS"));
+        if (damageProp && !flip.damage.isEmpty()) {
+            QVector<drm_mode_rect> clips;
+            for (const QRect &r : flip.damage)
+                clips.append(drm_mode_rect { r.x(), r.y(), r.x() + r.width(), r.y() + r.height() });
+            uint32_t blob = 0;
+            if (drmModeCreatePropertyBlob(fd(), clips.constData(), clips.count() * sizeof(drm_mode_rect), &blob) == 0) {
+                drmModeAtomicAddProperty(req, output->planeId, damageProp, blob);
+                blobs.append(blob);
+            }
+        }
+    }
+
+    const int ret = drmModeAtomicCommit(fd(), req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, this);
+    drmModeAtomicFree(req);
+    // the commit holds its own references
+    for (uint32_t blob : blobs)
+        drmModeDestroyPropertyBlob(fd(), blob);
+    if (ret != 0) {
+        qErrnoWarning(errno, "Atomic commit failed");
+        return false;
+    }
+    m_pendingFlips += flips.count();
+    return true;
+}
+
+bool Device::flipLegacy(const Flip &flip)
+{
+    Output *output = flip.output;
+    // Layers are updated right away. Without a new frame the buffer on
+    // screen is flipped to again, which still paces the renderer.
+    if (output->layersDirty)
+        updateLayersLegacy(output);
+    const int index = flip.index >= 0 ? flip.index : output->swapchain.scanningOut();
+    if (index < 0)
+        return false;
+    if (m_headless) {
+        m_headless->requestVblank(int(output - m_outputs.data()));
+        ++m_pendingFlips;
+        return true;
+    }
+    if (drmModePageFlip(fd(), output->kmsOutput.crtc_id, output->fb[index].fb,
+                        DRM_MODE_PAGE_FLIP_EVENT, this) == -1) {
         qErrnoWarning(errno, "Page flip failed");
+        return false;
+    }
+    ++m_pendingFlips;
+    return true;
+}
+
+void Device::handleDrmEvent()
+{
+    if (m_pendingFlips <= 0)
         return;
+
+    // The fd is readable so this does not block. Calls back
+    // pageFlipHandler for every flip that completed.
+    drmEventContext drmEvent = flipEventContext();
+    if (!dispatchEvents(&drmEvent)) {
+        qErrnoWarning(errno, "Failed to handle DRM events");
+        m_pendingFlips = 0;
+    }
+
+    if (m_pendingFlips == 0) {
+        // FIFO may have more frames waiting
+        present();
+        emit framePresented();
+    }
+}
+
+void Device::waitForFlips()
+{
+    drmEventContext drmEvent = flipEventContext();
+    while (m_pendingFlips > 0) {
+        // Blocks until there is something to read on the drm fd.
+        if (!dispatchEvents(&drmEvent)) {
+            qErrnoWarning(errno, "Failed to handle DRM events");
+            m_pendingFlips = 0;
+        }
     }
 }
 
+// Headless, the simulated vblank that the first flip waits for is slept
+// through, as reading the DRM fd would block.
+bool Device::readEvents(drmEventContext *drmEvent)
+{
+    if (!m_headless)
+        return drmHandleEvent(fd(), drmEvent) == 0;
+    return m_headless->dispatch([this](int index, unsigned int sequence, qint64 timestampUs) {
+        pageFlipHandler(-1, sequence, unsigned(timestampUs / 1000000), unsigned(timestampUs % 1000000),
+                        m_outputs[index].kmsOutput.crtc_id, this);
+    });
+}
+
+bool Device::dispatchEvents(drmEventContext *drmEvent)
+{
+    if (!m_perf)
+        return readEvents(drmEvent);
+    // charged to the outputs that were waiting
+    QVector<Output *> waiting;
+    for (Output &output : m_outputs) {
+        if (output.flipPending)
+            waiting.append(&output);
+    }
+    const PerfCounters::Sample start = perfSample();
+    const bool ok = readEvents(drmEvent);
+    const PerfCounters::Sample end = perfSample();
+    for (Output *output : waiting)
+        output->perf.add(PerfStats::Events, start, end);
+    return ok;
+}
+
+void Device::swapBuffers()
+{
+    for (Output &output : m_outputs) {
+        if (output.backFb < 0)
+            continue;
+        // Nothing changed, what is on screen stays there without a flip.
+        if (m_adaptive && output.damage.isEmpty()) {
+            output.swapchain.cancel(output.backFb);
+            output.backFb = -1;
+            continue;
+        }
+        output.swapchain.queue(output.backFb, output.damage);
+        output.damage = QRegion();
+        output.backFb = -1;
+    }
+
+    // With a flip still pending the frames stay queued until it completes.
+    if (m_pendingFlips == 0)
+        present();
+}
+
+void Device::present()
+{
+    QVector<Flip> flips;
+    for (Output &output : m_outputs) {
+        if (!output.active)
+            continue; // may be left with frames from before a hotplug
+        Flip flip;
+        flip.output = &output;
+        flip.index = output.swapchain.takeNextForPresent(QRect(QPoint(0, 0), output.size()), &flip.damage);
+        if (flip.index >= 0 || output.layersDirty)
+            flips.append(flip);
+    }
+    if (flips.isEmpty())
+        return;
+    // One atomic commit per frame covering all outputs so that they flip
+    // on the same vblank, or one page flip per output with legacy KMS.
+    const PerfCounters::Sample commitStart = perfSample();
+    const bool ok = m_hasAtomic && commitAtomic(flips);
+    const PerfCounters::Sample commitEnd = perfSample();
+    for (const Flip &flip : flips) {
+        bool flipped = ok;
+        if (m_hasAtomic) {
+            if (m_perf)
+                flip.output->perf.add(PerfStats::Present, commitStart, commitEnd);
+        } else {
+            const PerfCounters::Sample start = perfSample();
+            flipped = flipLegacy(flip);
+            if (m_perf)
+                flip.output->perf.add(PerfStats::Present, start, perfSample());
+        }
+        if (flipped) {
+            flip.output->flipPending = true;
+            flip.output->fbFlipPending = flip.index >= 0;
+            flip.output->flipDamage = flip.damage;
+            if (flip.output->layersDirty) {
+                for (Layer &layer : flip.output->layers) {
+                    layer.committedFb = layer.fb.fb;
+                    layer.retiring += layer.replaced;
+                    layer.replaced.clear();
+                }
+            }
+            flip.output->layersDirty = false;
+            flip.output->timing.submitted();
+        } else if (flip.index >= 0) {
+            flip.output->swapchain.presentFailed(flip.index);
+        }
+    }
+}
+
+int Device::createLayer(Output *output, Layer::Type type, const QSize &size)
+{
+    // no planes, not even the legacy cursor
+    if (m_headless)
+        return -1;
+    Layer layer;
+    layer.type = type;
+    const QVector<uint32_t> &candidates(type == Layer::Cursor ? output->cursorPlanes : output->overlayPlanes);
+    for (uint32_t planeId : candidates) {
+        if (!m_usedPlanes.contains(planeId)) {
+            layer.planeId = planeId;
+            break;
+        }
+    }
+
+    if (type == Layer::Cursor) {
+        uint64_t w = 64, h = 64;
+        drmGetCap(fd(), DRM_CAP_CURSOR_WIDTH, &w);
+        drmGetCap(fd(), DRM_CAP_CURSOR_HEIGHT, &h);
+        if (uint64_t(size.width()) > w || uint64_t(size.height()) > h) {
+            qWarning("Cursor layers are limited to %ux%u", uint(w), uint(h));
+            return -1;
+        }
+        // Without atomic there are the legacy cursor ioctls instead, which
+        // give each CRTC one cursor.
+        if (!layer.planeId) {
+            if (m_hasAtomic)
+                return -1;
+            for (const Layer &l : output->layers) {
+                if (l.type == Layer::Cursor)
+                    return -1;
+            }
+        }
+    } else if (!layer.planeId) {
+        return -1;
+    }
+
+    if (!m_pool.acquire(&layer.fb, size, DRM_FORMAT_ARGB8888))
+        return -1;
+    if (type == Layer::Cursor && !layer.planeId
+            && drmModeSetCursor(fd(), output->kmsOutput.crtc_id, layer.fb.handle, size.width(), size.height()) != 0) {
+        qErrnoWarning(errno, "Failed to set cursor");
+        m_pool.release(&layer.fb);
+        return -1;
+    }
+
+    if (layer.planeId) {
+        layer.planeProps = propertyIds(fd(), layer.planeId, DRM_MODE_OBJECT_PLANE);
+        m_usedPlanes.append(layer.planeId);
+    }
+    layer.geometry = QRect(QPoint(0, 0), size);
+    qDebug("Output %s: %s layer %dx%d on plane %u", qPrintable(output->kmsOutput.name),
+           type == Layer::Cursor ? "cursor" : "overlay", size.width(), size.height(), layer.planeId);
+    output->layers.append(layer);
+    output->layersDirty = true;
+    return output->layers.count() - 1;
+}
+
+void Device::moveLayer(Output *output, int layer, const QPoint &pos)
+{
+    Layer &l(output->layers[layer]);
+    if (l.geometry.topLeft() == pos)
+        return;
+    l.geometry.moveTopLeft(pos);
+    output->layersDirty = true;
+}
+
+bool Device::setLayerBuffer(Output *output, int layer, const Framebuffer &fb)
+{
+    Layer &l(output->layers[layer]);
+    Framebuffer buffer(fb);
+    bool supported = false;
+    if (l.planeId) {
+        drmModePlanePtr plane = drmModeGetPlane(fd(), l.planeId);
+        supported = plane && hasFormat(plane, buffer.format);
+        drmModeFreePlane(plane);
+    }
+    if (!supported) {
+        qWarning("Plane %u cannot scan out format %08x", l.planeId, buffer.format);
+        releaseBuffer(&buffer);
+        return false;
+    }
+
+    // Never committed means never on screen, that one can go right away.
+    if (l.fb.fb == l.committedFb)
+        l.replaced.append(l.fb);
+    else
+        releaseBuffer(&l.fb);
+    l.fb = buffer;
+    l.geometry.setSize(QSize(buffer.width, buffer.height));
+    output->layersDirty = true;
+    return true;
+}
+
+DmaBufServer *Device::startDmaBufServer(const QByteArray &path)
+{
+    if (!m_dmaBufServer)
+        m_dmaBufServer = new DmaBufServer(path, &m_pool, this);
+    return m_dmaBufServer;
+}
+
+void Device::releaseBuffer(Framebuffer *fb)
+{
+    if (!m_dmaBufServer || !m_dmaBufServer->release(fb))
+        m_pool.release(fb);
+}
+
+void Device::releaseLayer(Layer *layer)
+{
+    releaseBuffer(&layer->fb);
+    for (Framebuffer &fb : layer->replaced)
+        releaseBuffer(&fb);
+    for (Framebuffer &fb : layer->retiring)
+        releaseBuffer(&fb);
+    layer->replaced.clear();
+    layer->retiring.clear();
+    layer->committedFb = 0;
+}
+
+void Device::addLayerProperties(drmModeAtomicReq *req, const Output *output)
+{
+    for (const Layer &layer : output->layers) {
+        const QRect &g(layer.geometry);
+        addProperty(req, layer.planeId, layer.planeProps, "FB_ID", layer.fb.fb);
+        addProperty(req, layer.planeId, layer.planeProps, "CRTC_ID", output->kmsOutput.crtc_id);
+        addProperty(req, layer.planeId, layer.planeProps, "SRC_X", 0);
+        addProperty(req, layer.planeId, layer.planeProps, "SRC_Y", 0);
+        addProperty(req, layer.planeId, layer.planeProps, "SRC_W", uint64_t(g.width()) << 16);
+        addProperty(req, layer.planeId, layer.planeProps, "SRC_H", uint64_t(g.height()) << 16);
+        // CRTC_X and CRTC_Y are signed, partly off screen is fine
+        addProperty(req, layer.planeId, layer.planeProps, "CRTC_X", uint64_t(int64_t(g.x())));
+        addProperty(req, layer.planeId, layer.planeProps, "CRTC_Y", uint64_t(int64_t(g.y())));
+        addProperty(req, layer.planeId, layer.planeProps, "CRTC_W", g.width());
+        addProperty(req, layer.planeId, layer.planeProps, "CRTC_H", g.height());
+    }
+}
+
+void Device::disableLayers()
+{
+    drmModeAtomicReq *req = m_hasAtomic ? drmModeAtomicAlloc() : nullptr;
+    bool any = false;
+    for (Output &output : m_outputs) {
+        for (const Layer &layer : output.layers) {
+            if (req) {
+                addProperty(req, layer.planeId, layer.planeProps, "FB_ID", 0);
+                addProperty(req, layer.planeId, layer.planeProps, "CRTC_ID", 0);
+                any = true;
+            } else if (!layer.planeId) {
+                drmModeSetCursor(fd(), output.kmsOutput.crtc_id, 0, 0, 0);
+            } else if (drmModeSetPlane(fd(), layer.planeId, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0) != 0) {
+                qErrnoWarning(errno, "Failed to disable plane %u", layer.planeId);
+            }
+        }
+    }
+    if (req) {
+        // blocking, the buffers are reused right after
+        if (any && drmModeAtomicCommit(fd(), req, 0, nullptr) != 0)
+            qErrnoWarning(errno, "Failed to disable layers");
+        drmModeAtomicFree(req);
+    }
+}
+
+void Device::disableVrr()
+{
+    drmModeAtomicReq *req = nullptr;
+    for (Output &output : m_outputs) {
+        if (!output.vrrEnabled)
+            continue;
+        if (!req)
+            req = drmModeAtomicAlloc();
+        addProperty(req, output.kmsOutput.crtc_id, output.crtcProps, "VRR_ENABLED", 0);
+        output.vrrEnabled = false;
+    }
+    if (req) {
+        if (drmModeAtomicCommit(fd(), req, 0, nullptr) != 0)
+            qErrnoWarning(errno, "Failed to disable variable refresh");
+        drmModeAtomicFree(req);
+    }
+}
+
+void Device::updateLayersLegacy(Output *output)
+{
+    const uint32_t crtcId = output->kmsOutput.crtc_id;
+    for (const Layer &layer : output->layers) {
+        const QRect &g(layer.geometry);
+        if (!layer.planeId) {
+            if (drmModeMoveCursor(fd(), crtcId, g.x(), g.y()) != 0)
+                qErrnoWarning(errno, "Failed to move cursor");
+        } else if (drmModeSetPlane(fd(), layer.planeId, crtcId, layer.fb.fb, 0,
+                                   g.x(), g.y(), g.width(), g.height(),
+                                   0, 0, g.width() << 16, g.height() << 16) != 0) {
+            qErrnoWarning(errno, "Failed to set plane %u", layer.planeId);
+        }
+    }
+}
+
+void Device::dumpTiming() const
+{
+    for (const Output &output : m_outputs) {
+        output.timing.dump(output.kmsOutput.name);
+        output.perf.dump(output.kmsOutput.name);
+    }
+}
+
+// How long a card waits for the others to have their frame ready, a bit
+// over a frame at 60 Hz.
+static const int PresentAlignTimeout = 20; // ms
+
+typedef SpscQueue<DrawList> FrameQueue;
+
+// DRMFBTEST_RENDER_AHEAD=n (1 to 8) makes the demo frames on a thread of
+// their own, up to n ahead for every output, into one FrameQueue each. The
+// card's thread takes them out once it has a buffer to draw into, so the
+// next frame is made while the last one is rasterized and flipped. Frames
+// made ahead cannot scroll the buffers, with DRMFBTEST_SCROLL they are
+// painted in full.
+class SceneThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit SceneThread(int depth) : m_depth(depth) { }
+
+    // From the card's thread. An output that comes back, e.g. with a new
+    // mode, is removed and added again and starts over with a new queue.
+    QSharedPointer<FrameQueue> addOutput(const QSize &size);
+    void removeOutput(const QSharedPointer<FrameQueue> &queue);
+    // a frame was taken out, there is room for the next
+    void wake() { m_wake.release(); }
+    void stop();
+
+signals:
+    void frameQueued();
+
+protected:
+    void run() override;
+
+private:
+    struct Output {
+        QSize size;
+        QSharedPointer<FrameQueue> queue;
+        DemoScene scene; // the scene thread's only, of this output at 0
+    };
+
+    int m_depth;
+    QMutex m_mutex; // for m_outputs, the queues do without
+    QVector<QSharedPointer<Output>> m_outputs;
+    QSemaphore m_wake;
+};
+
+QSharedPointer<FrameQueue> SceneThread::addOutput(const QSize &size)
+{
+    QSharedPointer<Output> output(new Output);
+    output->size = size;
+    output->queue.reset(new FrameQueue(m_depth));
+    {
+        QMutexLocker locker(&m_mutex);
+        m_outputs.append(output);
+    }
+    wake();
+    return output->queue;
+}
+
+void SceneThread::removeOutput(const QSharedPointer<FrameQueue> &queue)
+{
+    // one that is being filled lives on until the thread lets go of it
+    QMutexLocker locker(&m_mutex);
+    for (int i = m_outputs.count() - 1; i >= 0; --i) {
+        if (m_outputs[i]->queue == queue)
+            m_outputs.remove(i);
+    }
+}
+
+void SceneThread::stop()
+{
+    requestInterruption();
+    wake();
+    wait();
+}
+
+void SceneThread::run()
+{
+    while (!isInterruptionRequested()) {
+        m_wake.acquire();
+        m_wake.tryAcquire(m_wake.available()); // one round fills everything
+        QVector<QSharedPointer<Output>> outputs;
+        {
+            QMutexLocker locker(&m_mutex);
+            outputs = m_outputs;
+        }
+        bool queued = false;
+        for (const QSharedPointer<Output> &output : outputs) {
+            while (!output->queue->isFull()) {
+                const QRegion damage = output->scene.advance(0, output->size);
+                DrawList list = output->scene.record(0, output->size);
+                list.damage = damage;
+                output->queue->push(list);
+                queued = true;
+            }
+        }
+        if (queued)
+            emit frameQueued();
+    }
+}
+
+// Drives one card. barrier, when given, is shared with the renderers of
+// the other cards.
 class DumbBufferRenderer : public QObject
 {
 public:
-    DumbBufferRenderer();
+    DumbBufferRenderer(const QString &devicePath, int card, PresentBarrier *barrier);
     ~DumbBufferRenderer();
 
+    bool isValid() const { return m_device && (m_device->fd() != -1 || m_device->isHeadless()); }
+
 private:
+    void initializeOutputs(const QVector<int> &indices);
+    void updateOutputs();
     void update();
+    void updateBenchmark();
+    void scheduleUpdate();
+    void framePresented();
+    void contentChanged();
+    void presentDmaBuf(const Device::Framebuffer &buffer);
+    void enterIdle();
+    void wake();
+    void setPresenting(bool presenting);
+    void applyRenderScale(int index);
+    void adjustRenderScale(int index, qint64 renderUs);
 
     QKmsScreenConfig m_screenConfig;
-    Device *m_device;
-    QTimer m_timer;
-    int m_r = 0, m_g = 0, m_b = 0;
+    Device *m_device = nullptr;
+    int m_card;
+    PresentBarrier *m_barrier;
+    bool m_presenting = true; // counted in by m_barrier
+    Benchmark *m_benchmark = nullptr;
+    PerfCounters m_perf; // ahead of the render threads, they inherit it
+    TileScheduler m_scheduler;
+    DemoScene m_scene; // by output index, the outputs may run at different rates
+    QVector<int> m_squareLayers; // -1 when drawn into the primary buffer
+    // DRMFBTEST_RENDER_AHEAD, per output, null for outputs with a layer
+    SceneThread *m_sceneThread = nullptr;
+    QVector<QSharedPointer<FrameQueue>> m_frameQueues;
+    // DRMFBTEST_PACING=late, per output
+    bool m_latePacing = false;
+    QVector<FrameScheduler *> m_frameSchedulers;
+    // DRMFBTEST_PRESENT_MODE=adaptive
+    bool m_contentDriven = false;
+    QTimer m_contentTimer;
+    int m_contentFps = 24;
+    int m_contentTicks = 0;
+    // With either, only outputs that are due render.
+    QVector<bool> m_due;
+    int m_videoLayer = -1; // on the primary output, DRMFBTEST_DMABUF_SOCKET
+    HotplugMonitor *m_hotplug = nullptr;
+    bool m_updateScheduled = false;
+    // DRMFBTEST_RENDER_SCALE, per output
+    struct RenderScale {
+        int percent = 100;
+        int wanted = 100; // applied once the flips are through
+        bool fixed = false; // auto gave up, the plane cannot scale
+        qint64 renderUs = 0; // of the frames so far of the current window
+        int frames = 0;
+    };
+    int m_renderScale = 100;
+    bool m_autoScale = false;
+    QVector<RenderScale> m_renderScales;
+    // DRMFBTEST_IDLE_MS, restarted by every frame with damage
+    int m_idleMs = 0;
+    QTimer m_idleTimer;
+    bool m_idle = false;
 };
 
-DumbBufferRenderer::DumbBufferRenderer()
+DumbBufferRenderer::DumbBufferRenderer(const QString &devicePath, int card, PresentBarrier *barrier)
+    : m_card(card),
+      m_barrier(barrier)
 {
-    m_device = new Device(&m_screenConfig);
+    // results of other cards are told apart by the backend name
+    if (Benchmark::isRequested())
+        m_benchmark = new Benchmark(devicePath.isEmpty() ? "doublebuffer-headless"
+                                    : card ? qPrintable(QStringLiteral("doublebuffer-card%1").arg(card)) : "doublebuffer");
+
+    m_device = new Device(&m_screenConfig, devicePath, card);
     if (!m_device->open()) {
-        qWarning("Failed to open DRM device");
+        qWarning(devicePath.isEmpty() ? "No headless outputs" : "Failed to open DRM device");
         return;
     }
+    QElapsedTimer startup;
+    startup.start();
     // Discover outputs. Calls back Device::createScreen().
-    m_device->createScreens();
+    if (!m_device->isHeadless())
+        m_device->createScreens();
+    if (m_perf.isValid())
+        m_device->setPerfCounters(&m_perf);
+    m_device->setTileScheduler(&m_scheduler);
+    QVector<Device::Output> &outputs(*m_device->outputs());
+    m_squareLayers.fill(-1, outputs.count());
+    m_frameQueues.resize(outputs.count());
+    m_frameSchedulers.fill(nullptr, outputs.count());
+    m_due.fill(false, outputs.count());
+    m_renderScales.fill(RenderScale(), outputs.count());
+
+    // Render the next frame as soon as the previous one is on screen,
+    // paced by the display instead of a timer. With DRMFBTEST_PACING=late
+    // rendering starts as late as it can for the next vblank instead, which
+    // shows fresher frames but has no slack for a render that runs long.
+    m_contentDriven = !m_benchmark && m_device->isAdaptive();
+    m_latePacing = !m_benchmark && !m_contentDriven && qgetenv("DRMFBTEST_PACING") == "late";
+    if (m_latePacing)
+        qDebug("Rendering as late as possible before each vblank");
+    connect(m_device, &Device::framePresented, this, &DumbBufferRenderer::framePresented);
+
+    const int renderAhead = qEnvironmentVariableIntValue("DRMFBTEST_RENDER_AHEAD");
+    if (!m_benchmark && renderAhead > 0) {
+        m_sceneThread = new SceneThread(qMin(renderAhead, 8));
+        connect(m_sceneThread, &SceneThread::frameQueued, this, &DumbBufferRenderer::scheduleUpdate);
+        m_sceneThread->start();
+        qDebug("Making frames up to %d ahead", qMin(renderAhead, 8));
+    }
+
+    // In adaptive mode the content sets the frame rate instead,
+    // DRMFBTEST_CONTENT_FPS (default 24, like film) while the square moves.
+    // Every few seconds it holds still and nothing is rendered or flipped:
+    // the last buffer stays on screen.
+    if (m_contentDriven) {
+        if (qEnvironmentVariableIsSet("DRMFBTEST_CONTENT_FPS"))
+            m_contentFps = qBound(1, qEnvironmentVariableIntValue("DRMFBTEST_CONTENT_FPS"), 1000);
+        m_contentTimer.setTimerType(Qt::PreciseTimer);
+        m_contentTimer.setInterval(1000 / m_contentFps);
+        connect(&m_contentTimer, &QTimer::timeout, this, &DumbBufferRenderer::contentChanged);
+        m_contentTimer.start();
+        qDebug("Content driven at %d fps", m_contentFps);
+    }
+
+    // DRMFBTEST_RENDER_SCALE=n renders at n percent (25 to 100) of the mode
+    // on each axis and has the primary plane scale it up, "auto" goes
+    // between 50 and 100 by the render time. Atomic only, see
+    // Device::setRenderSize().
+    const QByteArray renderScale = qgetenv("DRMFBTEST_RENDER_SCALE");
+    if (renderScale == "auto" && !m_benchmark)
+        m_autoScale = true;
+    else if (!renderScale.isEmpty() && renderScale != "auto")
+        m_renderScale = qBound(25, renderScale.toInt(), 100);
+
+    // DRMFBTEST_IDLE_MS=n: n ms without damage put the outputs in standby
+    // and stop rendering, the next change brings them back. Only the
+    // adaptive demo and DMA-BUF clients ever hold still.
+    if (!m_benchmark)
+        m_idleMs = qMax(0, qEnvironmentVariableIntValue("DRMFBTEST_IDLE_MS"));
+    if (m_idleMs) {
+        m_idleTimer.setSingleShot(true);
+        m_idleTimer.setInterval(m_idleMs);
+        connect(&m_idleTimer, &QTimer::timeout, this, &DumbBufferRenderer::enterIdle);
+        m_idleTimer.start();
+        qDebug("Standby after %d ms without changes", m_idleMs);
+    }
+
+    // The primary output, the first one in the order of the KMS config,
+    // lights up and gets its first frame before the others are started.
+    if (!outputs.isEmpty()) {
+        initializeOutputs(QVector<int>() << 0);
+        qDebug("Primary output %s up after %lld ms", qPrintable(outputs[0].kmsOutput.name), startup.elapsed());
+    }
+    if (outputs.count() > 1) {
+        QTimer::singleShot(0, this, [this, startup] {
+            QVector<int> secondary;
+            for (int i = 1; i < m_device->outputs()->count(); ++i)
+                secondary.append(i);
+            initializeOutputs(secondary);
+            qDebug("All outputs up after %lld ms", startup.elapsed());
+        });
+    }
+
+    // Benchmarks report per output index, which a hotplug would shuffle.
+    if (!m_benchmark && !m_device->isHeadless()) {
+        m_hotplug = new HotplugMonitor(m_device->devicePath(), this);
+        connect(m_hotplug, &HotplugMonitor::hotplug, this, &DumbBufferRenderer::updateOutputs);
+    }
+
+    // DRMFBTEST_DMABUF_SOCKET=path accepts frames from another process, see
+    // DmaBufServer. They go straight to an overlay plane of the primary
+    // output, top left. Only the first card listens.
+    const QByteArray dmaBufSocket = qgetenv("DRMFBTEST_DMABUF_SOCKET");
+    if (!dmaBufSocket.isEmpty() && m_device->isHeadless()) {
+        qWarning("DMA-BUF clients need a device, not listening on %s", dmaBufSocket.constData());
+    } else if (!m_benchmark && !dmaBufSocket.isEmpty() && m_card == 0) {
+        DmaBufServer *server = m_device->startDmaBufServer(dmaBufSocket);
+        connect(server, &DmaBufServer::present, this, &DumbBufferRenderer::presentDmaBuf);
+    }
+
+    // kill -USR1 for the statistics so far, of the first card: there is
+    // only one signal to go around
+    if (m_card == 0)
+        installTimingDumpHandler(this, [this] { m_device->dumpTiming(); });
+}
+
+void DumbBufferRenderer::initializeOutputs(const QVector<int> &indices)
+{
     // Now off to dumb buffer specifics.
-    m_device->createFramebuffers();
+    m_device->createFramebuffers(&m_scheduler, indices);
     // Do the modesetting.
-    m_device->setMode();
+    m_device->setMode(indices);
+    // With DRMFBTEST_LAYERS=1 the square gets a plane of its own where there
+    // is one, then only its position changes from frame to frame. Scrolling
+    // has no square.
+    QVector<Device::Output> &outputs(*m_device->outputs());
+    if (qEnvironmentVariableIntValue("DRMFBTEST_LAYERS") && !DisplayBackend::isScrollRequested()) {
+        for (int i : indices) {
+            Device::Output &output(outputs[i]);
+            if (!output.active)
+                continue;
+            // planes of their own are placed on the mode, not the buffer
+            const QSize size = DemoScene::squareRect(0, output.modeSize()).size();
+            int layer = m_device->createLayer(&output, Device::Layer::Overlay, size);
+            if (layer < 0)
+                layer = m_device->createLayer(&output, Device::Layer::Cursor, size);
+            if (layer < 0) {
+                qDebug("No plane for the square on %s, drawing it instead", qPrintable(output.kmsOutput.name));
+                continue;
+            }
+            const Device::Framebuffer &fb(output.layers[layer].fb);
+            fillRect32(fb.p, fb.pitch, QRect(QPoint(0, 0), size), 0xFF20A0FF);
+            m_squareLayers[i] = layer;
+        }
+    }
+
+    // then scale, the modeset is always at the full size
+    for (int i : indices) {
+        m_renderScales[i] = RenderScale();
+        m_renderScales[i].wanted = m_renderScale;
+        applyRenderScale(i);
+    }
 
-    m_timer.setInterval(16);
-    m_timer.setSingleShot(false);
-    connect(&m_timer, &QTimer::timeout, this, &DumbBufferRenderer::update);
-    m_timer.start();
+    if (m_sceneThread) {
+        for (int i : indices) {
+            if (m_squareLayers[i] < 0)
+                m_frameQueues[i] = m_sceneThread->addOutput(outputs[i].size());
+        }
+    }
+
+    if (m_latePacing) {
+        for (int i : indices) {
+            FrameScheduler *&frameScheduler(m_frameSchedulers[i]);
+            if (!frameScheduler) {
+                frameScheduler = new FrameScheduler(this);
+                // indices move with hotplug, the scheduler does not
+                connect(frameScheduler, &FrameScheduler::frameDue, this, [this, frameScheduler] {
+                    const int index = m_frameSchedulers.indexOf(frameScheduler);
+                    if (index >= 0) {
+                        m_due[index] = true;
+                        scheduleUpdate();
+                    }
+                });
+            }
+            const Device::Output &output(outputs[i]);
+            frameScheduler->setRefreshPeriod(FrameScheduler::refreshPeriodUs(output.kmsOutput.modes[output.kmsOutput.mode]));
+        }
+    }
+
+    // the first frame right away
+    for (int i : indices)
+        m_due[i] = true;
+    scheduleUpdate();
+}
+
+// Switches output index to the wanted scale, between frames.
+void DumbBufferRenderer::applyRenderScale(int index)
+{
+    RenderScale &scale(m_renderScales[index]);
+    if (scale.wanted == scale.percent)
+        return;
+    Device::Output &output((*m_device->outputs())[index]);
+    // The square's plane is placed on the mode and only moves, the primary
+    // buffer under it is not painted again to show a new size.
+    if (m_squareLayers[index] >= 0) {
+        qDebug("Not scaling %s, the square is on a plane of its own", qPrintable(output.kmsOutput.name));
+        scale.wanted = scale.percent;
+        scale.fixed = true;
+        return;
+    }
+    const QSize mode = output.modeSize();
+    // even sizes, some scalers want them
+    const QSize size(qMax(2, mode.width() * scale.wanted / 100) & ~1, qMax(2, mode.height() * scale.wanted / 100) & ~1);
+    // set first, setRenderSize() may present and come back here
+    const int previous = scale.percent;
+    scale.percent = scale.wanted;
+    switch (m_device->setRenderSize(&output, scale.wanted == 100 ? mode : size)) {
+    case Device::RenderSizeSet:
+        break;
+    case Device::RenderSizeLater:
+        // still wanted, the next framePresented() tries again
+        scale.percent = previous;
+        return;
+    case Device::RenderSizeUnsupported:
+        scale.percent = scale.wanted = previous;
+        scale.fixed = true;
+        return;
+    }
+
+    // What was made for the old size is of no use anymore, the new
+    // buffers are painted completely.
+    if (m_frameQueues[index]) {
+        m_sceneThread->removeOutput(m_frameQueues[index]);
+        m_frameQueues[index] = m_sceneThread->addOutput(output.size());
+    }
+    m_due[index] = true;
+    scheduleUpdate();
+}
+
+// DRMFBTEST_RENDER_SCALE=auto: a window of frames that took most of the
+// refresh period to render steps the scale down, one that took little of
+// it steps it back up. The cost goes with the square of the scale, one
+// step up from a window just under the low mark stays under the high one.
+void DumbBufferRenderer::adjustRenderScale(int index, qint64 renderUs)
+{
+    static const int ScaleWindow = 30; // frames
+    static const int ScaleStep = 10; // percent
+    static const int MinAutoScale = 50;
+
+    RenderScale &scale(m_renderScales[index]);
+    if (scale.fixed)
+        return;
+    scale.renderUs += renderUs;
+    if (++scale.frames < ScaleWindow)
+        return;
+    const qint64 mean = scale.renderUs / scale.frames;
+    scale.renderUs = 0;
+    scale.frames = 0;
+    const Device::Output &output((*m_device->outputs())[index]);
+    const qint64 period = FrameScheduler::refreshPeriodUs(output.kmsOutput.modes[output.kmsOutput.mode]);
+    if (mean > period * 3 / 4 && scale.percent > MinAutoScale)
+        scale.wanted = qMax(MinAutoScale, scale.percent - ScaleStep);
+    else if (mean < period / 3 && scale.percent < 100)
+        scale.wanted = qMin(100, scale.percent + ScaleStep);
+}
+
+// Cards with no frame on the way leave the barrier, so that the others do not
+// wait for them every frame. They are back with their next frame.
+void DumbBufferRenderer::setPresenting(bool presenting)
+{
+    if (!m_barrier || presenting == m_presenting)
+        return;
+    m_presenting = presenting;
+    if (presenting)
+        m_barrier->join();
+    else
+        m_barrier->leave();
+}
+
+void DumbBufferRenderer::enterIdle()
+{
+    m_idle = true;
+    setPresenting(false);
+    m_device->setStandby(true);
+}
+
+// Something changes on screen: the idle timer starts over, and outputs in
+// standby come back with what they had.
+void DumbBufferRenderer::wake()
+{
+    if (!m_idleMs)
+        return;
+    m_idleTimer.start();
+    if (!m_idle)
+        return;
+    m_idle = false;
+    m_device->setStandby(false);
+    scheduleUpdate();
+}
+
+void DumbBufferRenderer::contentChanged()
+{
+    wake();
+    for (bool &due : m_due)
+        due = true;
+    scheduleUpdate();
+
+    if (++m_contentTicks % (2 * m_contentFps) == 0) {
+        m_contentTimer.stop();
+        QTimer::singleShot(2000, &m_contentTimer, static_cast<void (QTimer::*)()>(&QTimer::start));
+    }
+}
+
+void DumbBufferRenderer::framePresented()
+{
+    for (int i = 0; i < m_renderScales.count(); ++i)
+        applyRenderScale(i);
+    if (!m_latePacing) {
+        // adaptive: a frame that could not be rendered for a lack of
+        // buffers goes out now
+        scheduleUpdate();
+        return;
+    }
+    // The flip timestamps keep the vblank predictions in phase.
+    QVector<Device::Output> &outputs(*m_device->outputs());
+    for (int i = 0; i < outputs.count(); ++i) {
+        FrameScheduler *frameScheduler = m_frameSchedulers.value(i);
+        if (!frameScheduler || !outputs[i].active)
+            continue;
+        if (outputs[i].timing.lastFlipUs())
+            frameScheduler->vblank(outputs[i].timing.lastFlipUs());
+        if (!outputs[i].flipPending)
+            frameScheduler->requestFrame();
+    }
+}
+
+void DumbBufferRenderer::updateOutputs()
+{
+    // new outputs come up lit in any case
+    wake();
+    const Device::OutputChanges changes = m_device->rescanOutputs();
+    for (int i : changes.removed) {
+        m_scene.removeOutput(i);
+        m_squareLayers.remove(i);
+        if (m_frameQueues[i])
+            m_sceneThread->removeOutput(m_frameQueues[i]);
+        m_frameQueues.remove(i);
+        delete m_frameSchedulers.takeAt(i);
+        m_due.remove(i);
+        m_renderScales.remove(i);
+    }
+    const int count = m_device->outputs()->count();
+    m_squareLayers.resize(count);
+    m_frameQueues.resize(count);
+    m_frameSchedulers.resize(count);
+    m_due.resize(count);
+    m_renderScales.resize(count);
+    for (int i : changes.added) {
+        // starts over
+        m_scene.removeOutput(i);
+        m_scene.insertOutput(i);
+        m_squareLayers[i] = -1;
+        if (m_frameQueues[i])
+            m_sceneThread->removeOutput(m_frameQueues[i]);
+        m_frameQueues[i].reset();
+        m_due[i] = false;
+    }
+    // the primary output lost its layers
+    if (changes.removed.contains(0) || changes.added.contains(0))
+        m_videoLayer = -1;
+    if (!changes.added.isEmpty())
+        initializeOutputs(changes.added);
+}
+
+void DumbBufferRenderer::presentDmaBuf(const Device::Framebuffer &buffer)
+{
+    wake();
+    Device::Framebuffer fb(buffer);
+    QVector<Device::Output> &outputs(*m_device->outputs());
+    if (outputs.isEmpty() || !outputs[0].active) {
+        m_device->releaseBuffer(&fb);
+        return;
+    }
+    Device::Output &output(outputs[0]);
+    if (m_videoLayer < 0) {
+        m_videoLayer = m_device->createLayer(&output, Device::Layer::Overlay, QSize(fb.width, fb.height));
+        if (m_videoLayer < 0) {
+            qWarning("No overlay plane left for DMA-BUF frames");
+            m_device->releaseBuffer(&fb);
+            return;
+        }
+    }
+    // committed with the next frame
+    m_device->setLayerBuffer(&output, m_videoLayer, fb);
+    scheduleUpdate();
 }
 
 DumbBufferRenderer::~DumbBufferRenderer()
 {
+    if (m_sceneThread) {
+        m_sceneThread->stop();
+        delete m_sceneThread;
+    }
     if (m_device) {
         qDebug("Closing down");
+        m_device->dumpTiming();
         m_device->destroyFramebuffers();
         m_device->close();
         delete m_device;
     }
+    delete m_benchmark;
+    setPresenting(false);
+}
+
+void DumbBufferRenderer::scheduleUpdate()
+{
+    if (m_updateScheduled)
+        return;
+    m_updateScheduled = true;
+    QTimer::singleShot(0, this, &DumbBufferRenderer::update);
 }
 
 void DumbBufferRenderer::update()
 {
-    for (Device::Output &output : *m_device->outputs()) {
-        void *p = output.fb[output.backFb].p;
-        if (p == MAP_FAILED)
+    m_updateScheduled = false;
+    if (m_benchmark) {
+        updateBenchmark();
+        return;
+    }
+    // nothing renders or flips until something changes
+    if (m_idle) {
+        setPresenting(false);
+        return;
+    }
+
+    QVector<Device::Output> &outputs(*m_device->outputs());
+    // The fills of all outputs go into one batch, split into tiles that
+    // are spread over the render threads. With shadow buffers endFrame()
+    // copies to the back buffers in tiles too.
+    QVector<TileScheduler::Job> jobs;
+    QVector<int> rendered;
+    QVector<QRegion> damage(outputs.count());
+    QVector<qint64> areas(outputs.count()); // painted pixels
+    qint64 totalArea = 0;
+    bool moved = false;
+    for (int i = 0; i < outputs.count(); ++i) {
+        Device::Output &output(outputs[i]);
+        if ((m_latePacing || m_contentDriven) && !m_due[i])
             continue;
-        quint32 *ip = static_cast<quint32 *>(p);
-        for (size_t i = 0; i < output.fb[output.backFb].size / 4; ++i)
-            *ip++ = (m_r << 16) | (m_g << 8) | (m_b);
-        m_r += 1;
-        m_g += 2;
-        m_b += 3;
-        m_device->swapBuffers(&output);
+        if (m_squareLayers[i] >= 0) {
+            // nothing to draw, the next commit moves the plane
+            if (!output.flipPending) {
+                m_scene.advance(i, output.modeSize());
+                m_device->moveLayer(&output, m_squareLayers[i], m_scene.square(i).topLeft());
+                m_due[i] = false;
+                moved = true;
+            }
+            continue;
+        }
+        // the scene thread has not got this far yet
+        if (m_frameQueues[i] && m_frameQueues[i]->isEmpty())
+            continue;
+        // no free buffer means waiting for a flip
+        Surface surface;
+        if (!m_device->beginFrame(i, &surface))
+            continue;
+        m_due[i] = false;
+        if (m_frameSchedulers[i])
+            m_frameSchedulers[i]->renderStarted();
+        DrawList list;
+        if (m_frameQueues[i]) {
+            m_frameQueues[i]->pop(&list);
+            m_sceneThread->wake();
+        } else {
+            // DRMFBTEST_SCROLL moves the shadow buffer, and what scrolled in
+            // is in the surface then.
+            const QRegion changed = m_scene.advance(i, surface.size, m_device);
+            m_device->beginFrame(i, &surface);
+            list = m_scene.record(i, surface.size);
+            list.damage = changed;
+        }
+        // The shadow buffer only misses the new damage, the back buffer
+        // everything that changed since it was last used.
+        const QRegion paint = list.damage + surface.behind;
+        list.rasterize(paint, *surface.format, surface.bits, surface.pitch, &jobs);
+        for (const QRect &rect : paint)
+            areas[i] += qint64(rect.width()) * rect.height();
+        totalArea += areas[i];
+        damage[i] = list.damage;
+        rendered.append(i);
+    }
+    if (rendered.isEmpty() && !moved) {
+        // A flip on the way brings the next frame, otherwise nothing may
+        // come for a while.
+        bool flipPending = false;
+        for (const Device::Output &output : outputs)
+            flipPending |= output.flipPending;
+        if (!flipPending)
+            setPresenting(false);
+        return;
+    }
+    wake();
+    setPresenting(true);
+
+    const qint64 batchStart = FrameTiming::monotonicUs();
+    m_scheduler.run(jobs);
+    const qint64 batchUs = FrameTiming::monotonicUs() - batchStart;
+    for (int i : rendered) {
+        const qint64 flushStart = FrameTiming::monotonicUs();
+        m_device->endFrame(i, damage[i]);
+        // The tiles of all outputs are mixed on the threads, so an output
+        // is charged its share of the batch by the pixels painted, plus its
+        // own copy out of the shadow buffer.
+        if (m_autoScale) {
+            const qint64 share = totalArea ? batchUs * areas[i] / totalArea : 0;
+            adjustRenderScale(i, share + FrameTiming::monotonicUs() - flushStart);
+        }
+        // The frame schedulers are charged for the whole batch, the frames
+        // of all outputs are ready at its end.
+        if (m_frameSchedulers[i])
+            m_frameSchedulers[i]->renderFinished();
+    }
+    if (m_barrier)
+        m_barrier->arrive(PresentAlignTimeout);
+    m_device->swapBuffers();
+
+    // With more than two buffers, or in mailbox mode, the next frame can be
+    // rendered while the previous one is still waiting for its flip. Layers
+    // only move once per flip. Late pacing and content driven rendering
+    // never render ahead.
+    if (m_latePacing || m_contentDriven)
+        return;
+    for (int i = 0; i < outputs.count(); ++i) {
+        if (m_squareLayers[i] < 0 && outputs[i].swapchain.hasFree()) {
+            scheduleUpdate();
+            break;
+        }
     }
 }
 
+void DumbBufferRenderer::updateBenchmark()
+{
+    if (!m_benchmark->renderFrame(m_device)) {
+        // the card's thread, main() quits once all cards are done
+        QThread::currentThread()->quit();
+        return;
+    }
+
+    for (const Device::Output &output : *m_device->outputs()) {
+        if (output.swapchain.hasFree()) {
+            scheduleUpdate();
+            break;
+        }
+    }
+}
+
+// Every card gets a thread with its own Device, renderer and event loop, so
+// that its flip events are handled when they come in, whatever the other
+// cards are busy with.
+class CardThread : public QThread
+{
+public:
+    CardThread(const QString &devicePath, int card, PresentBarrier *barrier)
+        : m_devicePath(devicePath), m_card(card), m_barrier(barrier) { }
+
+protected:
+    void run() override
+    {
+        {
+            DumbBufferRenderer renderer(m_devicePath, m_card, m_barrier);
+            // leaves the barrier when it goes
+            m_valid = renderer.isValid();
+            if (m_valid)
+                exec();
+        }
+    }
+
+public:
+    // whether the card came up, once the thread is done
+    bool isValid() const { return m_valid; }
+
+private:
+    QString m_devicePath;
+    bool m_valid = false;
+    int m_card;
+    PresentBarrier *m_barrier;
+};
+
 int main(int argc, char **argv)
 {
-    qputenv("QT_QPA_PLATFORM", "linuxfb:nographicsmodeswitch"); // something whose init won't interfere with us
+    // something whose init won't interfere with us, and needs no device at
+    // all when there is none
+    qputenv("QT_QPA_PLATFORM", HeadlessDisplay::isRequested() ? "offscreen" : "linuxfb:nographicsmodeswitch");
     qputenv("QT_LOGGING_RULES", "qt.qpa.*=true");
     QGuiApplication app(argc, argv);
 
-    DumbBufferRenderer r;
+    // DRMFBTEST_HEADLESS draws into memory instead of the cards, as one
+    // card, see Device.
+    const QStringList devices = HeadlessDisplay::isRequested() ? QStringList { QString() } : requestedDrmDevices();
+    if (devices.isEmpty())
+        return 1;
+
+    // With several cards their frames go out together. Benchmarks measure
+    // each card on its own.
+    QScopedPointer<PresentBarrier> barrier;
+    if (devices.count() > 1 && !Benchmark::isRequested())
+        barrier.reset(new PresentBarrier(devices.count()));
+
+    QVector<CardThread *> threads;
+    int running = devices.count();
+    for (int i = 0; i < devices.count(); ++i) {
+        CardThread *thread = new CardThread(devices[i], i, barrier.data());
+        QObject::connect(thread, &QThread::finished, &app, [&running] {
+            if (--running == 0)
+                QCoreApplication::quit();
+        });
+        thread->start();
+        threads.append(thread);
+    }
 
-    const int t = 10;
-    qDebug("Running for %d seconds", t);
-    QTimer::singleShot(t * 1000, &app, &QCoreApplication::quit);
-    return app.exec();
+    // benchmarks quit when they are done
+    if (!Benchmark::isRequested()) {
+        const int t = 10;
+        qDebug("Running for %d seconds", t);
+        QTimer::singleShot(t * 1000, &app, &QCoreApplication::quit);
+    }
+    const int ret = app.exec();
+    bool valid = false;
+    for (CardThread *thread : threads) {
+        // a quit() before the thread got to exec() would be lost
+        do
+            thread->quit();
+        while (!thread->wait(100));
+        valid |= thread->isValid();
+        delete thread;
+    }
+    // no card at all is a failure, also for the scripts running this
+    return valid ? ret : 1;
 }
+
+#include "main.moc"
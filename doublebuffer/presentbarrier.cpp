@@ -0,0 +1,44 @@
+#include "presentbarrier.h"
+#include <QElapsedTimer>
+
+bool PresentBarrier::arrive(int timeoutMs)
+{
+    QMutexLocker locker(&m_mutex);
+    const quint64 generation = m_generation;
+    if (++m_arrived >= m_participants) {
+        m_arrived = 0;
+        ++m_generation;
+        m_released.wakeAll();
+        return true;
+    }
+
+    QElapsedTimer waited;
+    waited.start();
+    while (generation == m_generation) {
+        const qint64 left = timeoutMs - waited.elapsed();
+        if (left <= 0 || !m_released.wait(&m_mutex, ulong(left)))
+            break;
+    }
+    if (generation != m_generation)
+        return true;
+    // the others keep waiting for a full house without this one
+    --m_arrived;
+    return false;
+}
+
+void PresentBarrier::join()
+{
+    QMutexLocker locker(&m_mutex);
+    ++m_participants;
+}
+
+void PresentBarrier::leave()
+{
+    QMutexLocker locker(&m_mutex);
+    --m_participants;
+    if (m_arrived && m_arrived >= m_participants) {
+        m_arrived = 0;
+        ++m_generation;
+        m_released.wakeAll();
+    }
+}
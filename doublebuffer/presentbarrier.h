@@ -0,0 +1,37 @@
+#ifndef PRESENTBARRIER_H
+#define PRESENTBARRIER_H
+
+#include <QMutex>
+#include <QWaitCondition>
+
+// Keeps the cards on the same frame: every card's thread arrives here with
+// its frame before presenting it, and waits until all cards have theirs
+// ready. Cards are not genlocked, each flip still lands on the next vblank
+// of its own card, but no card runs ahead of the others by more than that.
+//
+// A card with no frame on the way, because it has no outputs, is idle or its
+// content holds still, has to leave() until it has one, or the others would
+// wait out the timeout on every frame. One that is stuck is waited for up to
+// the timeout, then the frame goes out without it.
+class PresentBarrier
+{
+public:
+    explicit PresentBarrier(int participants) : m_participants(participants) { }
+
+    // False when the wait timed out.
+    bool arrive(int timeoutMs);
+    // For a card that goes away or has nothing to present for now, so that
+    // the others stop waiting for it.
+    void leave();
+    // Back after a leave(), the next frames are waited for again.
+    void join();
+
+private:
+    QMutex m_mutex;
+    QWaitCondition m_released;
+    int m_participants;
+    int m_arrived = 0;
+    quint64 m_generation = 0;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#include "swapchain.h"
+
+void Swapchain::reset(int bufferCount, PresentMode mode)
+{
+    m_mode = mode;
+    m_buffers.fill(Buffer(), bufferCount);
+    m_damageHistory.clear();
+    m_frame = 0;
+}
+
+bool Swapchain::hasFree() const
+{
+    for (const Buffer &b : m_buffers) {
+        if (b.state == Free)
+            return true;
+    }
+    return false;
+}
+
+bool Swapchain::hasQueued() const
+{
+    for (const Buffer &b : m_buffers) {
+        if (b.state == Queued)
+            return true;
+    }
+    return false;
+}
+
+int Swapchain::scanningOut() const
+{
+    for (int i = 0; i < m_buffers.count(); ++i) {
+        if (m_buffers[i].state == ScanningOut)
+            return i;
+    }
+    return -1;
+}
+
+void Swapchain::setScanningOut(int index)
+{
+    for (Buffer &b : m_buffers) {
+        if (b.state == ScanningOut)
+            b.state = Free;
+    }
+    m_buffers[index].state = ScanningOut;
+}
+
+int Swapchain::acquire()
+{
+    // Prefer the free buffer with the most recent contents, it has the
+    // least to repaint.
+    int index = -1;
+    for (int i = 0; i < m_buffers.count(); ++i) {
+        if (m_buffers[i].state == Free && (index < 0 || m_buffers[i].frame > m_buffers[index].frame))
+            index = i;
+    }
+    if (index >= 0)
+        m_buffers[index].state = Rendering;
+    return index;
+}
+
+// What changed going from the contents of frame from to frame to.
+QRegion Swapchain::damageBetween(quint64 from, quint64 to, const QRect &bounds) const
+{
+    if (!from || m_frame - from > quint64(m_damageHistory.count()))
+        return QRegion(bounds);
+
+    QRegion region;
+    for (quint64 frame = from + 1; frame <= to; ++frame)
+        region += m_damageHistory[m_frame - frame];
+    return region;
+}
+
+QRegion Swapchain::repaintRegion(int index, const QRegion &damage, const QRect &bounds) const
+{
+    return damage.united(damageBetween(m_buffers[index].frame, m_frame, bounds));
+}
+
+void Swapchain::cancel(int index)
+{
+    if (m_buffers[index].state == Rendering)
+        m_buffers[index].state = Free;
+}
+
+void Swapchain::queue(int index, const QRegion &damage)
+{
+    ++m_frame;
+    m_damageHistory.prepend(damage);
+    if (m_damageHistory.count() > MaxDamageHistory)
+        m_damageHistory.removeLast();
+
+    if (m_mode == Mailbox) {
+        // Superseded by the new frame. The contents stay valid, so these
+        // are cheap to reuse.
+        for (Buffer &b : m_buffers) {
+            if (b.state == Queued)
+                b.state = Free;
+        }
+    }
+
+    m_buffers[index].state = Queued;
+    m_buffers[index].frame = m_frame;
+}
+
+int Swapchain::takeNextForPresent(const QRect &bounds, QRegion *damage)
+{
+    quint64 onScreen = 0;
+    int index = -1;
+    for (int i = 0; i < m_buffers.count(); ++i) {
+        const Buffer &b(m_buffers[i]);
+        if (b.state == ScanningOut)
+            onScreen = b.frame;
+        // Mailbox leaves at most one queued buffer, so taking the
+        // oldest is right for both modes.
+        if (b.state == Queued && (index < 0 || b.frame < m_buffers[index].frame))
+            index = i;
+    }
+    if (index < 0)
+        return -1;
+
+    m_buffers[index].state = Flipping;
+    if (damage)
+        *damage = damageBetween(onScreen, m_buffers[index].frame, bounds);
+    return index;
+}
+
+void Swapchain::presentFailed(int index)
+{
+    m_buffers[index].state = Free;
+}
+
+void Swapchain::flipCompleted()
+{
+    int flipped = -1;
+    for (int i = 0; i < m_buffers.count(); ++i) {
+        if (m_buffers[i].state == Flipping)
+            flipped = i;
+    }
+    if (flipped < 0)
+        return;
+
+    for (Buffer &b : m_buffers) {
+        if (b.state == ScanningOut)
+            b.state = Free;
+    }
+    m_buffers[flipped].state = ScanningOut;
+}
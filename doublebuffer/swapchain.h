@@ -0,0 +1,74 @@
+#ifndef SWAPCHAIN_H
+#define SWAPCHAIN_H
+
+#include <QVector>
+#include <QRegion>
+
+// Tracks the state of the 2-4 buffers of one output. Knows nothing about DRM,
+// buffers are identified by their index.
+//
+// Every queued buffer is a new frame. The damage of the most recent frames is
+// kept so that a buffer with older contents only needs to have the difference
+// repainted, no matter how many frames were dropped in between.
+class Swapchain
+{
+public:
+    enum PresentMode {
+        Fifo,   // every queued frame is shown, in order
+        Mailbox // only the newest queued frame is shown, older ones are dropped
+    };
+
+    enum BufferState {
+        Free,
+        Rendering,
+        Queued,
+        Flipping,   // submitted, flip not yet completed
+        ScanningOut
+    };
+
+    void reset(int bufferCount, PresentMode mode);
+    int bufferCount() const { return m_buffers.count(); }
+    PresentMode presentMode() const { return m_mode; }
+    BufferState state(int index) const { return m_buffers[index].state; }
+    bool hasFree() const;
+    bool hasQueued() const;
+    // the buffer on screen, -1 before the first modeset
+    int scanningOut() const;
+
+    // Marks a buffer as being scanned out without a frame of known contents,
+    // e.g. the one used for the initial modeset.
+    void setScanningOut(int index);
+
+    // Returns a free buffer to render into, or -1 if there is none.
+    int acquire();
+    // What has to be repainted in the acquired buffer: the damage of the new
+    // frame plus everything that changed since the buffer was last current.
+    QRegion repaintRegion(int index, const QRegion &damage, const QRect &bounds) const;
+    void queue(int index, const QRegion &damage);
+    // Gives an acquired buffer back without making a frame of it. Anything
+    // painted into it counts as not painted.
+    void cancel(int index);
+
+    // Picks the queued buffer to flip to next, or -1. damage receives what
+    // changed compared to what is on screen.
+    int takeNextForPresent(const QRect &bounds, QRegion *damage);
+    void presentFailed(int index);
+    void flipCompleted();
+
+private:
+    QRegion damageBetween(quint64 from, quint64 to, const QRect &bounds) const;
+
+    struct Buffer {
+        BufferState state = Free;
+        quint64 frame = 0; // 0 = undefined contents
+    };
+
+    static const int MaxDamageHistory = 8;
+
+    PresentMode m_mode = Fifo;
+    QVector<Buffer> m_buffers;
+    QVector<QRegion> m_damageHistory; // most recent frame first
+    quint64 m_frame = 0;
+};
+
+#endif
@@ -1,3 +1,5 @@
 QT += core-private kms_support-private
 
 SOURCES = main.cpp
+
+include(../common/common.pri)
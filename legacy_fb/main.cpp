@@ -2,15 +2,33 @@
 #include <QTimer>
 #include <QRect>
 #include <QDebug>
+#include <QThread>
+#include <QAtomicInt>
+#include <QScopedPointer>
 #include <QtCore/private/qcore_unix_p.h>
 #include <sys/mman.h>
 #include <linux/fb.h>
+#include "pixelformat.h"
+#include "benchmark.h"
+#include "shadowbuffer.h"
+#include "framescheduler.h"
+#include "frametiming.h"
+#include "displaybackend.h"
+#include "demoscene.h"
+#include "scrollwindow.h"
+#include "damagetracker.h"
+#include "tilescheduler.h"
+#include "headlessdisplay.h"
 
-class Device
+class Device : public DisplayBackend
 {
 public:
-    Device();
-    bool open();
+    // An empty path opens the first DRMFBTEST_HEADLESS output instead.
+    explicit Device(const QString &path);
+    // panning asks for two buffers in the virtual resolution, see
+    // setUpPanning(), scrolling for a window into twice the screen, see
+    // setUpScrolling(). Panning wins when both are asked for.
+    bool open(bool panning, bool scrolling);
     void close();
 
     struct Framebuffer {
@@ -18,53 +36,111 @@ public:
             : size(0),
               pitch(0),
               p(MAP_FAILED),
-              depth(0)
+              format(nullptr)
             { }
         uint64_t size;
         uint32_t pitch;
         void *p;
-        int depth;
+        const PixelFormat *format;
         QRect geom;
     };
 
+    // Blocks until the next vsync. Not every driver has FBIO_WAITFORVSYNC.
+    bool waitForVsync();
+
+    // With two buffers: marks the back buffer as done, the next
+    // flipPending() shows it and the other one becomes the back buffer.
+    void queueFlip();
+    // Called right after a vsync, pans to the queued buffer if there is one.
+    void flipPending();
+    bool isFlipPending() const { return pendingBuffer.load() >= 0; }
+
+    QString devicePath;
     int fd;
     Framebuffer fb;
+    int bufferCount = 1; // 2 when panning between the halves of yres_virtual
+    int backBuffer = 0; // the one the renderer draws into
+    QAtomicInt pendingBuffer = -1; // set by the renderer, taken by the vsync thread
+    fb_var_screeninfo vinfo; // as set up in open()
+    qint64 refreshPeriodUs = 0; // from the timings in fb_var_screeninfo
+    fb_var_screeninfo savedVinfo; // to put back what DRMFBTEST_FORMAT changed
+    bool vinfoChanged = false;
+    ShadowBuffer shadow; // DRMFBTEST_SHADOW or DRMFBTEST_AUTO_DAMAGE
+    ScrollWindow window; // DRMFBTEST_SCROLL without panning
 
+    // the back buffer, which is the visible one without panning
+    QRect backGeometry() const {
+        return fb.geom.translated(0, backBuffer * fb.geom.height() + window.offset());
+    }
     uchar *screenStart() {
-        return static_cast<uchar *>(fb.p) + fb.geom.y() * fb.pitch + fb.geom.x() * fb.depth / 8;
+        const QRect geom = backGeometry();
+        return static_cast<uchar *>(fb.p) + geom.y() * fb.pitch + geom.x() * fb.format->bytesPerPixel();
     }
+    // the back buffer, for QPainter
+    QImage image() {
+        return fb.p == MAP_FAILED ? QImage() : wrapRect(*fb.format, fb.p, fb.pitch, backGeometry());
+    }
+
+    // DisplayBackend, one output. With panning a frame is shown by the
+    // vsync thread, endFrame() queues it.
+    int outputCount() const override { return fb.p == MAP_FAILED ? 0 : 1; }
+    QString outputName(int output) const override { Q_UNUSED(output); return QStringLiteral("fb0"); }
+    QSize outputSize(int output) const override { Q_UNUSED(output); return fb.geom.size(); }
+    bool beginFrame(int output, Surface *surface) override;
+    void endFrame(int output, const QRegion &damage) override;
+    // Pans the window when there is one, otherwise only moves the shadow
+    // buffer, which then goes out in full.
+    bool scroll(int output, int dy) override;
+
+private:
+    bool openDevice(fb_fix_screeninfo *finfo);
+    bool openHeadless(fb_fix_screeninfo *finfo);
+    bool setUpTallBuffer(fb_fix_screeninfo *finfo);
+    bool setUpPanning(fb_fix_screeninfo *finfo);
+    bool setUpScrolling(fb_fix_screeninfo *finfo);
+    bool panTo(int yoffset);
+
+    QRegion m_lastDamage; // what the other buffer has and the back buffer has not
+    QRegion m_exposed; // scrolled in, still to be painted
+    DamageTracker m_damageTracker; // DRMFBTEST_AUTO_DAMAGE
+    TileScheduler *m_hashPool = nullptr; // hashes the tiles, only with the tracker
+    int m_panStep = 1;
+    bool m_windowMoved = false;
+    bool m_shadowMoved = false;
+    HeadlessDisplay *m_headless = nullptr; // in place of the device
 };
 
-Device::Device()
-    : fd(-1)
+Device::Device(const QString &path)
+    : devicePath(path),
+      fd(-1)
 {
 }
 
-bool Device::open()
+bool Device::open(bool panning, bool scrolling)
 {
-    const QString devicePath = QStringLiteral("/dev/fb0");
-    fd = qt_safe_open(devicePath.toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
-    if (fd == -1) {
-        qErrnoWarning("Could not open device %s", qPrintable(devicePath));
-        return false;
-    }
-
     fb_fix_screeninfo finfo;
-    fb_var_screeninfo vinfo;
     memset(&vinfo, 0, sizeof(vinfo));
     memset(&finfo, 0, sizeof(finfo));
-    if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo) != 0) {
-        qErrnoWarning(errno, "Error reading fixed information");
+    if (!(devicePath.isEmpty() ? openHeadless(&finfo) : openDevice(&finfo)))
         return false;
-    }
-    if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo)) {
-        qErrnoWarning(errno, "Error reading variable information");
+
+    fb.format = PixelFormat::fromFbdev(vinfo);
+    if (!fb.format) {
+        qWarning("Unsupported pixel layout: %u bpp, red %u/%u, green %u/%u, blue %u/%u",
+                 vinfo.bits_per_pixel, vinfo.red.offset, vinfo.red.length,
+                 vinfo.green.offset, vinfo.green.length, vinfo.blue.offset, vinfo.blue.length);
         return false;
     }
+    qDebug("Format is %s", fb.format->name);
+
+    if (panning && !setUpPanning(&finfo))
+        qWarning("No panning, falling back to a single buffer");
+    else if (!panning && scrolling && !setUpScrolling(&finfo))
+        qWarning("No scrolling by panning");
 
     fb.size = finfo.smem_len;
     fb.pitch = finfo.line_length;
-    fb.p = mmap(0, fb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    fb.p = m_headless ? HeadlessDisplay::map(fb.size) : mmap(0, fb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if (fb.p == MAP_FAILED) {
         qErrnoWarning(errno, "Failed to mmap framebuffer");
         return false;
@@ -72,40 +148,345 @@ bool Device::open()
 
     qDebug("Mapped framebuffer at %p, sizeo %lu, stride %u", fb.p, fb.size, fb.pitch);
 
-    fb.depth = vinfo.bits_per_pixel;
-    if (fb.depth == 24) {
-        fb.depth = vinfo.red.length + vinfo.green.length + vinfo.blue.length;
-        if (fb.depth <= 0)
-            fb.depth = 24;
-    } else if (fb.depth == 16) {
-        fb.depth = vinfo.red.length + vinfo.green.length + vinfo.blue.length;
-        if (fb.depth <= 0)
-            fb.depth = 16;
+    fb.geom = QRect(vinfo.xoffset, vinfo.yoffset, vinfo.xres, vinfo.yres);
+    qDebug() << fb.geom;
+
+    // pixclock is in picoseconds, 0 when the driver does not say
+    const int htotal = vinfo.xres + vinfo.left_margin + vinfo.right_margin + vinfo.hsync_len;
+    const int vtotal = vinfo.yres + vinfo.upper_margin + vinfo.lower_margin + vinfo.vsync_len;
+    refreshPeriodUs = FrameScheduler::refreshPeriodUs(vinfo.pixclock ? 1000000000000LL / vinfo.pixclock : 0,
+                                                      htotal, vtotal);
+    if (m_headless)
+        refreshPeriodUs = m_headless->outputs().first().periodUs;
+
+    if (ShadowBuffer::isRequested() || DamageTracker::isRequested())
+        shadow.create(fb.geom.size(), *fb.format);
+    if (DamageTracker::isRequested() && !shadow.isNull()) {
+        m_damageTracker.reset(fb.geom.size());
+        m_hashPool = new TileScheduler;
+        qDebug("Detecting damage in tiles of %dx%d", DamageTracker::TileSize, DamageTracker::TileSize);
     }
-    qDebug("Depth is %d", fb.depth);
 
-    if (fb.depth != 32) {
-        qWarning("Depths other than 32 will not work for now");
+    return true;
+}
+
+bool Device::openDevice(fb_fix_screeninfo *finfo)
+{
+    fd = qt_safe_open(devicePath.toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        qErrnoWarning("Could not open device %s", qPrintable(devicePath));
         return false;
     }
 
-    fb.geom = QRect(vinfo.xoffset, vinfo.yoffset, vinfo.xres, vinfo.yres);
-    qDebug() << fb.geom;
+    if (ioctl(fd, FBIOGET_FSCREENINFO, finfo) != 0) {
+        qErrnoWarning(errno, "Error reading fixed information");
+        return false;
+    }
+    if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo)) {
+        qErrnoWarning(errno, "Error reading variable information");
+        return false;
+    }
 
+    // Ask for DRMFBTEST_FORMAT. Drivers that cannot do it either fail or
+    // pick something close, the bitfields tell what we got.
+    if (qEnvironmentVariableIsSet("DRMFBTEST_FORMAT")) {
+        fb_var_screeninfo request = vinfo;
+        PixelFormat::requested().toFbdev(&request);
+        request.activate = FB_ACTIVATE_NOW;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &request) != 0) {
+            qErrnoWarning(errno, "Failed to switch to %s", PixelFormat::requested().name);
+        } else {
+            savedVinfo = vinfo;
+            vinfoChanged = true;
+            // the pitch and the size of the mapping change with it
+            if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) != 0 || ioctl(fd, FBIOGET_FSCREENINFO, finfo) != 0) {
+                qErrnoWarning(errno, "Error reading back the screen information");
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// DRMFBTEST_FORMAT as asked for, with room for two screens like the fbdev
+// emulation of DRM drivers often has, and a vsync that is waited for as
+// with FBIO_WAITFORVSYNC. Panning changes nothing, there is no scanout.
+bool Device::openHeadless(fb_fix_screeninfo *finfo)
+{
+    QScopedPointer<HeadlessDisplay> display(new HeadlessDisplay);
+    if (display->outputs().isEmpty() || display->fd() == -1)
+        return false;
+    if (display->outputs().count() > 1)
+        qWarning("Using only %s", qPrintable(display->outputs().first().name));
+    const QSize size = display->outputs().first().size;
+    const PixelFormat &format(PixelFormat::requested());
+    format.toFbdev(&vinfo);
+    vinfo.xres = vinfo.xres_virtual = uint32_t(size.width());
+    vinfo.yres = uint32_t(size.height());
+    vinfo.yres_virtual = vinfo.yres * 2;
+    finfo->line_length = HeadlessDisplay::pitch(size.width(), format.bytesPerPixel());
+    finfo->smem_len = finfo->line_length * vinfo.yres_virtual;
+    finfo->ypanstep = 1;
+    m_headless = display.take();
     return true;
 }
 
 void Device::close()
 {
+    delete m_hashPool;
+    m_hashPool = nullptr;
+    shadow.destroy();
     if (fb.p != MAP_FAILED)
         munmap(fb.p, fb.size);
     fb = Framebuffer();
+    bufferCount = 1;
+    backBuffer = 0;
+    pendingBuffer.store(-1);
+    window = ScrollWindow();
+    m_lastDamage = QRegion();
+    m_exposed = QRegion();
+    if (vinfoChanged) {
+        savedVinfo.activate = FB_ACTIVATE_NOW;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &savedVinfo) != 0)
+            qErrnoWarning(errno, "Failed to restore the screen information");
+        vinfoChanged = false;
+    }
     if (fd != -1) {
         qt_safe_close(fd);
         fd = -1;
     }
+    delete m_headless;
+    m_headless = nullptr;
 }
 
+bool Device::waitForVsync()
+{
+    if (m_headless) {
+        m_headless->requestVblank(0);
+        return m_headless->dispatch([](int, unsigned int, qint64) { });
+    }
+    quint32 crtc = 0;
+    return ioctl(fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+}
+
+// Doubles yres_virtual so that the mapping holds two screens. Each step can
+// fail on drivers that have a fixed virtual resolution, cannot pan, or have
+// no memory for a second screen. The mapping and the pitch are taken from
+// finfo, so it is read back.
+bool Device::setUpTallBuffer(fb_fix_screeninfo *finfo)
+{
+    if (vinfo.yres_virtual < vinfo.yres * 2) {
+        fb_var_screeninfo request = vinfo;
+        request.xres_virtual = vinfo.xres;
+        request.yres_virtual = vinfo.yres * 2;
+        request.xoffset = 0;
+        request.yoffset = 0;
+        request.activate = FB_ACTIVATE_NOW;
+        if (ioctl(fd, FBIOPUT_VSCREENINFO, &request) != 0) {
+            qErrnoWarning(errno, "Failed to set the virtual resolution to %ux%u",
+                          request.xres_virtual, request.yres_virtual);
+            return false;
+        }
+        if (!vinfoChanged) {
+            savedVinfo = vinfo;
+            vinfoChanged = true;
+        }
+        if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) != 0 || ioctl(fd, FBIOGET_FSCREENINFO, finfo) != 0) {
+            qErrnoWarning(errno, "Error reading back the screen information");
+            return false;
+        }
+    }
+    // some drivers take the request and round it down
+    if (vinfo.yres_virtual < vinfo.yres * 2 || finfo->smem_len < finfo->line_length * vinfo.yres * 2) {
+        qWarning("Virtual resolution %ux%u holds only one buffer", vinfo.xres_virtual, vinfo.yres_virtual);
+        return false;
+    }
+    if (!finfo->ypanstep) {
+        qWarning("Driver cannot pan vertically");
+        return false;
+    }
+    m_panStep = finfo->ypanstep;
+    return true;
+}
+
+// One screen shown while the other is drawn. Without FBIO_WAITFORVSYNC the
+// flip could not be timed.
+bool Device::setUpPanning(fb_fix_screeninfo *finfo)
+{
+    if (!waitForVsync()) {
+        qErrnoWarning(errno, "No FBIO_WAITFORVSYNC");
+        return false;
+    }
+    if (!setUpTallBuffer(finfo) || !panTo(0))
+        return false;
+
+    bufferCount = 2;
+    backBuffer = 1;
+    vinfo.xoffset = 0;
+    vinfo.yoffset = 0;
+    qDebug("Double buffering by panning, virtual resolution %ux%u", vinfo.xres_virtual, vinfo.yres_virtual);
+    return true;
+}
+
+// A screen sized window that scroll() slides over the tall buffer. Both ends
+// have to be offsets the driver can pan to.
+bool Device::setUpScrolling(fb_fix_screeninfo *finfo)
+{
+    if (!setUpTallBuffer(finfo))
+        return false;
+    if (vinfo.yres % m_panStep) {
+        qWarning("Height %u is not a multiple of the pan step %d", vinfo.yres, m_panStep);
+        return false;
+    }
+    if (!panTo(0))
+        return false;
+    window.reset(vinfo.yres);
+    vinfo.xoffset = 0;
+    vinfo.yoffset = 0;
+    qDebug("Scrolling by panning in steps of %d, virtual resolution %ux%u",
+           m_panStep, vinfo.xres_virtual, vinfo.yres_virtual);
+    return true;
+}
+
+bool Device::panTo(int yoffset)
+{
+    if (m_headless)
+        return true;
+    fb_var_screeninfo request = vinfo;
+    request.xoffset = 0;
+    request.yoffset = yoffset;
+    if (ioctl(fd, FBIOPAN_DISPLAY, &request) != 0) {
+        qErrnoWarning(errno, "Failed to pan to %d", yoffset);
+        return false;
+    }
+    return true;
+}
+
+bool Device::beginFrame(int output, Surface *surface)
+{
+    Q_UNUSED(output);
+    // Both buffers are taken until the vsync thread pans.
+    if (fb.p == MAP_FAILED || isFlipPending())
+        return false;
+    const bool useShadow = !shadow.isNull();
+    surface->bits = useShadow ? shadow.bits() : screenStart();
+    surface->pitch = useShadow ? shadow.pitch() : int(fb.pitch);
+    surface->size = fb.geom.size();
+    surface->format = fb.format;
+    // the back buffer is one frame behind the other
+    surface->behind = m_exposed;
+    if (bufferCount > 1 && !useShadow)
+        surface->behind += m_lastDamage;
+    return true;
+}
+
+void Device::endFrame(int output, const QRegion &damage)
+{
+    Q_UNUSED(output);
+    // Clients that cannot tell report everything, the tracker finds out
+    // what actually changed.
+    QRegion changed = damage + m_exposed;
+    if (m_hashPool)
+        changed = m_damageTracker.detect(shadow, QRect(QPoint(0, 0), fb.geom.size()), m_hashPool) + m_exposed;
+    if (m_shadowMoved)
+        changed = QRect(QPoint(0, 0), fb.geom.size());
+    if (!shadow.isNull())
+        shadow.flush(screenStart(), fb.pitch, bufferCount > 1 ? changed + m_lastDamage : changed);
+    m_lastDamage = changed;
+    m_exposed = QRegion();
+    m_shadowMoved = false;
+    // A single buffer does not wait for anything, the window moves right
+    // away.
+    if (m_windowMoved)
+        panTo(window.offset());
+    m_windowMoved = false;
+    queueFlip();
+}
+
+bool Device::scroll(int output, int dy)
+{
+    Q_UNUSED(output);
+    const QSize size = fb.geom.size();
+    if (fb.p == MAP_FAILED || isFlipPending() || !dy || qAbs(dy) >= size.height())
+        return false;
+    const bool useWindow = !window.isNull() && dy % m_panStep == 0;
+    if (!useWindow && shadow.isNull())
+        return false;
+
+    const QRect bounds(QPoint(0, 0), size);
+    const QRect exposed = dy > 0 ? QRect(0, size.height() - dy, size.width(), dy)
+                                 : QRect(0, 0, size.width(), -dy);
+    shadow.scroll(dy);
+    // The screen moved with the shadow, the hashes did not.
+    m_damageTracker.invalidate();
+    m_exposed = m_exposed.translated(0, -dy).intersected(bounds) + exposed;
+    m_lastDamage = m_lastDamage.translated(0, -dy).intersected(bounds);
+    if (!useWindow) {
+        m_shadowMoved = true;
+        return true;
+    }
+
+    const ScrollWindow::Move move = window.scroll(dy);
+    if (move.rows) {
+        // Starting over at the other end, where the rows that stay are not
+        // on screen yet, see singlebuffer.
+        uchar *p = static_cast<uchar *>(fb.p);
+        if (!shadow.isNull())
+            shadow.flush(screenStart(), fb.pitch, QRect(0, qMax(-dy, 0), size.width(), move.rows));
+        else
+            memmove(p + size_t(move.to) * fb.pitch, p + size_t(move.from) * fb.pitch,
+                    size_t(move.rows) * fb.pitch);
+    }
+    m_windowMoved = true;
+    return true;
+}
+
+void Device::queueFlip()
+{
+    if (bufferCount < 2)
+        return;
+    pendingBuffer.store(backBuffer);
+    backBuffer ^= 1;
+}
+
+void Device::flipPending()
+{
+    const int buffer = pendingBuffer.fetchAndStoreOrdered(-1);
+    if (buffer >= 0)
+        panTo(buffer * vinfo.yres);
+}
+
+// fbdev has no vsync events, only the blocking FBIO_WAITFORVSYNC, so a thread
+// waits and passes the timestamps on. With panning it also flips, right at
+// the start of the vblank, so that the new offset is latched for the next
+// frame.
+class VsyncThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit VsyncThread(Device *device) : m_device(device) { }
+
+signals:
+    void vsync(qint64 timestampUs);
+
+protected:
+    void run() override
+    {
+        while (!isInterruptionRequested()) {
+            if (!m_device->waitForVsync()) {
+                qErrnoWarning(errno, "Waiting for vsync failed");
+                return;
+            }
+            m_device->flipPending();
+            emit vsync(FrameTiming::monotonicUs());
+        }
+    }
+
+private:
+    Device *m_device;
+};
+
 class FbRenderer : public QObject
 {
 public:
@@ -114,60 +495,140 @@ public:
 
 private:
     void update();
+    void updateBenchmark();
 
     Device *m_device;
-    QTimer m_timer;
-    int m_r = 0, m_g = 0, m_b = 0;
+    Benchmark *m_benchmark = nullptr;
+    QTimer m_timer; // benchmarks only
+    FrameScheduler m_scheduler;
+    VsyncThread *m_vsyncThread = nullptr;
+    DemoScene m_scene;
+    bool m_firstFrame = true;
 };
 
 FbRenderer::FbRenderer()
 {
-    m_device = new Device;
-    if (!m_device->open()) {
-        qWarning("Failed to open framebuffer device");
+    // DRMFBTEST_HEADLESS draws into memory instead of the device
+    const bool headless = HeadlessDisplay::isRequested();
+    if (Benchmark::isRequested())
+        m_benchmark = new Benchmark(headless ? "legacy_fb-headless" : "legacy_fb");
+
+    // DRMFBTEST_PANNING=1 double buffers by panning. Benchmarks measure
+    // drawing and do not flip.
+    const bool panning = !m_benchmark && qEnvironmentVariableIntValue("DRMFBTEST_PANNING");
+    // DRMFBTEST_FBDEV picks another fbdev device than /dev/fb0.
+    const QByteArray path = qgetenv("DRMFBTEST_FBDEV");
+    m_device = new Device(headless ? QString() : path.isEmpty() ? QStringLiteral("/dev/fb0") : QString::fromLocal8Bit(path));
+    if (!m_device->open(panning, DisplayBackend::isScrollRequested())) {
+        qWarning(headless ? "No headless output" : "Failed to open framebuffer device");
+        // nothing to show is a failure, also for the scripts running this
+        QTimer::singleShot(0, QCoreApplication::instance(), [] { QCoreApplication::exit(1); });
         return;
     }
+    if (m_benchmark)
+        m_benchmark->setFormat(*m_device->fb.format);
 
-    m_timer.setInterval(16);
-    m_timer.setSingleShot(false);
-    connect(&m_timer, &QTimer::timeout, this, &FbRenderer::update);
-    m_timer.start();
+    // Benchmarks run as fast as they can.
+    if (m_benchmark) {
+        m_timer.setInterval(0);
+        m_timer.setSingleShot(false);
+        connect(&m_timer, &QTimer::timeout, this, &FbRenderer::updateBenchmark);
+        m_timer.start();
+        return;
+    }
+
+    // Otherwise once per refresh, timed to finish just before the vsync.
+    m_scheduler.setRefreshPeriod(m_device->refreshPeriodUs);
+    connect(&m_scheduler, &FrameScheduler::frameDue, this, &FbRenderer::update);
+    if (m_device->waitForVsync()) {
+        m_scheduler.vblank(FrameTiming::monotonicUs());
+        m_vsyncThread = new VsyncThread(m_device);
+        connect(m_vsyncThread, &VsyncThread::vsync, this, [this](qint64 timestampUs) {
+            m_scheduler.vblank(timestampUs);
+            m_scheduler.requestFrame();
+        });
+        // should the driver stop cooperating
+        connect(m_vsyncThread, &QThread::finished, &m_scheduler, &FrameScheduler::requestFrame);
+        m_vsyncThread->start();
+    } else {
+        qDebug("No FBIO_WAITFORVSYNC, pacing by the mode alone");
+    }
+    m_scheduler.requestFrame();
 }
 
 FbRenderer::~FbRenderer()
 {
+    if (m_vsyncThread) {
+        // returns within a frame
+        m_vsyncThread->requestInterruption();
+        m_vsyncThread->wait();
+        delete m_vsyncThread;
+    }
     if (m_device) {
         qDebug("Closing down");
         m_device->close();
         delete m_device;
     }
+    delete m_benchmark;
 }
 
 void FbRenderer::update()
 {
     if (m_device->fb.p == MAP_FAILED)
         return;
+    // Should the vsync thread have given up with a flip queued, flip
+    // unsynchronized.
+    if (m_device->isFlipPending() && (!m_vsyncThread || m_vsyncThread->isFinished()))
+        m_device->flipPending();
+
+    // Otherwise a queued flip takes both buffers, this frame is dropped and
+    // the next vsync asks again. Scrolling comes before the surface, it can
+    // move the window.
+    Surface surface;
+    if (!m_device->isFlipPending()) {
+        m_scheduler.renderStarted();
+        QRegion damage = m_scene.advance(0, m_device->outputSize(0), m_device);
+        if (m_device->beginFrame(0, &surface)) {
+            // whatever was on the screen before
+            if (m_firstFrame)
+                damage = QRect(QPoint(0, 0), surface.size);
+            m_firstFrame = false;
+            m_scene.paint(0, surface, damage + surface.behind);
+            m_device->endFrame(0, damage);
+            m_scheduler.renderFinished();
+        }
+    }
+
+    // with the thread the next vsync asks for the next frame
+    if (!m_vsyncThread || m_vsyncThread->isFinished())
+        m_scheduler.requestFrame();
+}
 
-    for (int y = 0; y < m_device->fb.geom.height(); ++y) {
-        quint32 *ip = reinterpret_cast<quint32 *>(m_device->screenStart() + y * m_device->fb.pitch);
-        for (int x = 0; x < m_device->fb.geom.width(); ++x)
-            *ip++ = (m_r << 16) | (m_g << 8) | (m_b);
+void FbRenderer::updateBenchmark()
+{
+    if (!m_benchmark->renderFrame(m_device)) {
+        m_timer.stop();
+        QCoreApplication::quit();
     }
-    m_r += 1;
-    m_g += 2;
-    m_b += 3;
 }
 
 int main(int argc, char **argv)
 {
-    qputenv("QT_QPA_PLATFORM", "linuxfb:nographicsmodeswitch"); // something whose init won't interfere with us
+    // something whose init won't interfere with us, and needs no device at
+    // all when there is none
+    qputenv("QT_QPA_PLATFORM", HeadlessDisplay::isRequested() ? "offscreen" : "linuxfb:nographicsmodeswitch");
     qputenv("QT_LOGGING_RULES", "qt.qpa.*=true");
     QGuiApplication app(argc, argv);
 
     FbRenderer r;
 
-    const int t = 10;
-    qDebug("Running for %d seconds", t);
-    QTimer::singleShot(t * 1000, &app, &QCoreApplication::quit);
+    // benchmarks quit when they are done
+    if (!Benchmark::isRequested()) {
+        const int t = 10;
+        qDebug("Running for %d seconds", t);
+        QTimer::singleShot(t * 1000, &app, &QCoreApplication::quit);
+    }
     return app.exec();
 }
+
+#include "main.moc"
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs the benchmark workloads through every back end that was built and
+# prints one JSON object per back end, output and workload on stdout.
+#
+# usage: run-benchmarks.sh [build dir] [workloads]
+#
+# The build dir defaults to the source tree (in-source qmake builds), the
+# workloads to all of them (see DRMFBTEST_BENCHMARK in common/benchmark.h).
+# The log of each run goes to benchmark-<backend>.log in the current directory.
+# With DRMFBTEST_HEADLESS set the back ends run without a device, see
+# common/headlessdisplay.h.
+
+build=${1:-$(dirname "$0")}
+export DRMFBTEST_BENCHMARK=${2:-all}
+
+for backend in legacy_fb/legacy_fb singlebuffer/drmfbtest doublebuffer/drmfbtest; do
+    if [ ! -x "$build/$backend" ]; then
+        echo "Skipping $backend, not built" >&2
+        continue
+    fi
+    "$build/$backend" 2> "benchmark-${backend%%/*}.log" || echo "$backend failed, see benchmark-${backend%%/*}.log" >&2
+done
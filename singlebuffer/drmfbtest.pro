@@ -2,3 +2,4 @@ QT += core-private kms_support-private
 
 SOURCES = main.cpp
 
+include(../common/common.pri)
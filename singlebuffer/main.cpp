@@ -1,13 +1,33 @@
 #include <QGuiApplication>
 #include <QTimer>
+#include <QRegion>
+#include <QSocketNotifier>
+#include <QScopedPointer>
 #include <QtKmsSupport/private/qkmsdevice_p.h>
 #include <QtCore/private/qcore_unix_p.h>
 #include <sys/mman.h>
+#include "pixelformat.h"
+#include "benchmark.h"
+#include "shadowbuffer.h"
+#include "framescheduler.h"
+#include "frametiming.h"
+#include "dumbbufferpool.h"
+#include "displaybackend.h"
+#include "demoscene.h"
+#include "scrollwindow.h"
+#include "drmdevices.h"
+#include "damagetracker.h"
+#include "tilescheduler.h"
+#include "headlessdisplay.h"
+#include <drm_fourcc.h>
+#include <functional>
 
-class Device : public QKmsDevice
+class Device : public QKmsDevice, public DisplayBackend
 {
 public:
-    Device(QKmsScreenConfig *screenConfig);
+    // An empty path opens the DRMFBTEST_HEADLESS outputs instead, which
+    // are there right away, without createScreens().
+    Device(QKmsScreenConfig *screenConfig, const QString &path);
     bool open() override;
     void close() override;
     void *nativeDisplay() const override;
@@ -20,30 +40,84 @@ public:
     void createFramebuffers();
     void destroyFramebuffers();
 
-    struct Framebuffer {
-        Framebuffer() : handle(0), pitch(0), size(0), fb(0), p(MAP_FAILED) { }
-        uint32_t handle;
-        uint32_t pitch;
-        uint64_t size;
-        uint32_t fb;
-        void *p;
-    };
+    // DisplayBackend, straight into the front buffer
+    int outputCount() const override { return m_outputs.count(); }
+    QString outputName(int output) const override { return m_outputs[output].kmsOutput.name; }
+    QSize outputSize(int output) const override { return m_outputs[output].size(); }
+    bool beginFrame(int output, Surface *surface) override;
+    void endFrame(int output, const QRegion &damage) override;
+    bool scroll(int output, int dy) override;
+
+    struct Output;
+    void addDamage(Output *output, const QRect &rect);
+    void flush(Output *output);
+
+    // Asks for an event at the next vblank of the output at index, which
+    // calls back onVblank from handleEvents(). False when the driver has no
+    // vblank events.
+    bool requestVblank(int index);
+    void handleEvents();
+    // what to watch for the events
+    int eventFd() const { return m_headless ? m_headless->fd() : fd(); }
+    std::function<void(int index, qint64 timestampUs)> onVblank;
+    bool isHeadless() const { return m_headless != nullptr; }
+
+    typedef DumbBuffer Framebuffer;
 
     struct Output {
+        QSize size() const {
+            const drmModeModeInfo &modeInfo(kmsOutput.modes[kmsOutput.mode]);
+            return QSize(modeInfo.hdisplay, modeInfo.vdisplay);
+        }
+        // the visible part of fb
+        uchar *front() const { return static_cast<uchar *>(fb.p) + size_t(window.offset()) * fb.pitch; }
+        // where to draw, the shadow buffer when there is one
+        void *bits() const { return shadow.isNull() ? front() : shadow.bits(); }
+        int pitch() const { return shadow.isNull() ? int(fb.pitch) : shadow.pitch(); }
         QKmsOutput kmsOutput;
         Framebuffer fb;
+        ShadowBuffer shadow;
+        DamageTracker damageTracker; // DRMFBTEST_AUTO_DAMAGE
+        QRegion damage; // not yet reported to the kernel
+        // With DRMFBTEST_SCROLL fb is twice the height of the mode and the
+        // CRTC scans out from window.offset().
+        ScrollWindow window;
+        bool windowMoved = false;
+        bool shadowMoved = false; // without a window, all of it goes out
+        QRegion exposed; // scrolled in, still to be painted
     };
 
     QVector<Output> m_outputs;
+    bool m_hasDirtyFb = true;
+    bool m_useShadow = false;
+    const PixelFormat *m_format;
+    DumbBufferPool m_pool;
+    TileScheduler *m_hashPool = nullptr; // for the damage trackers
+    HeadlessDisplay *m_headless = nullptr; // in place of the device
+
+private:
+    bool openHeadless();
+
+    struct VblankRequest {
+        Device *device;
+        int index;
+    };
+    static void vblankHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+                              void *user_data);
+    QVector<VblankRequest> m_vblankRequests; // what the events point to, one per output
 };
 
-Device::Device(QKmsScreenConfig *screenConfig)
-    : QKmsDevice(screenConfig, QStringLiteral("/dev/dri/card0"))
+Device::Device(QKmsScreenConfig *screenConfig, const QString &path)
+    : QKmsDevice(screenConfig, path),
+      m_useShadow(ShadowBuffer::isRequested() || DamageTracker::isRequested()),
+      m_format(&PixelFormat::requested())
 {
 }
 
 bool Device::open()
 {
+    if (devicePath().isEmpty())
+        return openHeadless();
     int fd = qt_safe_open(devicePath().toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
     if (fd == -1) {
         qErrnoWarning("Could not open DRM device %s", qPrintable(devicePath()));
@@ -56,6 +130,30 @@ bool Device::open()
         return false;
     }
     setFd(fd);
+    m_pool.setFd(fd);
+    if (DamageTracker::isRequested()) {
+        m_hashPool = new TileScheduler;
+        qDebug("Detecting damage in tiles of %dx%d", DamageTracker::TileSize, DamageTracker::TileSize);
+    }
+    return true;
+}
+
+// Buffers in memory and a simulated vblank, the rest is as with a device.
+// Nothing copies out of the front buffer, so there is no DirtyFB.
+bool Device::openHeadless()
+{
+    QScopedPointer<HeadlessDisplay> display(new HeadlessDisplay);
+    if (display->outputs().isEmpty() || display->fd() == -1)
+        return false;
+    m_headless = display.take();
+    m_pool.setHeadless(true);
+    m_hasDirtyFb = false;
+    for (int i = 0; i < m_headless->outputs().count(); ++i)
+        createScreen(m_headless->kmsOutput(i));
+    if (DamageTracker::isRequested()) {
+        m_hashPool = new TileScheduler;
+        qDebug("Detecting damage in tiles of %dx%d", DamageTracker::TileSize, DamageTracker::TileSize);
+    }
     return true;
 }
 
@@ -66,6 +164,15 @@ void Device::close()
 
     m_outputs.clear();
 
+    // nothing is on screen anymore
+    m_pool.dumpStats();
+    m_pool.clear();
+    delete m_hashPool;
+    m_hashPool = nullptr;
+    delete m_headless;
+    m_headless = nullptr;
+    m_pool.setHeadless(false);
+
     if (fd() != -1) {
         qt_safe_close(fd());
         setFd(-1);
@@ -101,76 +208,234 @@ void Device::registerScreen(QPlatformScreen *screen,
 
 void Device::createFramebuffers()
 {
+    // All buffers before the first modeset. Without atomic there is no
+    // telling what the plane can scan out, the kernel refuses the FB if the
+    // driver cannot, and the fallback must not pull buffers from under
+    // outputs that are already on screen.
+    const bool tall = DisplayBackend::isScrollRequested();
+    for (Output &output : m_outputs) {
+        const QSize size = output.size();
+        if (m_pool.acquire(&output.fb, QSize(size.width(), tall ? 2 * size.height() : size.height()), m_format->fourcc))
+            continue;
+        if (m_format->id == PixelFormat::XRGB8888)
+            break; // the outputs that have buffers still come up
+        qWarning("No %s framebuffers, falling back to xrgb8888", m_format->name);
+        m_format = &PixelFormat::get(PixelFormat::XRGB8888);
+        for (Output &other : m_outputs)
+            m_pool.release(&other.fb);
+        createFramebuffers();
+        return;
+    }
+
     for (Output &output : m_outputs) {
+        if (!output.fb.fb)
+            continue;
         drmModeModeInfo &modeInfo(output.kmsOutput.modes[output.kmsOutput.mode]);
-        const uint32_t w = modeInfo.hdisplay;
-        const uint32_t h = modeInfo.vdisplay;
-        drm_mode_create_dumb creq = {
-            h,
-            w,
-            32,
-            0, 0, 0, 0
-        };
-        if (drmIoctl(fd(), DRM_IOCTL_MODE_CREATE_DUMB, &creq) == -1) {
-            qErrnoWarning(errno, "Failed to create dumb buffer");
-            return;
-        }
+        if (m_useShadow)
+            output.shadow.create(output.size(), *m_format);
+        if (tall)
+            output.window.reset(modeInfo.vdisplay);
 
-        output.fb.handle = creq.handle;
-        output.fb.pitch = creq.pitch;
-        output.fb.size = creq.size;
-        qDebug("Got a dumb buffer for size %dx%d, handle %u, pitch %u, size %lu", w, h,
-               output.fb.handle, output.fb.pitch, output.fb.size);
+        if (!m_headless) {
+            if (drmModeSetCrtc(fd(), output.kmsOutput.crtc_id, output.fb.fb, 0, 0,
+                               &output.kmsOutput.connector_id, 1, &modeInfo) == -1) {
+                qErrnoWarning(errno, "Failed to set mode");
+                return;
+            }
 
-        if (drmModeAddFB(fd(), w, h, 24, 32, output.fb.pitch, output.fb.handle, &output.fb.fb) == -1) {
-            qErrnoWarning(errno, "Failed to add FB");
-            return;
+            output.kmsOutput.mode_set = true; // have cleanup() to restore the mode
+            output.kmsOutput.setPowerState(this, QPlatformScreen::PowerStateOn);
         }
 
-        drm_mode_map_dumb mreq = {
-            output.fb.handle,
-            0, 0
-        };
-        if (drmIoctl(fd(), DRM_IOCTL_MODE_MAP_DUMB, &mreq) == -1) {
-            qErrnoWarning(errno, "Failed to map dumb buffer");
-            return;
+        output.damage = QRect(QPoint(0, 0), output.size());
+    }
+}
+
+void Device::destroyFramebuffers()
+{
+    for (Output &output : m_outputs) {
+        m_pool.release(&output.fb);
+        output.shadow.destroy();
+    }
+}
+
+void Device::addDamage(Output *output, const QRect &rect)
+{
+    output->damage += rect.intersected(QRect(QPoint(0, 0), output->size()));
+}
+
+void Device::flush(Output *output)
+{
+    if (output->shadowMoved) {
+        output->damage = QRect(QPoint(0, 0), output->size());
+        output->shadowMoved = false;
+    }
+    if (output->damage.isEmpty() && !output->windowMoved)
+        return;
+
+    output->shadow.flush(output->front(), output->fb.pitch, output->damage);
+
+    if (output->windowMoved) {
+        // Same mode, same FB, only the source offset changes, which atomic
+        // drivers do as a plane update without a modeset.
+        if (!m_headless && drmModeSetCrtc(fd(), output->kmsOutput.crtc_id, output->fb.fb, 0, output->window.offset(),
+                           &output->kmsOutput.connector_id, 1,
+                           &output->kmsOutput.modes[output->kmsOutput.mode]) == -1)
+            qErrnoWarning(errno, "Failed to scroll %s", qPrintable(output->kmsOutput.name));
+        output->windowMoved = false;
+        // drivers that copy have to take all of it
+        output->damage = QRect(QPoint(0, 0), output->size());
+    }
+
+    // Drivers that scan out from a copy (USB, virtual GPUs) need to be told
+    // what changed since we render straight into the front buffer.
+    if (m_hasDirtyFb) {
+        // in FB coordinates
+        const QRegion damage = output->damage.translated(0, output->window.offset());
+        QVector<drmModeClip> clips;
+        if (damage.rectCount() > 256) { // DRM_MODE_FB_DIRTY_MAX_CLIPS
+            const QRect r = damage.boundingRect();
+            clips.append(drmModeClip { ushort(r.x()), ushort(r.y()),
+                                       ushort(r.x() + r.width()), ushort(r.y() + r.height()) });
+        } else {
+            for (const QRect &r : damage)
+                clips.append(drmModeClip { ushort(r.x()), ushort(r.y()),
+                                           ushort(r.x() + r.width()), ushort(r.y() + r.height()) });
         }
-        output.fb.p = mmap(0, output.fb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd(), mreq.offset);
-        if (output.fb.p == MAP_FAILED) {
-            qErrnoWarning(errno, "Failed to mmap dumb buffer");
-            return;
+        const int ret = drmModeDirtyFB(fd(), output->fb.fb, clips.data(), clips.count());
+        if (ret == -ENOSYS) {
+            qDebug("DirtyFB not supported, not reporting damage");
+            m_hasDirtyFb = false;
+        } else if (ret < 0) {
+            qErrnoWarning(-ret, "Failed to report damage for FB %u", output->fb.fb);
         }
+    }
 
-        qDebug("FB is %u, mapped at %p", output.fb.fb, output.fb.p);
-        memset(output.fb.p, 0, output.fb.size);
+    output->damage = QRegion();
+}
 
-        if (drmModeSetCrtc(fd(), output.kmsOutput.crtc_id, output.fb.fb, 0, 0,
-                           &output.kmsOutput.connector_id, 1, &modeInfo) == -1) {
-            qErrnoWarning(errno, "Failed to set mode");
-            return;
-        }
+bool Device::beginFrame(int output, Surface *surface)
+{
+    const Output &o(m_outputs[output]);
+    if (o.fb.p == MAP_FAILED)
+        return false;
+    surface->bits = o.bits();
+    surface->pitch = o.pitch();
+    surface->size = o.size();
+    surface->format = m_format;
+    surface->behind = o.exposed;
+    return true;
+}
+
+void Device::endFrame(int output, const QRegion &damage)
+{
+    Output &o(m_outputs[output]);
+    // Clients that cannot tell report everything, the tracker finds out
+    // what actually changed.
+    QRegion changed = damage + o.exposed;
+    if (m_hashPool)
+        changed = o.damageTracker.detect(o.shadow, QRect(QPoint(0, 0), o.size()), m_hashPool) + o.exposed;
+    for (const QRect &rect : changed)
+        addDamage(&o, rect);
+    o.exposed = QRegion();
+    flush(&o);
+}
+
+bool Device::scroll(int output, int dy)
+{
+    Output &o(m_outputs[output]);
+    const QSize size = o.size();
+    if (o.fb.p == MAP_FAILED || !dy || qAbs(dy) >= size.height())
+        return false;
+    if (o.window.isNull() && o.shadow.isNull())
+        return false; // moving the front buffer in place would tear
+
+    // The shadow, if any, is what is drawn into and moves in any case. Its
+    // unflushed damage moves along, and lands where the window is next.
+    const QRect bounds(QPoint(0, 0), size);
+    const QRect exposed = dy > 0 ? QRect(0, size.height() - dy, size.width(), dy)
+                                 : QRect(0, 0, size.width(), -dy);
+    o.shadow.scroll(dy);
+    // The screen moves with the shadow, the hashes do not.
+    o.damageTracker.invalidate();
+    o.damage = o.damage.translated(0, -dy).intersected(bounds);
+    o.exposed = o.exposed.translated(0, -dy).intersected(bounds) + exposed;
+
+    if (o.window.isNull()) {
+        o.shadowMoved = true;
+        return true;
+    }
 
-        output.kmsOutput.mode_set = true; // have cleanup() to restore the mode
-        output.kmsOutput.setPowerState(this, QPlatformScreen::PowerStateOn);
+    const ScrollWindow::Move move = o.window.scroll(dy);
+    if (move.rows) {
+        // The window starts over at the other end of the buffer, the rows
+        // that stay are not on screen there yet. From the shadow when there
+        // is one, it is cached and up to date; otherwise a read back from
+        // the mapping, once per screenful.
+        uchar *fb = static_cast<uchar *>(o.fb.p);
+        if (!o.shadow.isNull())
+            o.shadow.flush(o.front(), o.fb.pitch, QRect(0, qMax(-dy, 0), size.width(), move.rows));
+        else
+            memmove(fb + size_t(move.to) * o.fb.pitch, fb + size_t(move.from) * o.fb.pitch,
+                    size_t(move.rows) * o.fb.pitch);
     }
+    o.windowMoved = true;
+    return true;
 }
 
-void Device::destroyFramebuffers()
+bool Device::requestVblank(int index)
 {
-    for (Output &output : m_outputs) {
-        if (output.fb.p != MAP_FAILED)
-            munmap(output.fb.p, output.fb.size);
-        if (output.fb.fb) {
-            if (drmModeRmFB(fd(), output.fb.fb) == -1)
-                qErrnoWarning("Failed to remove fb");
-        }
-        if (output.fb.handle) {
-            drm_mode_destroy_dumb dreq = { output.fb.handle };
-            if (drmIoctl(fd(), DRM_IOCTL_MODE_DESTROY_DUMB, &dreq) == -1)
-                qErrnoWarning(errno, "Failed to destroy dumb buffer %u", output.fb.handle);
-        }
-        output.fb = Framebuffer();
+    if (m_headless) {
+        m_headless->requestVblank(index);
+        return true;
+    }
+    // Outputs do not come and go here, so the pointers stay valid.
+    if (m_vblankRequests.count() != m_outputs.count()) {
+        m_vblankRequests.resize(m_outputs.count());
+        for (int i = 0; i < m_vblankRequests.count(); ++i)
+            m_vblankRequests[i] = VblankRequest { this, i };
+    }
+    drmVBlank vbl;
+    memset(&vbl, 0, sizeof(vbl));
+    const uint32_t crtcSelect = (m_outputs[index].kmsOutput.crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT)
+            & DRM_VBLANK_HIGH_CRTC_MASK;
+    vbl.request.type = drmVBlankSeqType(DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT | crtcSelect);
+    vbl.request.sequence = 1;
+    vbl.request.signal = reinterpret_cast<unsigned long>(&m_vblankRequests[index]);
+    if (drmWaitVBlank(fd(), &vbl) != 0) {
+        qErrnoWarning(errno, "No vblank events for %s, pacing by the mode alone",
+                      qPrintable(m_outputs[index].kmsOutput.name));
+        return false;
+    }
+    return true;
+}
+
+void Device::vblankHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+                           void *user_data)
+{
+    Q_UNUSED(fd);
+    Q_UNUSED(sequence);
+    const VblankRequest *request = static_cast<const VblankRequest *>(user_data);
+    if (request->device->onVblank)
+        request->device->onVblank(request->index, qint64(tv_sec) * 1000000 + tv_usec);
+}
+
+void Device::handleEvents()
+{
+    if (m_headless) {
+        m_headless->dispatch([this](int index, unsigned int sequence, qint64 timestampUs) {
+            Q_UNUSED(sequence);
+            if (onVblank)
+                onVblank(index, timestampUs);
+        });
+        return;
     }
+    drmEventContext drmEvent;
+    memset(&drmEvent, 0, sizeof(drmEvent));
+    drmEvent.version = 2;
+    drmEvent.vblank_handler = vblankHandler;
+    if (drmHandleEvent(fd(), &drmEvent) != 0)
+        qErrnoWarning(errno, "Failed to handle DRM events");
 }
 
 class DumbBufferRenderer : public QObject
@@ -180,30 +445,78 @@ public:
     ~DumbBufferRenderer();
 
 private:
-    void update();
+    void renderOutput(int index);
+    void updateBenchmark();
 
     QKmsScreenConfig m_screenConfig;
-    Device *m_device;
-    QTimer m_timer;
-    int m_r = 0, m_g = 0, m_b = 0;
+    Device *m_device = nullptr;
+    Benchmark *m_benchmark = nullptr;
+    QTimer m_timer; // benchmarks only
+    QSocketNotifier *m_notifier = nullptr;
+    QVector<FrameScheduler *> m_schedulers; // per output
+    DemoScene m_scene;
+    bool m_hasVblankEvents = true;
 };
 
 DumbBufferRenderer::DumbBufferRenderer()
 {
-    m_device = new Device(&m_screenConfig);
+    // DRMFBTEST_HEADLESS draws into memory instead of the device
+    const bool headless = HeadlessDisplay::isRequested();
+    if (Benchmark::isRequested())
+        m_benchmark = new Benchmark(headless ? "singlebuffer-headless" : "singlebuffer");
+
+    // Nothing to show is a failure, also for the scripts running this.
+    const auto fail = [] { QTimer::singleShot(0, QCoreApplication::instance(), [] { QCoreApplication::exit(1); }); };
+    // One card only, doublebuffer drives several.
+    const QStringList devices = headless ? QStringList { QString() } : requestedDrmDevices();
+    if (devices.isEmpty()) {
+        fail();
+        return;
+    }
+    if (devices.count() > 1)
+        qWarning("Using only %s", qPrintable(devices.first()));
+    m_device = new Device(&m_screenConfig, devices.first());
     if (!m_device->open()) {
-        qWarning("Failed to open DRM device");
+        qWarning(headless ? "No headless outputs" : "Failed to open DRM device");
+        fail();
         return;
     }
     // Discover outputs. Calls back Device::createScreen().
-    m_device->createScreens();
+    if (!m_device->isHeadless())
+        m_device->createScreens();
     // Now off to dumb buffer specifics.
     m_device->createFramebuffers();
+    if (m_benchmark)
+        m_benchmark->setFormat(*m_device->m_format);
+
+    // Benchmarks run as fast as they can.
+    if (m_benchmark) {
+        m_timer.setInterval(0);
+        m_timer.setSingleShot(false);
+        connect(&m_timer, &QTimer::timeout, this, &DumbBufferRenderer::updateBenchmark);
+        m_timer.start();
+        return;
+    }
 
-    m_timer.setInterval(16);
-    m_timer.setSingleShot(false);
-    connect(&m_timer, &QTimer::timeout, this, &DumbBufferRenderer::update);
-    m_timer.start();
+    // Otherwise every output renders once per refresh, timed to finish just
+    // before its vblank.
+    m_notifier = new QSocketNotifier(m_device->eventFd(), QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, [this] { m_device->handleEvents(); });
+    m_device->onVblank = [this](int index, qint64 timestampUs) {
+        m_schedulers[index]->vblank(timestampUs);
+        m_schedulers[index]->requestFrame();
+    };
+    for (int i = 0; i < m_device->m_outputs.count(); ++i) {
+        const Device::Output &output(m_device->m_outputs[i]);
+        FrameScheduler *scheduler = new FrameScheduler(this);
+        scheduler->setRefreshPeriod(FrameScheduler::refreshPeriodUs(output.kmsOutput.modes[output.kmsOutput.mode]));
+        connect(scheduler, &FrameScheduler::frameDue, this, [this, i] { renderOutput(i); });
+        m_schedulers.append(scheduler);
+        if (!m_hasVblankEvents || !m_device->requestVblank(i)) {
+            m_hasVblankEvents = false;
+            scheduler->requestFrame();
+        }
+    }
 }
 
 DumbBufferRenderer::~DumbBufferRenderer()
@@ -214,32 +527,57 @@ DumbBufferRenderer::~DumbBufferRenderer()
         m_device->close();
         delete m_device;
     }
+    delete m_benchmark;
 }
 
-void DumbBufferRenderer::update()
+void DumbBufferRenderer::renderOutput(int index)
 {
-    for (Device::Output &output : m_device->m_outputs) {
-        if (output.fb.p == MAP_FAILED)
-            continue;
-        quint32 *ip = static_cast<quint32 *>(output.fb.p);
-        for (size_t i = 0; i < output.fb.size / 4; ++i)
-            *ip++ = (m_r << 16) | (m_g << 8) | (m_b);
-        m_r += 1;
-        m_g += 2;
-        m_b += 3;
+    FrameScheduler *scheduler = m_schedulers[index];
+    scheduler->renderStarted();
+    // With a single buffer only what changed since the last frame has to be
+    // touched, the rest of the front buffer is still valid. The first frame
+    // also has the whole screen from the modeset. Scrolling happens before
+    // the surface is handed out, it can move the window.
+    QRegion damage = m_scene.advance(index, m_device->outputSize(index), m_device);
+    Surface surface;
+    if (m_device->beginFrame(index, &surface)) {
+        damage += m_device->m_outputs[index].damage;
+        m_scene.paint(index, surface, damage + surface.behind);
+        m_device->endFrame(index, damage);
+        scheduler->renderFinished();
+    }
+
+    // The vblank event corrects the prediction before the next frame is
+    // timed. Without events it goes by the mode.
+    if (!m_hasVblankEvents || !m_device->requestVblank(index)) {
+        m_hasVblankEvents = false;
+        scheduler->requestFrame();
+    }
+}
+
+void DumbBufferRenderer::updateBenchmark()
+{
+    if (!m_benchmark->renderFrame(m_device)) {
+        m_timer.stop();
+        QCoreApplication::quit();
     }
 }
 
 int main(int argc, char **argv)
 {
-    qputenv("QT_QPA_PLATFORM", "linuxfb:nographicsmodeswitch"); // something whose init won't interfere with us
+    // something whose init won't interfere with us, and needs no device at
+    // all when there is none
+    qputenv("QT_QPA_PLATFORM", HeadlessDisplay::isRequested() ? "offscreen" : "linuxfb:nographicsmodeswitch");
     qputenv("QT_LOGGING_RULES", "qt.qpa.*=true");
     QGuiApplication app(argc, argv);
 
     DumbBufferRenderer r;
 
-    const int t = 10;
-    qDebug("Running for %d seconds", t);
-    QTimer::singleShot(t * 1000, &app, &QCoreApplication::quit);
+    // benchmarks quit when they are done
+    if (!Benchmark::isRequested()) {
+        const int t = 10;
+        qDebug("Running for %d seconds", t);
+        QTimer::singleShot(t * 1000, &app, &QCoreApplication::quit);
+    }
     return app.exec();
 }